@@ -0,0 +1,917 @@
+/*
+	Copyright (c) 2021 Julian Cahill <cahill.julian@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgment in the product documentation would be
+	   appreciated but is not required.
+	2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+	3. This notice may not be removed or altered from any source distribution.
+*/
+
+/*
+	Throughput benchmark over a synthetic corpus. The corpus is generated
+	from a fixed seed, so every run and every version of the library parses
+	the same bytes.
+
+		sh compile_bench.sh && ./bench          # table
+		./bench -t > bench_output.txt           # tab separated, for diffing
+
+	For each document kind it reports MB/s, documents/s and ns per node,
+	plus allocations per document and the peak heap use of one document,
+	for these operations:
+
+		parse     bencode_parse() onto the heap
+		lookup    read the fields a consumer of the document would
+		encode    bencode_encode() of the parsed tree
+		free      bencode_free() of the parsed tree
+		schema    the parser generated from krpc.schema or metainfo.schema
+		          (torrents and KRPC only; compare with parse + lookup)
+		borrow    parse with BENCODE_OPT_BORROW
+		padded    parse with BENCODE_OPT_PADDED
+		lazy      parse with BENCODE_OPT_LAZY, then the lookup
+		arena     bencode_parse_arena() and an arena reset
+		context   bencode_parse_context() and bencode_reset()
+		validate  bencode_validate()
+
+	Allocations and peak bytes are counted in untimed passes, through an
+	allocator installed with bencode_set_allocator(). The figures come from
+	the second pass, so arena and context show their warmed-up state. The
+	timed passes run with no allocator installed, on plain malloc.
+
+	A second table compares the struct bencode tree with the compact node
+	layout: heap bytes per node with every document of the corpus parsed,
+	and the time to visit every node, key, integer and string length.
+
+	A third table times dict lookups by dict size: bencode_getsn(), and
+	bencode_dict_index_gets() together with the cost of building the index.
+
+	bench_threads, the same file built with BENCODE_THREADS, instead times
+	bencode_parse_batch() over the KRPC messages and bencode_parse_parallel()
+	over one large list, on 1 to N threads (default: one per online CPU):
+
+		./bench_threads [-t] [N]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCODE_IMPLEMENTATION
+#include "bencode.h"
+#include "krpc.h"
+#include "metainfo.h"
+
+/*
+	The corpus
+*/
+
+static uint64_t bench_seed = 0x9e3779b97f4a7c15;
+
+static uint64_t bench_random() { // xorshift64
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 7;
+	bench_seed ^= bench_seed << 17;
+	return bench_seed;
+}
+
+struct bench_buffer {
+	char *data;
+	size_t length;
+	size_t capacity;
+};
+
+static void bench_reserve(struct bench_buffer *buf, size_t extra) {
+	if(buf->length + extra <= buf->capacity) return;
+	while(buf->length + extra > buf->capacity) buf->capacity = buf->capacity ? buf->capacity * 2 : 4096;
+	buf->data = realloc(buf->data, buf->capacity);
+	if(buf->data == NULL) abort();
+}
+
+static void bench_printf(struct bench_buffer *buf, const char *format, long long a, long long b) {
+	bench_reserve(buf, 128);
+	buf->length += sprintf(buf->data + buf->length, format, a, b);
+}
+
+// Appends "<length>:<bytes>" with pseudo-random (or filler) payload.
+static void bench_bytes(struct bench_buffer *buf, size_t length, int random) {
+	bench_printf(buf, "%lld:", (long long) length, 0);
+	bench_reserve(buf, length);
+	for(size_t i = 0; i < length; i++)
+		buf->data[buf->length + i] = random ? (char) bench_random() : (char) ('a' + i % 26);
+	buf->length += length;
+}
+
+static void bench_key(struct bench_buffer *buf, const char *key) {
+	size_t n = strlen(key);
+	bench_printf(buf, "%lld:", (long long) n, 0);
+	bench_reserve(buf, n);
+	memcpy(buf->data + buf->length, key, n);
+	buf->length += n;
+}
+
+static void bench_int(struct bench_buffer *buf, long long value) {
+	bench_printf(buf, "i%llde", value, 0);
+}
+
+static void bench_char(struct bench_buffer *buf, char c) {
+	bench_reserve(buf, 1);
+	buf->data[buf->length++] = c;
+}
+
+static void bench_torrent(struct bench_buffer *buf, int files) {
+	size_t pieces = 2000 + bench_random() % 2000;
+
+	bench_char(buf, 'd');
+	bench_key(buf, "announce");
+	bench_key(buf, "udp://tracker.example.org:1337/announce");
+	bench_key(buf, "comment");
+	bench_key(buf, "synthetic benchmark torrent");
+	bench_key(buf, "creation date");
+	bench_int(buf, 1600000000 + (long long) (bench_random() % 100000000));
+	bench_key(buf, "info");
+	bench_char(buf, 'd');
+
+	if(files) {
+		bench_key(buf, "files");
+		bench_char(buf, 'l');
+		for(int i = 0; i < files; i++) {
+			bench_char(buf, 'd');
+			bench_key(buf, "length");
+			bench_int(buf, (long long) (bench_random() % 4000000000ULL));
+			bench_key(buf, "path");
+			bench_char(buf, 'l');
+			bench_key(buf, "disc 1");
+			bench_bytes(buf, 8 + bench_random() % 24, 0);
+			bench_char(buf, 'e');
+			bench_char(buf, 'e');
+		}
+		bench_char(buf, 'e');
+	} else {
+		bench_key(buf, "length");
+		bench_int(buf, (long long) (bench_random() % 4000000000ULL));
+	}
+
+	bench_key(buf, "name");
+	bench_key(buf, "synthetic-release");
+	bench_key(buf, "piece length");
+	bench_int(buf, 262144);
+	bench_key(buf, "pieces");
+	bench_bytes(buf, pieces * 20, 1);
+	bench_char(buf, 'e');
+	bench_char(buf, 'e');
+}
+
+static void bench_krpc_query(struct bench_buffer *buf) {
+	bench_char(buf, 'd');
+	bench_key(buf, "a");
+	bench_char(buf, 'd');
+	bench_key(buf, "id");
+	bench_bytes(buf, 20, 1);
+	bench_key(buf, "info_hash");
+	bench_bytes(buf, 20, 1);
+	bench_char(buf, 'e');
+	bench_key(buf, "q");
+	bench_key(buf, "get_peers");
+	bench_key(buf, "t");
+	bench_bytes(buf, 2, 1);
+	bench_key(buf, "y");
+	bench_key(buf, "q");
+	bench_char(buf, 'e');
+}
+
+static void bench_krpc_response(struct bench_buffer *buf) {
+	bench_char(buf, 'd');
+	bench_key(buf, "r");
+	bench_char(buf, 'd');
+	bench_key(buf, "id");
+	bench_bytes(buf, 20, 1);
+	bench_key(buf, "nodes");
+	bench_bytes(buf, 8 * 26, 1);
+	bench_key(buf, "token");
+	bench_bytes(buf, 8, 1);
+	bench_key(buf, "values");
+	bench_char(buf, 'l');
+	for(int i = 0; i < 8; i++) bench_bytes(buf, 6, 1);
+	bench_char(buf, 'e');
+	bench_char(buf, 'e');
+	bench_key(buf, "t");
+	bench_bytes(buf, 2, 1);
+	bench_key(buf, "y");
+	bench_key(buf, "r");
+	bench_char(buf, 'e');
+}
+
+static void bench_int_list(struct bench_buffer *buf, int count) {
+	bench_char(buf, 'l');
+	for(int i = 0; i < count; i++) {
+		uint64_t r = bench_random();
+		long long value = (long long) (r >> (r & 63)); // all magnitudes
+		bench_int(buf, (r & 64) ? -value / 2 : value / 2);
+	}
+	bench_char(buf, 'e');
+}
+
+static void bench_nested(struct bench_buffer *buf, int depth) {
+	for(int i = 0; i < depth; i++) {
+		if(i % 2) {
+			bench_char(buf, 'd');
+			bench_key(buf, "k");
+		} else {
+			bench_char(buf, 'l');
+			bench_int(buf, i);
+		}
+	}
+	bench_int(buf, depth);
+	for(int i = 0; i < depth; i++) bench_char(buf, 'e');
+}
+
+static void bench_large_bytes(struct bench_buffer *buf) {
+	bench_char(buf, 'l');
+	for(int i = 0; i < 4; i++) bench_bytes(buf, 1 << 20, 1);
+	bench_char(buf, 'e');
+}
+
+/*
+	Lookups: what a consumer of each kind of document reads.
+*/
+
+static int64_t bench_lookup_torrent(struct bencode *b) {
+	struct bencode *info = bencode_gets(b, "info");
+	int64_t sum = bencode_gets(info, "piece length")->i + bencode_gets(info, "name")->length;
+
+	struct bencode *files = bencode_gets(info, "files");
+	if(files == NULL) return sum + bencode_gets(info, "length")->i;
+	bencode_expand(files, NULL); // only does something for a lazy tree
+
+	for(struct bencode *file = files->list; file; file = file->next)
+		sum += bencode_gets(file, "length")->i;
+	return sum;
+}
+
+static int64_t bench_lookup_krpc(struct bencode *b) {
+	struct bencode *body = bencode_gets(b, "a");
+	if(body == NULL) body = bencode_gets(b, "r");
+	return (int64_t) (bencode_gets(body, "id")->length + bencode_gets(b, "y")->bytes[0] + bencode_gets(b, "t")->length);
+}
+
+static int64_t bench_lookup_list(struct bencode *b) {
+	int64_t sum = 0;
+	for(struct bencode *element = b->list; element; element = element->next)
+		sum += (element->type == BENCODE_INT) ? element->i : (int64_t) element->length;
+	return sum;
+}
+
+static int64_t bench_lookup_nested(struct bencode *b) {
+	while(b->type != BENCODE_INT) {
+		bencode_expand(b, NULL);
+		b = b->list;
+		if(b->next) b = b->next; // lists hold their index first
+	}
+	return b->i;
+}
+
+// The same reads through the generated parsers.
+static int64_t bench_schema_torrent(char *str, size_t length, struct bencode_parser *parser) {
+	struct metainfo torrent;
+	if(metainfo_parse(str, length, &torrent, parser) == NULL) return 0;
+
+	struct metainfo_info *info = &torrent.info;
+	int64_t sum = info->piece_length + info->name.length;
+	if(!(info->present & METAINFO_INFO_FILES)) return sum + info->length;
+
+	for(size_t i = 0; i < info->files_count; i++) sum += info->files[i].length;
+	return sum;
+}
+
+static int64_t bench_schema_krpc(char *str, size_t length, struct bencode_parser *parser) {
+	struct krpc_message msg;
+	if(krpc_message_parse(str, length, &msg, parser) == NULL) return 0;
+
+	size_t id = (msg.present & KRPC_MESSAGE_A) ? msg.a.id.length : msg.r.id.length;
+	return (int64_t) (id + msg.y.bytes[0] + msg.t.length);
+}
+
+struct bench_corpus {
+	const char *name;
+	int64_t (*lookup)(struct bencode *b);
+	int64_t (*schema)(char *str, size_t length, struct bencode_parser *parser); // or NULL
+	struct bench_buffer *docs;
+	size_t count;
+	size_t bytes;
+	size_t nodes; // per pass over all documents
+};
+
+static double bench_now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+#define BENCH_ROUNDS 5
+#define BENCH_PASS_BYTES (8 * 1024 * 1024) // documents parsed per timed pass
+
+static volatile uint64_t bench_sink; // keeps the results alive; unsigned, so it wraps
+
+#ifndef BENCODE_THREADS
+/*
+	Allocation counts come from an allocator installed with
+	bencode_set_allocator() for the untimed counting passes only, so the
+	timed passes run on plain malloc without any bookkeeping.
+*/
+static size_t bench_allocs;
+static size_t bench_live;
+static size_t bench_peak;
+
+#define BENCH_HEADER 16 // keeps the library's pointer 16-byte aligned
+
+static void* bench_malloc(void *ctx, size_t size) {
+	(void) ctx;
+	char *p = malloc(size + BENCH_HEADER);
+	if(p == NULL) return NULL;
+	*(size_t*) p = size;
+
+	bench_allocs++;
+	bench_live += size;
+	if(bench_live > bench_peak) bench_peak = bench_live;
+	return p + BENCH_HEADER;
+}
+
+static void* bench_realloc(void *ctx, void *ptr, size_t size) {
+	if(ptr == NULL) return bench_malloc(ctx, size);
+
+	char *p = realloc((char*) ptr - BENCH_HEADER, size + BENCH_HEADER);
+	if(p == NULL) return NULL;
+	bench_live = bench_live - *(size_t*) p + size;
+	*(size_t*) p = size;
+
+	bench_allocs++;
+	if(bench_live > bench_peak) bench_peak = bench_live;
+	return p + BENCH_HEADER;
+}
+
+static void bench_free(void *ctx, void *ptr) {
+	(void) ctx;
+	if(ptr == NULL) return;
+	char *p = (char*) ptr - BENCH_HEADER;
+	bench_live -= *(size_t*) p;
+	free(p);
+}
+
+static void bench_count_allocations(int on) {
+	static const struct bencode_allocator counting = { bench_malloc, bench_realloc, bench_free, NULL };
+	bencode_set_allocator(on ? &counting : NULL);
+}
+
+static size_t bench_count_nodes(struct bencode *b) {
+	size_t nodes = 1;
+	if(b->type == BENCODE_LIST || b->type == BENCODE_DICT)
+		for(struct bencode *child = b->list; child; child = child->next) nodes += bench_count_nodes(child);
+	return nodes;
+}
+
+/*
+	The timed operations. Each handles document i of the corpus and returns
+	what the counting pass checks: the bytes it consumed or wrote, or what
+	the corpus's lookup read. Trees an operation needs, or leaves behind,
+	are made and released by its setup and cleanup, outside the timing.
+*/
+struct bench_state {
+	struct bench_corpus *corpus;
+	struct bencode *trees;
+	struct bencode_arena arena;   // the arena mode and the generated parsers
+	struct bencode_parser parser; // parser.arena is `arena`
+	struct bencode_context ctx;
+	char *out;                    // encoder output
+	size_t out_size;
+};
+
+static int64_t bench_parsed(struct bench_state *state, size_t i, char *end) {
+	return end ? end - state->corpus->docs[i].data : -1;
+}
+
+static int64_t bench_op_parse_with(struct bench_state *state, size_t i, unsigned int flags) {
+	struct bench_buffer *doc = &state->corpus->docs[i];
+	struct bencode_parser parser = {0};
+	parser.flags = flags;
+	memset(&state->trees[i], 0, sizeof(struct bencode));
+	return bench_parsed(state, i, bencode_parse_with(doc->data, doc->length, &state->trees[i], &parser));
+}
+
+static int64_t bench_op_parse(struct bench_state *state, size_t i) {
+	struct bench_buffer *doc = &state->corpus->docs[i];
+	memset(&state->trees[i], 0, sizeof(struct bencode));
+	return bench_parsed(state, i, bencode_parse(doc->data, doc->length, &state->trees[i]));
+}
+
+static int64_t bench_op_lookup(struct bench_state *state, size_t i) {
+	return state->corpus->lookup(&state->trees[i]);
+}
+
+static int64_t bench_op_encode(struct bench_state *state, size_t i) {
+	char *end = bencode_encode(&state->trees[i], state->out, state->out_size, 0);
+	return end ? end - state->out : -1;
+}
+
+static int64_t bench_op_free(struct bench_state *state, size_t i) {
+	bencode_free(&state->trees[i]);
+	return 0;
+}
+
+static int64_t bench_op_schema(struct bench_state *state, size_t i) {
+	struct bench_buffer *doc = &state->corpus->docs[i];
+	int64_t value = state->corpus->schema(doc->data, doc->length, &state->parser);
+	bencode_arena_reset(&state->arena);
+	return value;
+}
+
+static int64_t bench_op_borrow(struct bench_state *state, size_t i) {
+	return bench_op_parse_with(state, i, BENCODE_OPT_BORROW);
+}
+
+static int64_t bench_op_padded(struct bench_state *state, size_t i) {
+	return bench_op_parse_with(state, i, BENCODE_OPT_PADDED);
+}
+
+static int64_t bench_op_lazy(struct bench_state *state, size_t i) {
+	if(bench_op_parse_with(state, i, BENCODE_OPT_LAZY) < 0) return -1;
+	return state->corpus->lookup(&state->trees[i]);
+}
+
+static int64_t bench_op_arena(struct bench_state *state, size_t i) {
+	struct bench_buffer *doc = &state->corpus->docs[i];
+	struct bencode b = {0};
+	int64_t parsed = bench_parsed(state, i, bencode_parse_arena(doc->data, doc->length, &b, &state->arena));
+	bencode_arena_reset(&state->arena);
+	return parsed;
+}
+
+static int64_t bench_op_context(struct bench_state *state, size_t i) {
+	struct bench_buffer *doc = &state->corpus->docs[i];
+	struct bencode b = {0};
+	int64_t parsed = bench_parsed(state, i, bencode_parse_context(doc->data, doc->length, &b, &state->ctx));
+	bencode_reset(&state->ctx);
+	return parsed;
+}
+
+static int64_t bench_op_validate(struct bench_state *state, size_t i) {
+	struct bench_buffer *doc = &state->corpus->docs[i];
+	return (bencode_validate(doc->data, doc->length, NULL) == BENCODE_OK) ? (int64_t) doc->length : -1;
+}
+
+static void bench_parse_trees(struct bench_state *state) {
+	for(size_t i = 0; i < state->corpus->count; i++) bench_op_parse(state, i);
+}
+
+static void bench_free_trees(struct bench_state *state) {
+	for(size_t i = 0; i < state->corpus->count; i++) bencode_free(&state->trees[i]);
+}
+
+enum { BENCH_CHECK_NONE, BENCH_CHECK_LENGTH, BENCH_CHECK_LOOKUP };
+
+struct bench_op {
+	const char *name;
+	int64_t (*run)(struct bench_state *state, size_t i);
+	void (*setup)(struct bench_state *state);   // or NULL
+	void (*cleanup)(struct bench_state *state); // or NULL
+	int check;
+};
+
+static const struct bench_op bench_ops[] = {
+	{ "parse",    bench_op_parse,    NULL,              bench_free_trees, BENCH_CHECK_LENGTH },
+	{ "lookup",   bench_op_lookup,   bench_parse_trees, bench_free_trees, BENCH_CHECK_LOOKUP },
+	{ "encode",   bench_op_encode,   bench_parse_trees, bench_free_trees, BENCH_CHECK_LENGTH },
+	{ "free",     bench_op_free,     bench_parse_trees, NULL,             BENCH_CHECK_NONE },
+	{ "schema",   bench_op_schema,   NULL,              NULL,             BENCH_CHECK_LOOKUP },
+	{ "borrow",   bench_op_borrow,   NULL,              bench_free_trees, BENCH_CHECK_LENGTH },
+	{ "padded",   bench_op_padded,   NULL,              bench_free_trees, BENCH_CHECK_LENGTH },
+	{ "lazy",     bench_op_lazy,     NULL,              bench_free_trees, BENCH_CHECK_LOOKUP }, // parse + lookup
+	{ "arena",    bench_op_arena,    NULL,              NULL,             BENCH_CHECK_LENGTH }, // parse + reset
+	{ "context",  bench_op_context,  NULL,              NULL,             BENCH_CHECK_LENGTH }, // parse + reset
+	{ "validate", bench_op_validate, NULL,              NULL,             BENCH_CHECK_LENGTH },
+};
+
+#define BENCH_OPS (sizeof(bench_ops) / sizeof(bench_ops[0]))
+
+static void bench_state_init(struct bench_state *state, struct bench_corpus *corpus) {
+	memset(state, 0, sizeof(struct bench_state));
+	state->corpus = corpus;
+	state->trees = calloc(corpus->count, sizeof(struct bencode));
+	state->parser.arena = &state->arena;
+	bencode_context_init(&state->ctx, 0);
+
+	// the corpus round-trips, so no encoding is longer than its input
+	for(size_t i = 0; i < corpus->count; i++)
+		if(corpus->docs[i].length > state->out_size) state->out_size = corpus->docs[i].length;
+	state->out = malloc(state->out_size);
+}
+
+static void bench_state_free(struct bench_state *state) {
+	bencode_arena_free(&state->arena);
+	bencode_context_free(&state->ctx);
+	free(state->trees);
+	free(state->out);
+}
+
+static void bench_run(struct bench_corpus *corpus, int tsv) {
+	// reference values for the checks, and the node count
+	int64_t *expected = malloc(sizeof(int64_t) * corpus->count);
+	corpus->nodes = 0;
+	for(size_t i = 0; i < corpus->count; i++) {
+		struct bencode b = {0};
+		if(bencode_parse(corpus->docs[i].data, corpus->docs[i].length, &b) != corpus->docs[i].data + corpus->docs[i].length) {
+			fprintf(stderr, "%s: document %zu does not parse\n", corpus->name, i);
+			exit(1);
+		}
+		expected[i] = corpus->lookup(&b);
+		corpus->nodes += bench_count_nodes(&b);
+		bencode_free(&b);
+	}
+
+	// untimed counting passes; the second shows the steady state of the arena and context modes
+	size_t allocs[BENCH_OPS] = {0}, peak[BENCH_OPS] = {0};
+	struct bench_state state;
+	bench_count_allocations(1);
+	bench_state_init(&state, corpus);
+	for(int pass = 0; pass < 2; pass++) {
+		for(size_t k = 0; k < BENCH_OPS; k++) {
+			if(bench_ops[k].run == bench_op_schema && corpus->schema == NULL) continue;
+			allocs[k] = peak[k] = 0;
+
+			if(bench_ops[k].setup) bench_ops[k].setup(&state);
+			for(size_t i = 0; i < corpus->count; i++) {
+				size_t base = bench_live, before = bench_allocs;
+				bench_peak = bench_live;
+				int64_t value = bench_ops[k].run(&state, i);
+
+				allocs[k] += bench_allocs - before;
+				if(bench_peak - base > peak[k]) peak[k] = bench_peak - base;
+
+				int check = bench_ops[k].check;
+				if((check == BENCH_CHECK_LENGTH && value != (int64_t) corpus->docs[i].length)
+					|| (check == BENCH_CHECK_LOOKUP && value != expected[i])) {
+					fprintf(stderr, "%s: %s disagrees on document %zu\n", corpus->name, bench_ops[k].name, i);
+					exit(1);
+				}
+			}
+			if(bench_ops[k].cleanup) bench_ops[k].cleanup(&state);
+		}
+	}
+	bench_state_free(&state);
+	bench_count_allocations(0);
+	free(expected);
+
+	size_t passes = BENCH_PASS_BYTES / corpus->bytes + 1;
+	double best[BENCH_OPS];
+	for(size_t k = 0; k < BENCH_OPS; k++) best[k] = 1e30;
+
+	bench_state_init(&state, corpus);
+	for(size_t k = 0; k < BENCH_OPS; k++) {
+		if(bench_ops[k].run == bench_op_schema && corpus->schema == NULL) continue;
+
+		for(int round = 0; round < BENCH_ROUNDS; round++) {
+			double elapsed = 0;
+
+			for(size_t pass = 0; pass < passes; pass++) {
+				if(bench_ops[k].setup) bench_ops[k].setup(&state);
+				double t = bench_now();
+				for(size_t i = 0; i < corpus->count; i++) bench_sink += (uint64_t) bench_ops[k].run(&state, i);
+				elapsed += bench_now() - t;
+				if(bench_ops[k].cleanup) bench_ops[k].cleanup(&state);
+			}
+
+			if(elapsed / passes < best[k]) best[k] = elapsed / passes;
+		}
+	}
+	bench_state_free(&state);
+
+	for(size_t k = 0; k < BENCH_OPS; k++) {
+		if(bench_ops[k].run == bench_op_schema && corpus->schema == NULL) continue;
+
+		double mb_s = corpus->bytes / best[k] / 1e6;
+		double docs_s = corpus->count / best[k];
+		double ns_node = best[k] * 1e9 / corpus->nodes;
+		double allocs_doc = (double) allocs[k] / corpus->count;
+
+		if(tsv) printf("%s\t%s\t%.1f\t%.0f\t%.2f\t%.1f\t%zu\n", corpus->name, bench_ops[k].name, mb_s, docs_s, ns_node, allocs_doc, peak[k]);
+		else printf("%-15s %-8s %10.1f %12.0f %9.2f %11.1f %11zu\n", corpus->name, bench_ops[k].name, mb_s, docs_s, ns_node, allocs_doc, peak[k]);
+	}
+}
+
+static int64_t bench_walk_tree(struct bencode *b) {
+	int64_t sum = (int64_t) b->key_length;
+	if(b->type == BENCODE_INT) return sum + b->i;
+	if(b->type == BENCODE_BYTES) return sum + (int64_t) b->length;
+
+	for(struct bencode *child = b->list; child; child = child->next) sum += bench_walk_tree(child);
+	return sum;
+}
+
+static int64_t bench_walk_compact(const struct bencode_compact *doc) {
+	int64_t sum = 0;
+	for(size_t i = 0; i < doc->count; i++) {
+		size_t length;
+		bencode_compact_key(doc, i, &length);
+		sum += (int64_t) length;
+
+		int type = bencode_compact_type(doc, i);
+		if(type == BENCODE_INT) sum += bencode_compact_int(doc, i);
+		if(type == BENCODE_BYTES) {
+			bencode_compact_bytes(doc, i, &length);
+			sum += (int64_t) length;
+		}
+	}
+	return sum;
+}
+
+static void bench_layout(struct bench_corpus *corpus, int tsv) {
+	struct bencode *trees = calloc(corpus->count, sizeof(struct bencode));
+	struct bencode_compact *docs = calloc(corpus->count, sizeof(struct bencode_compact));
+
+	bench_count_allocations(1); // until the trees are freed again
+	size_t base = bench_live;
+	for(size_t i = 0; i < corpus->count; i++) bencode_parse(corpus->docs[i].data, corpus->docs[i].length, &trees[i]);
+	size_t tree_bytes = bench_live - base + corpus->count * sizeof(struct bencode);
+
+	base = bench_live;
+	for(size_t i = 0; i < corpus->count; i++) {
+		if(bencode_parse_compact(corpus->docs[i].data, corpus->docs[i].length, &docs[i]) != corpus->docs[i].data + corpus->docs[i].length
+			|| bench_walk_compact(&docs[i]) != bench_walk_tree(&trees[i])) {
+			fprintf(stderr, "%s: compact document %zu disagrees\n", corpus->name, i);
+			exit(1);
+		}
+		bencode_compact_shrink(&docs[i]);
+	}
+	size_t compact_bytes = bench_live - base + corpus->count * sizeof(struct bencode_compact);
+
+	size_t passes = BENCH_PASS_BYTES / corpus->bytes + 1;
+	double best[2] = { 1e30, 1e30 }; // tree, compact
+
+	for(int round = 0; round < BENCH_ROUNDS; round++) {
+		double t = bench_now();
+		for(size_t pass = 0; pass < passes; pass++)
+			for(size_t i = 0; i < corpus->count; i++) bench_sink += (uint64_t) bench_walk_tree(&trees[i]);
+		double elapsed = (bench_now() - t) / passes;
+		if(elapsed < best[0]) best[0] = elapsed;
+
+		t = bench_now();
+		for(size_t pass = 0; pass < passes; pass++)
+			for(size_t i = 0; i < corpus->count; i++) bench_sink += (uint64_t) bench_walk_compact(&docs[i]);
+		elapsed = (bench_now() - t) / passes;
+		if(elapsed < best[1]) best[1] = elapsed;
+	}
+
+	static const char *layouts[2] = { "tree", "compact" };
+	size_t bytes[2] = { tree_bytes, compact_bytes };
+	for(int k = 0; k < 2; k++) {
+		double bytes_node = (double) bytes[k] / corpus->nodes;
+		double ns_node = best[k] * 1e9 / corpus->nodes;
+		if(tsv) printf("%s\t%s\t%.1f\t%.2f\n", corpus->name, layouts[k], bytes_node, ns_node);
+		else printf("%-15s %-7s %10.1f %9.2f\n", corpus->name, layouts[k], bytes_node, ns_node);
+	}
+
+	for(size_t i = 0; i < corpus->count; i++) {
+		bencode_free(&trees[i]);
+		bencode_compact_free(&docs[i]);
+	}
+	bench_count_allocations(0);
+	free(trees);
+	free(docs);
+}
+
+#define BENCH_QUERIES 1024 // keys looked up per pass, in random order
+
+static void bench_dicts(int tsv) {
+	static const size_t sizes[4] = { 8, 64, 512, 4096 };
+
+	for(int d = 0; d < 4; d++) {
+		size_t size = sizes[d];
+		struct bench_buffer buf = {0};
+		char key[32];
+
+		bench_char(&buf, 'd');
+		for(size_t j = 0; j < size; j++) {
+			sprintf(key, "key%06zu", j);
+			bench_key(&buf, key);
+			bench_int(&buf, (long long) j);
+		}
+		bench_char(&buf, 'e');
+
+		struct bencode dict = {0};
+		bencode_parse(buf.data, buf.length, &dict);
+		struct bencode_dict_index index = {0};
+		bencode_dict_index_build(&index, &dict);
+
+		static char queries[BENCH_QUERIES][16];
+		for(size_t q = 0; q < BENCH_QUERIES; q++) sprintf(queries[q], "key%06zu", (size_t) (bench_random() % size));
+
+		size_t passes = 1 + (1 << 16) / size;
+		double best[3] = { 1e30, 1e30, 1e30 }; // getsn, index, build
+
+		for(int round = 0; round < BENCH_ROUNDS; round++) {
+			double t = bench_now();
+			for(size_t pass = 0; pass < passes; pass++)
+				for(size_t q = 0; q < BENCH_QUERIES; q++) bench_sink += (uint64_t) bencode_getsn(&dict, queries[q], 9)->i;
+			double elapsed = (bench_now() - t) / (passes * BENCH_QUERIES);
+			if(elapsed < best[0]) best[0] = elapsed;
+
+			t = bench_now();
+			for(size_t pass = 0; pass < passes; pass++)
+				for(size_t q = 0; q < BENCH_QUERIES; q++) bench_sink += (uint64_t) bencode_dict_index_gets(&index, queries[q], 9)->i;
+			elapsed = (bench_now() - t) / (passes * BENCH_QUERIES);
+			if(elapsed < best[1]) best[1] = elapsed;
+
+			t = bench_now();
+			for(size_t pass = 0; pass < passes; pass++) {
+				struct bencode_dict_index rebuilt = {0};
+				bencode_dict_index_build(&rebuilt, &dict);
+				bencode_dict_index_free(&rebuilt);
+			}
+			elapsed = (bench_now() - t) / passes;
+			if(elapsed < best[2]) best[2] = elapsed;
+		}
+
+		if(tsv) printf("%zu\t%.2f\t%.2f\t%.0f\n", size, best[0] * 1e9, best[1] * 1e9, best[2] * 1e9);
+		else printf("%-7zu %10.2f %10.2f %10.0f\n", size, best[0] * 1e9, best[1] * 1e9, best[2] * 1e9);
+
+		bencode_dict_index_free(&index);
+		bencode_free(&dict);
+		free(buf.data);
+	}
+}
+#else
+/*
+	Thread scaling: the same work with bencode_parse_batch() and
+	bencode_parse_parallel() on 1, 2, ... threads.
+*/
+
+static void bench_append(struct bench_buffer *buf, const struct bench_buffer *doc) {
+	bench_reserve(buf, doc->length);
+	memcpy(buf->data + buf->length, doc->data, doc->length);
+	buf->length += doc->length;
+}
+
+static void bench_scaling(struct bench_corpus *corpora, size_t max_threads, int tsv) {
+	// batch: every KRPC message, repeated until they add up to one pass
+	size_t krpc_bytes = corpora[2].bytes + corpora[3].bytes;
+	size_t repeats = BENCH_PASS_BYTES / krpc_bytes + 1;
+	size_t count = repeats * (corpora[2].count + corpora[3].count);
+	struct bencode_message *messages = calloc(count, sizeof(struct bencode_message));
+
+	size_t m = 0;
+	for(size_t r = 0; r < repeats; r++)
+		for(int c = 2; c <= 3; c++)
+			for(size_t i = 0; i < corpora[c].count; i++, m++) {
+				messages[m].str = corpora[c].docs[i].data;
+				messages[m].length = corpora[c].docs[i].length;
+			}
+
+	// parallel: one list of every torrent and integer list, well above BENCODE_PARALLEL_MIN
+	struct bench_buffer doc = {0};
+	bench_char(&doc, 'l');
+	static const int kinds[3] = { 0, 1, 4 };
+	for(int k = 0; k < 3; k++)
+		for(size_t i = 0; i < corpora[kinds[k]].count; i++) bench_append(&doc, &corpora[kinds[k]].docs[i]);
+	bench_char(&doc, 'e');
+
+	double first[2] = { 0, 0 }; // one thread, for the speedup column
+	for(size_t threads = 1; threads <= max_threads; threads++) {
+		struct bencode_batch batch;
+		bencode_batch_init(&batch, threads);
+		double best[2] = { 1e30, 1e30 }; // batch, parallel
+
+		// arenas are reset outside the timed part; the first round grows them
+		for(int round = 0; round < BENCH_ROUNDS + 1; round++) {
+			double t = bench_now();
+			size_t failed = bencode_parse_batch(&batch, messages, count);
+			double elapsed = bench_now() - t;
+			if(failed) {
+				fprintf(stderr, "batch: %zu messages do not parse\n", failed);
+				exit(1);
+			}
+			if(elapsed < best[0]) best[0] = elapsed;
+			bencode_batch_reset(&batch);
+
+			struct bencode tree = {0};
+			t = bench_now();
+			char *end = bencode_parse_parallel(doc.data, doc.length, &tree, &batch);
+			elapsed = bench_now() - t;
+			if(end != doc.data + doc.length) {
+				fprintf(stderr, "parallel: the document does not parse\n");
+				exit(1);
+			}
+			if(elapsed < best[1]) best[1] = elapsed;
+			bencode_batch_reset(&batch);
+		}
+
+		static const char *ops[2] = { "batch", "parallel" };
+		size_t bytes[2] = { repeats * krpc_bytes, doc.length };
+		size_t docs[2] = { count, 1 };
+		for(int k = 0; k < 2; k++) {
+			if(threads == 1) first[k] = best[k];
+			double mb_s = bytes[k] / best[k] / 1e6;
+			double docs_s = docs[k] / best[k];
+			double speedup = first[k] / best[k];
+
+			if(tsv) printf("%zu\t%s\t%.1f\t%.0f\t%.2f\n", threads, ops[k], mb_s, docs_s, speedup);
+			else printf("%-7zu %-8s %10.1f %12.0f %8.2f\n", threads, ops[k], mb_s, docs_s, speedup);
+		}
+
+		bencode_batch_free(&batch);
+	}
+
+	free(doc.data);
+	free(messages);
+}
+#endif // BENCODE_THREADS
+
+static void bench_corpus_init(struct bench_corpus *corpus, const char *name, int64_t (*lookup)(struct bencode *b), size_t count) {
+	corpus->name = name;
+	corpus->lookup = lookup;
+	corpus->schema = NULL;
+	corpus->docs = calloc(count, sizeof(struct bench_buffer));
+	corpus->count = count;
+	corpus->bytes = 0;
+}
+
+int main(int argc, char **argv) {
+	int tsv = (argc > 1 && strcmp(argv[1], "-t") == 0);
+	struct bench_corpus corpora[7];
+
+	bench_corpus_init(&corpora[0], "torrent_single", bench_lookup_torrent, 16);
+	bench_corpus_init(&corpora[1], "torrent_multi", bench_lookup_torrent, 16);
+	bench_corpus_init(&corpora[2], "krpc_query", bench_lookup_krpc, 1000);
+	bench_corpus_init(&corpora[3], "krpc_response", bench_lookup_krpc, 1000);
+	bench_corpus_init(&corpora[4], "int_list", bench_lookup_list, 16);
+	bench_corpus_init(&corpora[5], "nested", bench_lookup_nested, 100);
+	bench_corpus_init(&corpora[6], "large_bytes", bench_lookup_list, 2);
+	corpora[0].schema = corpora[1].schema = bench_schema_torrent;
+	corpora[2].schema = corpora[3].schema = bench_schema_krpc;
+
+	for(int c = 0; c < 7; c++) {
+		for(size_t i = 0; i < corpora[c].count; i++) {
+			struct bench_buffer *doc = &corpora[c].docs[i];
+			switch(c) {
+				case 0: bench_torrent(doc, 0); break;
+				case 1: bench_torrent(doc, 200 + (int) (bench_random() % 800)); break;
+				case 2: bench_krpc_query(doc); break;
+				case 3: bench_krpc_response(doc); break;
+				case 4: bench_int_list(doc, 10000); break;
+				case 5: bench_nested(doc, 200); break;
+				case 6: bench_large_bytes(doc); break;
+			}
+			bench_reserve(doc, BENCODE_PADDING); // for the padded mode
+			memset(doc->data + doc->length, 0, BENCODE_PADDING);
+			corpora[c].bytes += doc->length;
+		}
+	}
+
+	#ifdef BENCODE_THREADS
+	// ./bench_threads [-t] [threads], one per online CPU by default
+	size_t max_threads = (argc > 1 + tsv) ? strtoul(argv[1 + tsv], NULL, 10) : 0;
+	if(max_threads == 0) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		max_threads = (online > 0) ? (size_t) online : 1;
+	}
+
+	if(tsv) printf("threads\top\tmb_s\tdocs_s\tspeedup\n");
+	else printf("%-7s %-8s %10s %12s %8s\n", "threads", "op", "MB/s", "docs/s", "speedup");
+	bench_scaling(corpora, max_threads, tsv);
+
+	for(int c = 0; c < 7; c++) {
+		for(size_t i = 0; i < corpora[c].count; i++) free(corpora[c].docs[i].data);
+		free(corpora[c].docs);
+	}
+	#else
+	if(tsv) printf("corpus\top\tmb_s\tdocs_s\tns_node\tallocs_doc\tpeak_bytes\n");
+	else printf("%-15s %-8s %10s %12s %9s %11s %11s\n", "corpus", "op", "MB/s", "docs/s", "ns/node", "allocs/doc", "peak bytes");
+
+	for(int c = 0; c < 7; c++) bench_run(&corpora[c], tsv);
+
+	if(tsv) printf("\ncorpus\tlayout\tbytes_node\twalk_ns_node\n");
+	else printf("\n%-15s %-7s %10s %9s\n", "corpus", "layout", "B/node", "walk ns");
+
+	for(int c = 0; c < 7; c++) {
+		bench_layout(&corpora[c], tsv);
+		for(size_t i = 0; i < corpora[c].count; i++) free(corpora[c].docs[i].data);
+		free(corpora[c].docs);
+	}
+
+	if(tsv) printf("\nkeys\tgetsn_ns\tindex_ns\tbuild_ns\n");
+	else printf("\n%-7s %10s %10s %10s\n", "keys", "getsn ns", "index ns", "build ns");
+	bench_dicts(tsv);
+	#endif
+
+	return 0;
+}
@@ -37,6 +37,8 @@ struct bencode {
 		BENCODE_LIST, BENCODE_DICT
 	} type;
 	
+	unsigned int flags; // BENCODE_FLAG_*
+	
 	union {
 		int64_t i;            // BENCODE_INT
 		char *bytes;          // BENCODE_BYTES
@@ -50,302 +52,3947 @@ struct bencode {
 	size_t key_length; // BENCODE_DICT
 	
 	struct bencode *next; // BENCODE_DICT | BENCODE_LIST
+	
+	#ifdef BENCODE_SPANS
+	size_t span_begin; // offset of the value's first byte in the input
+	size_t span_end;   // offset just past its last byte
+	struct bencode *parent; // the parsed list or dict holding the value
+	#endif
+};
+
+// struct bencode.flags
+#define BENCODE_FLAG_BORROWED     0x1 // bytes points into the parsed input
+#define BENCODE_FLAG_BORROWED_KEY 0x2 // key points into the parsed input
+#define BENCODE_FLAG_LAZY         0x4 // list or dict not expanded yet, bytes/length hold its encoding
+#define BENCODE_FLAG_INTERNED_KEY 0x8 // key is owned by a struct bencode_intern
+#define BENCODE_FLAG_DIRTY        0x10 // value changed since parsing (BENCODE_SPANS edits)
+#define BENCODE_FLAG_DIRTY_CHILD  0x20 // list or dict with changed children (BENCODE_SPANS edits)
+#define BENCODE_FLAG_ARENA        0x40 // bytes were copied into an arena
+
+/*
+	Every heap allocation the library makes goes through BENCODE_MALLOC,
+	BENCODE_REALLOC and BENCODE_FREE. Define all three before the
+	implementation to bind another allocator at compile time. Left alone,
+	they use the allocator installed with bencode_set_allocator(), or the C
+	library's when there is none (or NULL is passed). The runtime allocator
+	is process-wide: install it before parsing, and keep it until every tree
+	allocated through it has been freed.
+*/
+struct bencode_allocator {
+	void* (*malloc_fn)(void *ctx, size_t size);
+	void* (*realloc_fn)(void *ctx, void *ptr, size_t size); // ptr may be NULL
+	void (*free_fn)(void *ctx, void *ptr);
+	void *ctx;
+};
+
+void bencode_set_allocator(const struct bencode_allocator *allocator);
+
+#ifdef BENCODE_STATS
+/*
+	Allocation counters, kept while BENCODE_STATS is defined. Each block
+	carries a small header recording its size so live and peak bytes stay
+	exact. Nodes are counted as the parsers create them, by type; trees
+	in arenas count too, though their memory is the arena's blocks.
+*/
+struct bencode_stats {
+	size_t allocations; // successful malloc/calloc, plus reallocs of a NULL pointer
+	size_t reallocations;
+	size_t frees;
+	size_t bytes;       // total requested, including growth by realloc
+	size_t live;        // currently allocated
+	size_t peak;        // highest value of live
+	size_t nodes[BENCODE_DICT + 1]; // indexed by BENCODE_INT .. BENCODE_DICT
+};
+
+void bencode_stats_get(struct bencode_stats *stats);
+void bencode_stats_reset(void); // live bytes are kept, everything else is zeroed
+#endif
+
+#ifndef BENCODE_ARENA_BLOCK_SIZE
+#define BENCODE_ARENA_BLOCK_SIZE 65536
+#endif
+
+/*
+	A bump allocator for parse trees. Every node, byte string and dict key of
+	a document parsed with bencode_parse_arena() is carved out of the arena's
+	blocks, so the whole document is released at once with
+	bencode_arena_reset() (keeps the blocks for the next document) or
+	bencode_arena_free() (returns them to the heap). A zeroed arena is ready
+	to use. Never call bencode_free() on a tree that lives in an arena.
+*/
+struct bencode_arena_block {
+	struct bencode_arena_block *next;
+	size_t size; // usable bytes following this header
+	size_t used;
+};
+
+struct bencode_arena {
+	struct bencode_arena_block *first;
+	struct bencode_arena_block *current;
+	size_t block_size; // 0 means BENCODE_ARENA_BLOCK_SIZE
+};
+
+enum bencode_error {
+	BENCODE_OK = 0,
+	BENCODE_ERR_SYNTAX,    // unexpected byte
+	BENCODE_ERR_EOF,       // the input ended inside a value
+	BENCODE_ERR_OVERFLOW,  // integer or length out of range
+	BENCODE_ERR_DEPTH,     // nested deeper than max_depth
+	BENCODE_ERR_NOMEM,
+	BENCODE_ERR_SCHEMA,    // well-formed, but not what a generated parser expects
+	BENCODE_ERR_CANONICAL, // well-formed, but not canonical (BENCODE_OPT_CANONICAL)
+};
+
+// struct bencode_parser.flags
+#define BENCODE_OPT_BORROW    0x1
+#define BENCODE_OPT_LAZY      0x2
+#define BENCODE_OPT_CANONICAL 0x4
+#define BENCODE_OPT_PADDED    0x8
+
+// Readable bytes BENCODE_OPT_PADDED needs after the end of the input.
+#define BENCODE_PADDING 8
+
+#ifndef BENCODE_MAX_DEPTH
+#define BENCODE_MAX_DEPTH 256
+#endif
+
+#ifndef BENCODE_INLINE_DEPTH
+#define BENCODE_INLINE_DEPTH 32
+#endif
+
+/*
+	Options for bencode_parse_with(). A zeroed parser behaves exactly like
+	bencode_parse(). After each parse, `error` and `error_offset` (relative
+	to the start of the input) describe why it stopped, or are
+	BENCODE_OK / 0.
+	
+	max_depth limits how deeply lists and dicts may nest (0 means
+	BENCODE_MAX_DEPTH). Parsing never recurses; it needs a fixed amount of C
+	stack plus, beyond BENCODE_INLINE_DEPTH levels, up to max_depth frames of
+	3 pointers each on the heap (or in the arena, if there is one). Neither
+	do bencode_free() and the encoders, so raising max_depth never calls
+	for a bigger C stack.
+	
+	BENCODE_OPT_BORROW: byte strings and dict keys are not copied. Their
+	`bytes` and `key` pointers point straight into the input buffer, and the
+	nodes are marked BENCODE_FLAG_BORROWED / BENCODE_FLAG_BORROWED_KEY so that
+	bencode_free() leaves them alone. The input buffer must stay alive and
+	unmodified for as long as the tree is used; the borrowed bytes are not
+	NUL terminated.
+	
+	BENCODE_OPT_LAZY: only the top-level value is parsed. Lists and dicts
+	inside it are checked with bencode_skip() but not built; they are marked
+	BENCODE_FLAG_LAZY, with `bytes` and `length` holding their encoded span,
+	until bencode_expand() builds their children (again one level deep).
+	bencode_gets() and bencode_getsn() expand a lazy dict on the heap when
+	they first look inside it; with an arena, call bencode_expand() with the
+	same parser first. Lazy parsing implies BENCODE_OPT_BORROW. The streaming
+	parser ignores it.
+	
+	BENCODE_OPT_CANONICAL: the input must be in canonical form, as needed
+	for info-hashes to match: no leading zeros in integers or string lengths,
+	and the keys of every dict strictly ascending in raw byte order (so no
+	duplicates). Each key is compared with the one before it as it is read,
+	and the first violation stops the parse with BENCODE_ERR_CANONICAL at
+	the offending token. With BENCODE_OPT_LAZY the skipped values are
+	checked too, and bencode_expand() with the flag checks the level it
+	builds. The streaming parser ignores it.
+	
+	BENCODE_OPT_PADDED: the caller promises that BENCODE_PADDING bytes past
+	the end of the input can be read (their contents do not matter, they are
+	never part of the result). Integers and string lengths are then read
+	with one 8-byte load and no per-byte end checks, which is most of the
+	work for small messages. Without the flag, or without BENCODE_SWAR,
+	nothing past the input is read.
+	
+	With `intern` set, dict keys come from that table (see struct
+	bencode_intern) and are marked BENCODE_FLAG_INTERNED_KEY. A full table
+	falls back to the usual copy or borrow. The streaming parser ignores it.
+*/
+struct bencode_parser {
+	struct bencode_arena *arena;   // NULL allocates from the heap
+	struct bencode_arena *strings; // with an arena: copied bytes and keys go here, if set
+	struct bencode_intern *intern; // dict keys are shared through this table, if set
+	unsigned int flags;            // BENCODE_OPT_*
+	size_t max_depth;
+	
+	enum bencode_error error;
+	size_t error_offset;
 };
 
 char* bencode_parses(char *str, struct bencode *dest);
 char* bencode_parse(char *str, size_t length, struct bencode *dest);
+char* bencode_parse_arena(char *str, size_t length, struct bencode *dest, struct bencode_arena *arena);
+char* bencode_parse_with(char *str, size_t length, struct bencode *dest, struct bencode_parser *parser);
 void print_bencode(struct bencode *b, int indent);
 void bencode_free(struct bencode *b);
 struct bencode* bencode_gets(struct bencode *b, char *key_string); 
+struct bencode* bencode_getsn(struct bencode *b, const char *key, size_t key_length);
+char* bencode_skip(char *str, size_t length);
+enum bencode_error bencode_validate(const char *str, size_t length, size_t *error_offset);
+int bencode_expand(struct bencode *b, struct bencode_parser *parser);
+
+#ifdef BENCODE_SPANS
+/*
+	With BENCODE_SPANS defined, every node records where its value (not its
+	key) starts and ends in the parsed input, as offsets from the start of
+	the buffer given to the parser (for streams, from the first byte fed).
+	bencode_span() returns the raw encoded bytes of a value inside that same
+	buffer, and bencode_hash_span() hands them to a hash update function in
+	one call, e.g. for a torrent's info-hash without re-encoding:
+	
+		bencode_hash_span(bencode_gets(&torrent, "info"), buf, sha1_update, &sha1);
+*/
+typedef void (*bencode_span_fn)(void *ctx, const void *data, size_t length);
+
+const char* bencode_span(const struct bencode *b, const char *input, size_t *length);
+void bencode_hash_span(const struct bencode *b, const char *input, bencode_span_fn update, void *ctx);
+
+/*
+	Editing a parsed tree and writing it back. Change values found any way
+	(bencode_gets(), walking the lists) with bencode_set_int() or
+	bencode_set_bytes(). Both mark the node BENCODE_FLAG_DIRTY, and follow
+	the parent links the parser records to mark every container above it
+	BENCODE_FLAG_DIRTY_CHILD.
+	
+	bencode_encode_patched() then writes the tree using the original input:
+	every untouched value, however big, is one memcpy() of its span, only
+	dirty values are serialized, and the containers leading to them are
+	rebuilt around their children. Nodes without a span (made by hand) are
+	always serialized; a hand-made change to a container's children needs
+	bencode_touch() on it, which marks it and the containers above it.
+	`input` must be the buffer the tree was parsed from, and stays the
+	reference for later patches of the same tree. bencode_patched_size()
+	returns the exact size of the output.
+	
+	bencode_set_bytes() copies the bytes like the parser would (into its
+	arena, or not at all with BENCODE_OPT_BORROW); a NULL parser means the
+	heap. The old copy is released only if it is the node's own heap copy,
+	as recorded by BENCODE_FLAG_BORROWED and BENCODE_FLAG_ARENA. A heap copy
+	belongs to the node and is released by bencode_free(), so a NULL parser
+	is refused (-1) for a node with BENCODE_FLAG_ARENA; for borrowed nodes of
+	an arena tree, pass the arena's parser too, since bencode_arena_free()
+	would leave a heap copy behind.
+*/
+void bencode_touch(struct bencode *b);
+int bencode_set_int(struct bencode *b, int64_t value);
+int bencode_set_bytes(struct bencode *b, char *bytes, size_t length, struct bencode_parser *parser);
+size_t bencode_patched_size(const struct bencode *b);
+char* bencode_encode_patched(const struct bencode *b, const char *input, char *buffer, size_t size);
+#endif // BENCODE_SPANS
+
+/*
+	Support for the parsers bencode_gen.c generates from a schema. Each
+	function reads one value at `cursor`, never past `end`, and returns the
+	position after it. On failure it stores the error and its offset from
+	`origin` in the parser and returns NULL. A value of the wrong type is
+	BENCODE_ERR_SCHEMA. Byte strings point into the input.
+	
+	bencode_schema_list() checks the 'l' and counts the list's elements
+	(validating them) and returns the position of the first one.
+	bencode_schema_array() takes room for the elements from parser->arena;
+	there is no heap fallback, so lists need an arena.
+*/
+struct bencode_bytes {
+	char *bytes;
+	size_t length;
+};
+
+char* bencode_schema_fail(char *origin, char *cursor, struct bencode_parser *parser, enum bencode_error error);
+char* bencode_schema_key(char *origin, char *cursor, char *end, struct bencode_bytes *key, struct bencode_parser *parser);
+char* bencode_schema_int(char *origin, char *cursor, char *end, int64_t *value, struct bencode_parser *parser);
+char* bencode_schema_bytes(char *origin, char *cursor, char *end, struct bencode_bytes *value, struct bencode_parser *parser);
+char* bencode_schema_skip(char *origin, char *cursor, char *end, struct bencode_parser *parser);
+char* bencode_schema_list(char *origin, char *cursor, char *end, size_t *count, struct bencode_parser *parser);
+void* bencode_schema_array(char *origin, char *cursor, size_t count, size_t size, struct bencode_parser *parser);
+
+/*
+	Path queries over raw input. bencode_query_compile() turns up to
+	BENCODE_QUERY_MAX_PATHS paths into one trie, and bencode_query_run()
+	extracts all of them in a single pass over a document, skipping every
+	subtree no path leads into. No nodes are built and nothing is allocated
+	while running, so one compiled query can serve many buffers and threads.
+
+	A path is a chain of steps: `key`, `.key`, `[3]` (list index) or `[*]`
+	(every element), e.g. "info.files[*].length" or "r.nodes". A leading
+	`.` is optional, keys run to the next `.` or `[`, and `\` escapes those
+	(and itself) inside keys. The empty path matches the whole document.
+
+	Each match is reported with the index of its path. Ints come with their
+	value, byte strings with their payload, and lists and dicts with their
+	whole encoding; `bytes` points into the input. Matches are reported in
+	the order their values end, so a dict comes after any matches inside it.
+*/
+#ifndef BENCODE_QUERY_MAX_PATHS
+#define BENCODE_QUERY_MAX_PATHS 64
+#endif
+
+#ifndef BENCODE_QUERY_MAX_STEPS
+#define BENCODE_QUERY_MAX_STEPS 32
+#endif
+
+struct bencode_match {
+	size_t path;   // index into the paths given to bencode_query_compile()
+	int type;      // BENCODE_INT, BENCODE_BYTES, BENCODE_LIST or BENCODE_DICT
+	int64_t i;     // BENCODE_INT
+	char *bytes;   // BENCODE_BYTES: the payload; lists and dicts: their encoding
+	size_t length;
+	size_t offset; // where the value starts in the input
+};
+
+typedef void (*bencode_match_fn)(void *ctx, const struct bencode_match *match);
+
+struct bencode_query_node;
+
+struct bencode_query {
+	struct bencode_query_node *nodes; // the trie; nodes[0] is the document
+	size_t node_count;
+	char *keys;                       // the key bytes of every step
+	size_t path_count;
+};
+
+int bencode_query_compile(struct bencode_query *query, const char **paths, size_t count);
+enum bencode_error bencode_query_run(const struct bencode_query *query, char *str, size_t length, bencode_match_fn match, void *ctx, size_t *error_offset);
+void bencode_query_free(struct bencode_query *query);
+
+/*
+	A lookup index over one dict, for dicts that are queried many times: an
+	open-addressed hash table of the dict's children, built in one pass and
+	sized to at most half full. It returns the same node as bencode_getsn()
+	would, including for dicts with duplicate keys. The index points at the
+	dict's children and must be rebuilt if the dict changes.
+*/
+struct bencode_dict_index {
+	struct bencode **entries; // hash slots
+	size_t count;             // children in the dict
+	size_t slots;             // power of two
+};
+
+int bencode_dict_index_build(struct bencode_dict_index *index, struct bencode *dict);
+struct bencode* bencode_dict_index_gets(const struct bencode_dict_index *index, const char *key, size_t key_length);
+void bencode_dict_index_free(struct bencode_dict_index *index);
+
+/*
+	A key intern table: one shared, NUL terminated copy of every distinct
+	dict key, for parsers that see the same few keys over and over. Give it
+	to bencode_parser.intern, and identical keys in every document parsed
+	with it point at the same bytes. bencode_intern() returns that copy for
+	a key (adding it if needed), so a caller can look a key up once and then
+	find it with bencode_gets_interned(), which compares pointers only.
+	
+	The table has a fixed capacity chosen by bencode_intern_init(): `keys`
+	distinct keys in `bytes` of storage. Once either runs out bencode_intern()
+	returns NULL. With BENCODE_THREADS it is lock-free and may be shared by
+	any number of parsing threads; two threads adding the same key at once
+	may waste a little storage, but agree on the copy. Interned keys live
+	until bencode_intern_free(), which must come after every tree using them.
+*/
+#ifdef BENCODE_THREADS
+#include <stdatomic.h>
+#define BENCODE_ATOMIC _Atomic
+#else
+#define BENCODE_ATOMIC
+#endif
+
+struct bencode_intern {
+	char *BENCODE_ATOMIC *slots; // open addressing, NULL when free
+	size_t slot_count;           // power of two
+	char *storage;
+	size_t capacity;
+	BENCODE_ATOMIC size_t used;
+};
+
+int bencode_intern_init(struct bencode_intern *table, size_t keys, size_t bytes);
+const char* bencode_intern(struct bencode_intern *table, const char *key, size_t key_length);
+struct bencode* bencode_gets_interned(struct bencode *b, const char *interned_key);
+void bencode_intern_free(struct bencode_intern *table);
+
+/*
+	Encoding a tree back to bencode. bencode_encoded_size() returns the exact
+	number of bytes bencode_encode() will write, so the output can go into one
+	buffer of that size. bencode_encode() returns the position after the
+	last byte written, or NULL if `size` is too small (the buffer contents
+	are then undefined). No terminating NUL is written.
+	
+	Neither recurses. Past BENCODE_INLINE_DEPTH levels of nesting, or
+	BENCODE_ENCODE_INLINE_KEYS keys in open canonical dicts, they keep their
+	place on the heap; if that fails, bencode_encoded_size() returns 0 and
+	bencode_encode() NULL. bencode_free() does not recurse or allocate.
+	
+	With BENCODE_ENCODE_CANONICAL, dict entries are written sorted by raw
+	key bytes, as the spec requires, without reordering the tree. Lazy lists
+	and dicts (BENCODE_OPT_LAZY) are copied exactly as they were parsed.
+*/
+#define BENCODE_ENCODE_CANONICAL 0x1
+
+#ifndef BENCODE_ENCODE_INLINE_KEYS
+#define BENCODE_ENCODE_INLINE_KEYS 32
+#endif
+
+size_t bencode_encoded_size(const struct bencode *b);
+char* bencode_encode(const struct bencode *b, char *buffer, size_t size, unsigned int flags);
+
+/*
+	Tape documents: an alternative to the linked struct bencode tree. The
+	whole document is one contiguous array of fixed-size entries in document
+	order. A container entry is followed by its children, and records how
+	many children it has and the index just past its last descendant, so a
+	subtree is skipped in O(1). Dict children alternate key (always
+	BENCODE_BYTES) and value. Byte strings point into the input, which must
+	outlive the tape. Strings and containers are limited to 2^32-1 bytes
+	and children respectively.
+	
+	Iterating the children of a container at `index`:
+	
+		for(size_t i = index + 1; i < tape->entries[index].end; i = bencode_tape_next(tape, i))
+*/
+struct bencode_tape_entry {
+	uint32_t type;   // BENCODE_INT, BENCODE_BYTES, BENCODE_LIST or BENCODE_DICT
+	uint32_t length; // BENCODE_BYTES: bytes, BENCODE_LIST: elements, BENCODE_DICT: pairs
+	
+	union {
+		int64_t i;   // BENCODE_INT
+		char *bytes; // BENCODE_BYTES
+		size_t end;  // BENCODE_LIST | BENCODE_DICT
+	};
+};
+
+struct bencode_tape {
+	struct bencode_tape_entry *entries;
+	size_t count;
+	size_t capacity;
+};
+
+char* bencode_parse_tape(char *str, size_t length, struct bencode_tape *tape);
+void bencode_tape_free(struct bencode_tape *tape);
+size_t bencode_tape_next(const struct bencode_tape *tape, size_t index);
+size_t bencode_tape_gets(const struct bencode_tape *tape, size_t index, char *key_string);
+void print_bencode_tape(const struct bencode_tape *tape, size_t index, int indent);
+
+/*
+	Compact documents: a self-contained flat layout for keeping many large
+	documents in memory. Like a tape, the nodes sit in one array in document
+	order and a container knows the index past its last descendant, but
+	every node is 16 bytes and dict keys are not nodes of their own: a dict
+	child refers to an entry in the key table. Integers and byte strings of
+	up to 8 bytes are stored in the node itself, longer strings and all
+	keys are copied into one string pool and referenced by 32-bit offset,
+	so the input can be dropped after parsing. Node counts, the key table
+	and the pool are limited to 2^32-1 entries or bytes. The arrays grow by
+	doubling; bencode_compact_shrink() trims them to size for documents
+	that are kept around.
+	
+	The layout may change; read documents through the accessors. Iterating
+	the children of a container at `index`:
+	
+		for(size_t i = index + 1; i < bencode_compact_end(doc, index); i = bencode_compact_next(doc, i))
+*/
+#define BENCODE_COMPACT_POOLED 0xff       // inline_length of a string kept in the pool
+#define BENCODE_COMPACT_NO_KEY UINT32_MAX // key of a node that is not inside a dict
+
+struct bencode_compact_node {
+	uint8_t type;          // BENCODE_INT, BENCODE_BYTES, BENCODE_LIST or BENCODE_DICT
+	uint8_t inline_length; // BENCODE_BYTES: 0-8 bytes in `data`, or BENCODE_COMPACT_POOLED
+	uint16_t reserved;
+	uint32_t key;          // index into the key table, or BENCODE_COMPACT_NO_KEY
+	
+	union {
+		int64_t i;     // BENCODE_INT
+		char data[8];  // BENCODE_BYTES, inline
+		struct { uint32_t offset, length; } pooled;  // BENCODE_BYTES, in the pool
+		struct { uint32_t count, end; } children;    // BENCODE_LIST | BENCODE_DICT
+	};
+};
+
+struct bencode_compact_key {
+	uint32_t offset; // into the string pool
+	uint32_t length;
+};
+
+struct bencode_compact {
+	struct bencode_compact_node *nodes;
+	size_t count, capacity;
+	
+	struct bencode_compact_key *keys;
+	size_t key_count, key_capacity;
+	
+	char *strings; // the pool, not NUL terminated
+	size_t strings_length, strings_capacity;
+};
+
+char* bencode_parse_compact(char *str, size_t length, struct bencode_compact *doc);
+void bencode_compact_shrink(struct bencode_compact *doc);
+void bencode_compact_free(struct bencode_compact *doc);
+int bencode_compact_type(const struct bencode_compact *doc, size_t index);
+int64_t bencode_compact_int(const struct bencode_compact *doc, size_t index);
+const char* bencode_compact_bytes(const struct bencode_compact *doc, size_t index, size_t *length);
+const char* bencode_compact_key(const struct bencode_compact *doc, size_t index, size_t *length);
+size_t bencode_compact_count(const struct bencode_compact *doc, size_t index);
+size_t bencode_compact_end(const struct bencode_compact *doc, size_t index);
+size_t bencode_compact_next(const struct bencode_compact *doc, size_t index);
+size_t bencode_compact_gets(const struct bencode_compact *doc, size_t index, char *key_string);
+
+#ifndef BENCODE_STREAM_MAX_BYTES
+#define BENCODE_STREAM_MAX_BYTES (16 * 1024 * 1024)
+#endif
+
+/*
+	Incremental parser for input that arrives in pieces, e.g. from a socket.
+	Feed it chunks of any size with bencode_stream_feed(); it keeps its
+	place between calls, touches every input byte once and copies byte
+	strings in bulk, so the total work does not depend on how the input was
+	chunked. It builds the same tree as bencode_parse() into the `dest`
+	given to bencode_stream_init(), allocating from `parser->arena` if one
+	is set and enforcing its max_depth. Borrowing is not possible since
+	chunks do not outlive the call.
+	
+	bencode_stream_feed() returns BENCODE_NEED_MORE once the chunk has been
+	used up without completing the value, BENCODE_DONE when the value is
+	complete (`consumed` then says where the next message starts in the
+	chunk), and BENCODE_ERROR with `error` and `error_offset` (counted from
+	the first byte ever fed) set. Byte strings longer than `max_bytes`
+	(BENCODE_STREAM_MAX_BYTES after init) are rejected before anything is
+	allocated for them.
+	
+	On error the partial tree stays in `dest`; release it with
+	bencode_free() as usual, and the stream itself with bencode_stream_free().
+*/
+enum bencode_stream_status {
+	BENCODE_NEED_MORE,
+	BENCODE_DONE,
+	BENCODE_ERROR,
+};
+
+struct bencode_stream_frame {
+	struct bencode *container;
+	struct bencode *tail;
+	int expect_key; // dicts: the next item is a key
+};
+
+struct bencode_stream {
+	struct bencode *dest;
+	struct bencode_parser parser;
+	size_t max_bytes;
+	
+	int state;
+	int negative;
+	uint64_t number;      // integer or length prefix read so far
+	struct bencode *node; // node receiving the current scalar
+	
+	char *bytes;          // byte string or key being filled
+	size_t bytes_length;
+	size_t bytes_filled;
+	int reading_key;
+	
+	struct bencode_stream_frame *stack;
+	size_t depth;
+	size_t stack_capacity;
+	
+	size_t offset; // bytes consumed over the stream's lifetime
+	enum bencode_error error;
+	size_t error_offset;
+};
+
+void bencode_stream_init(struct bencode_stream *stream, struct bencode *dest, struct bencode_parser *parser);
+enum bencode_stream_status bencode_stream_feed(struct bencode_stream *stream, const char *chunk, size_t length, size_t *consumed);
+void bencode_stream_free(struct bencode_stream *stream);
+
+#if !defined(BENCODE_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define BENCODE_MMAP 1
+#endif
+
+#ifdef BENCODE_MMAP
+#ifndef BENCODE_FILE_WINDOW
+#define BENCODE_FILE_WINDOW (4 * 1024 * 1024) // a multiple of the page size
+#endif
+
+/*
+	Parsing a file without reading it into a heap buffer (POSIX only, define
+	BENCODE_NO_MMAP to leave it out). The file is mapped read-only and read
+	sequentially. Returns the position where parsing stopped, inside
+	file->data, or NULL with errno set if the file could not be opened or
+	mapped.
+	
+	With BENCODE_OPT_BORROW or BENCODE_OPT_LAZY the tree points into the
+	mapping, so keep the file open until the tree is freed; never write
+	through those pointers. The mapped pages are handed back to the page
+	cache after parsing and fault in again when used.
+	
+	Otherwise the file is fed through a bencode_stream one
+	BENCODE_FILE_WINDOW at a time and each window is released once it is
+	parsed, so resident memory stays near the size of the tree rather than
+	the file. The file can be closed straight after. The stream cannot check
+	BENCODE_OPT_CANONICAL or use `intern` or `strings`, so with any of those
+	the whole mapping is parsed in one go (still copying, unless borrowed).
+	BENCODE_OPT_PADDED is ignored: a mapping has no readable padding.
+*/
+struct bencode_file {
+	char *data;
+	size_t length;
+};
+
+char* bencode_parse_file(const char *path, struct bencode_file *file, struct bencode *dest, struct bencode_parser *parser);
+void bencode_file_close(struct bencode_file *file);
+#endif // BENCODE_MMAP
+
+#ifdef BENCODE_THREADS
+#ifndef BENCODE_PARALLEL_MIN
+#define BENCODE_PARALLEL_MIN (256 * 1024) // smaller documents are not split
+#endif
+
+/*
+	Batch parsing of independent messages on several threads (define
+	BENCODE_THREADS and link with -pthread). Each message is parsed with the
+	batch's parser options into its own `tree`, and its result is stored
+	next to its input, so results come back in input order whichever thread
+	parsed them.
+	
+	Work is split into one contiguous range per thread; a thread that runs
+	out steals the back half of another thread's remaining range. Trees
+	live in per-thread arenas owned by the batch: they stay valid until
+	bencode_batch_reset() or bencode_batch_free(), and must not be passed to
+	bencode_free(). The calling thread takes part in the work.
+*/
+struct bencode_message {
+	char *str;     // input
+	size_t length;
+	
+	struct bencode tree; // results
+	char *end;           // where parsing stopped, as returned by bencode_parse_with()
+	enum bencode_error error;
+	size_t error_offset;
+};
+
+struct bencode_batch {
+	struct bencode_parser parser; // flags and max_depth for every message
+	size_t threads;               // 0 means one per online CPU
+	
+	struct bencode_arena *arenas; // one per thread, kept between batches
+	size_t arena_count;
+};
+
+void bencode_batch_init(struct bencode_batch *batch, size_t threads);
+size_t bencode_parse_batch(struct bencode_batch *batch, struct bencode_message *messages, size_t count);
+char* bencode_parse_parallel(char *str, size_t length, struct bencode *dest, struct bencode_batch *batch);
+void bencode_batch_reset(struct bencode_batch *batch);
+void bencode_batch_free(struct bencode_batch *batch);
+#endif // BENCODE_THREADS
+
+void bencode_arena_init(struct bencode_arena *arena, size_t block_size);
+void* bencode_arena_alloc(struct bencode_arena *arena, size_t size);
+void bencode_arena_reset(struct bencode_arena *arena);
+void bencode_arena_free(struct bencode_arena *arena);
+
+/*
+	Everything needed to parse a stream of documents without touching the
+	heap once it has warmed up: a parser plus one arena for nodes (and deep
+	frame stacks) and one for copied byte strings and keys. bencode_reset()
+	drops the last document but keeps the memory, merging blocks so that
+	each arena settles at a single block as big as the largest document
+	seen. Set `parser.flags` and `parser.max_depth` as needed; the arena
+	pointers are filled in on every parse. Trees are valid until the next
+	bencode_reset() and must not be passed to bencode_free().
+*/
+struct bencode_context {
+	struct bencode_parser parser;
+	struct bencode_arena nodes;
+	struct bencode_arena strings;
+};
+
+void bencode_context_init(struct bencode_context *ctx, unsigned int flags);
+char* bencode_parse_context(char *str, size_t length, struct bencode *dest, struct bencode_context *ctx);
+void bencode_reset(struct bencode_context *ctx);
+void bencode_context_free(struct bencode_context *ctx);
 
 #ifdef BENCODE_IMPLEMENTATION
 
 #include "ctype.h"
 
-struct bencode* bencode_gets(struct bencode *b, char *key_string) {
-	if(b->type != BENCODE_DICT) return NULL;
+#ifdef BENCODE_SPANS
+#define BENCODE_SPAN_BEGIN(node, offset) ((node)->span_begin = (offset))
+#define BENCODE_SPAN_END(node, offset)   ((node)->span_end = (offset))
+#define BENCODE_SET_PARENT(node, container) ((node)->parent = (container))
+#else
+#define BENCODE_SPAN_BEGIN(node, offset) ((void) 0)
+#define BENCODE_SPAN_END(node, offset)   ((void) 0)
+#define BENCODE_SET_PARENT(node, container) ((void) 0)
+#endif
+
+static struct bencode_allocator bencode_allocator; // all NULL: the C library
+
+void bencode_set_allocator(const struct bencode_allocator *allocator) {
+	if(allocator) bencode_allocator = *allocator;
+	else memset(&bencode_allocator, 0, sizeof(bencode_allocator));
+}
+
+#if !defined(BENCODE_MALLOC) || !defined(BENCODE_REALLOC) || !defined(BENCODE_FREE)
+static void* bencode_runtime_malloc(size_t size) {
+	return bencode_allocator.malloc_fn ? bencode_allocator.malloc_fn(bencode_allocator.ctx, size) : malloc(size);
+}
+
+static void* bencode_runtime_realloc(void *ptr, size_t size) {
+	return bencode_allocator.realloc_fn ? bencode_allocator.realloc_fn(bencode_allocator.ctx, ptr, size) : realloc(ptr, size);
+}
+
+static void bencode_runtime_free(void *ptr) {
+	if(bencode_allocator.free_fn) bencode_allocator.free_fn(bencode_allocator.ctx, ptr);
+	else free(ptr);
+}
+
+#define BENCODE_MALLOC(size)       bencode_runtime_malloc(size)
+#define BENCODE_REALLOC(ptr, size) bencode_runtime_realloc(ptr, size)
+#define BENCODE_FREE(ptr)          bencode_runtime_free(ptr)
+#endif
+
+#ifdef BENCODE_STATS
+#ifdef BENCODE_THREADS
+#include <stdatomic.h>
+typedef _Atomic size_t bencode_counter;
+#define BENCODE_STAT_ADD(counter, n) atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+#define BENCODE_STAT_SUB(counter, n) atomic_fetch_sub_explicit(&(counter), (n), memory_order_relaxed)
+#define BENCODE_STAT_LOAD(counter)   atomic_load_explicit(&(counter), memory_order_relaxed)
+#else
+typedef size_t bencode_counter;
+#define BENCODE_STAT_ADD(counter, n) ((counter) += (n))
+#define BENCODE_STAT_SUB(counter, n) ((counter) -= (n))
+#define BENCODE_STAT_LOAD(counter)   (counter)
+#endif
+
+static struct {
+	bencode_counter allocations, reallocations, frees;
+	bencode_counter bytes, live, peak;
+	bencode_counter nodes[BENCODE_DICT + 1];
+} bencode_stats_state;
+
+// Blocks are prefixed with their size; 16 bytes keeps the user's pointer as aligned as malloc's.
+#define BENCODE_STATS_HEADER 16
+
+#define BENCODE_STAT_NODE(type) BENCODE_STAT_ADD(bencode_stats_state.nodes[type], 1)
+
+static void bencode_stats_grow(size_t size) {
+	BENCODE_STAT_ADD(bencode_stats_state.bytes, size);
+
+	#ifdef BENCODE_THREADS
+	size_t live = BENCODE_STAT_ADD(bencode_stats_state.live, size) + size; // fetch_add returns the old value
+	size_t peak = atomic_load_explicit(&bencode_stats_state.peak, memory_order_relaxed);
+	while(live > peak && !atomic_compare_exchange_weak_explicit(&bencode_stats_state.peak, &peak, live, memory_order_relaxed, memory_order_relaxed));
+	#else
+	size_t live = bencode_stats_state.live += size;
+	if(live > bencode_stats_state.peak) bencode_stats_state.peak = live;
+	#endif
+}
+
+static void* bencode_heap_malloc(size_t size) {
+	char *block = BENCODE_MALLOC(size + BENCODE_STATS_HEADER);
+	if(block == NULL) return NULL;
+	*(size_t*) block = size;
+
+	BENCODE_STAT_ADD(bencode_stats_state.allocations, 1);
+	bencode_stats_grow(size);
+	return block + BENCODE_STATS_HEADER;
+}
+
+static void* bencode_heap_realloc(void *ptr, size_t size) {
+	if(ptr == NULL) return bencode_heap_malloc(size);
+
+	char *block = (char*) ptr - BENCODE_STATS_HEADER;
+	size_t old_size = *(size_t*) block;
+
+	block = BENCODE_REALLOC(block, size + BENCODE_STATS_HEADER);
+	if(block == NULL) return NULL;
+	*(size_t*) block = size;
+
+	BENCODE_STAT_ADD(bencode_stats_state.reallocations, 1);
+	if(size > old_size) bencode_stats_grow(size - old_size);
+	else BENCODE_STAT_SUB(bencode_stats_state.live, old_size - size);
+	return block + BENCODE_STATS_HEADER;
+}
+
+static void bencode_heap_free(void *ptr) {
+	if(ptr == NULL) return;
+
+	char *block = (char*) ptr - BENCODE_STATS_HEADER;
+	BENCODE_STAT_ADD(bencode_stats_state.frees, 1);
+	BENCODE_STAT_SUB(bencode_stats_state.live, *(size_t*) block);
+	BENCODE_FREE(block);
+}
+
+void bencode_stats_get(struct bencode_stats *stats) {
+	stats->allocations = BENCODE_STAT_LOAD(bencode_stats_state.allocations);
+	stats->reallocations = BENCODE_STAT_LOAD(bencode_stats_state.reallocations);
+	stats->frees = BENCODE_STAT_LOAD(bencode_stats_state.frees);
+	stats->bytes = BENCODE_STAT_LOAD(bencode_stats_state.bytes);
+	stats->live = BENCODE_STAT_LOAD(bencode_stats_state.live);
+	stats->peak = BENCODE_STAT_LOAD(bencode_stats_state.peak);
+	for(int type = 0; type <= BENCODE_DICT; type++)
+		stats->nodes[type] = BENCODE_STAT_LOAD(bencode_stats_state.nodes[type]);
+}
+
+void bencode_stats_reset(void) {
+	size_t live = BENCODE_STAT_LOAD(bencode_stats_state.live);
+	#ifdef BENCODE_THREADS
+	atomic_store(&bencode_stats_state.allocations, 0);
+	atomic_store(&bencode_stats_state.reallocations, 0);
+	atomic_store(&bencode_stats_state.frees, 0);
+	atomic_store(&bencode_stats_state.bytes, 0);
+	atomic_store(&bencode_stats_state.peak, live);
+	for(int type = 0; type <= BENCODE_DICT; type++) atomic_store(&bencode_stats_state.nodes[type], 0);
+	#else
+	memset(&bencode_stats_state, 0, sizeof(bencode_stats_state));
+	bencode_stats_state.live = live;
+	bencode_stats_state.peak = live;
+	#endif
+}
+#else
+#define BENCODE_STAT_NODE(type) ((void) 0)
+#define bencode_heap_malloc(size)       BENCODE_MALLOC(size)
+#define bencode_heap_realloc(ptr, size) BENCODE_REALLOC(ptr, size)
+#define bencode_heap_free(ptr)          BENCODE_FREE(ptr)
+#endif
+
+static void* bencode_heap_calloc(size_t count, size_t size) {
+	void *ptr = bencode_heap_malloc(count * size);
+	if(ptr) memset(ptr, 0, count * size);
+	return ptr;
+}
+
+// Arena blocks hand out memory aligned for any member of struct bencode.
+#define BENCODE_ARENA_ALIGN(n) (((n) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+#define BENCODE_ARENA_HEADER BENCODE_ARENA_ALIGN(sizeof(struct bencode_arena_block))
+
+void bencode_arena_init(struct bencode_arena *arena, size_t block_size) {
+	arena->first = NULL;
+	arena->current = NULL;
+	arena->block_size = block_size;
+}
+
+void* bencode_arena_alloc(struct bencode_arena *arena, size_t size) {
+	size = BENCODE_ARENA_ALIGN(size);
 	
-	size_t query_length = strlen(key_string);
+	struct bencode_arena_block *block = arena->current;
+	if(block && block->size - block->used >= size) {
+		void *ptr = (char*) block + BENCODE_ARENA_HEADER + block->used;
+		block->used += size;
+		return ptr;
+	}
+	
+	// reuse a block kept by bencode_arena_reset() if it is big enough
+	if(block && block->next && block->next->size >= size) {
+		block = block->next;
+		block->used = size;
+		arena->current = block;
+		return (char*) block + BENCODE_ARENA_HEADER;
+	}
+	
+	size_t block_size = arena->block_size ? arena->block_size : BENCODE_ARENA_BLOCK_SIZE;
+	if(block_size < size) block_size = size;
+	
+	struct bencode_arena_block *fresh = bencode_heap_malloc(BENCODE_ARENA_HEADER + block_size);
+	if(fresh == NULL) return NULL;
+	fresh->size = block_size;
+	fresh->used = size;
+	
+	// splice the new block in after the current one, keeping any spare blocks
+	if(block) {
+		fresh->next = block->next;
+		block->next = fresh;
+	} else {
+		fresh->next = arena->first;
+		arena->first = fresh;
+	}
+	arena->current = fresh;
+	
+	return (char*) fresh + BENCODE_ARENA_HEADER;
+}
+
+void bencode_arena_reset(struct bencode_arena *arena) {
+	// a document that spilled over several blocks gets them merged into one,
+	// so the next document of that size fits without another malloc
+	if(arena->current != arena->first) {
+		size_t total = 0;
+		for(struct bencode_arena_block *block = arena->first; block; block = block->next) total += block->size;
+		
+		struct bencode_arena_block *merged = bencode_heap_malloc(BENCODE_ARENA_HEADER + total);
+		if(merged) {
+			bencode_arena_free(arena);
+			merged->size = total;
+			merged->next = NULL;
+			arena->first = merged;
+		}
+	}
+	
+	if(arena->first) arena->first->used = 0;
+	arena->current = arena->first;
+}
+
+void bencode_arena_free(struct bencode_arena *arena) {
+	struct bencode_arena_block *block = arena->first;
+	while(block) {
+		struct bencode_arena_block *next = block->next;
+		bencode_heap_free(block);
+		block = next;
+	}
+	arena->first = NULL;
+	arena->current = NULL;
+}
+
+static void* bencode_alloc(struct bencode_parser *parser, size_t size) {
+	return parser->arena ? bencode_arena_alloc(parser->arena, size) : bencode_heap_malloc(size);
+}
+
+// Copied byte strings and keys, kept apart from the nodes when the parser has a string arena.
+static void* bencode_alloc_bytes(struct bencode_parser *parser, size_t size) {
+	if(parser->arena == NULL) return bencode_heap_malloc(size);
+	return bencode_arena_alloc(parser->strings ? parser->strings : parser->arena, size);
+}
+
+static char* bencode_parse_internal(char *str, size_t length, struct bencode *dest, struct bencode_parser *parser);
+
+void bencode_context_init(struct bencode_context *ctx, unsigned int flags) {
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->parser.flags = flags;
+}
+
+char* bencode_parse_context(char *str, size_t length, struct bencode *dest, struct bencode_context *ctx) {
+	ctx->parser.arena = &ctx->nodes;
+	ctx->parser.strings = &ctx->strings;
+	return bencode_parse_internal(str, length, dest, &ctx->parser);
+}
+
+void bencode_reset(struct bencode_context *ctx) {
+	bencode_arena_reset(&ctx->nodes);
+	bencode_arena_reset(&ctx->strings);
+}
+
+void bencode_context_free(struct bencode_context *ctx) {
+	bencode_arena_free(&ctx->nodes);
+	bencode_arena_free(&ctx->strings);
+}
+
+#if !defined(BENCODE_NO_SWAR) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BENCODE_SWAR 1
+
+// Eight ASCII digits loaded little-endian into one word.
+static int bencode_swar_is_8_digits(uint64_t chunk) {
+	return ( (chunk & 0xF0F0F0F0F0F0F0F0) |
+	         (((chunk + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4) ) == 0x3333333333333333;
+}
+
+// How many of the eight bytes, from the first, are ASCII digits.
+static size_t bencode_swar_leading_digits(uint64_t chunk) {
+	// a byte's carry only reaches later bytes, past the first non-digit
+	uint64_t non_digits = ((chunk & 0xF0F0F0F0F0F0F0F0) ^ 0x3030303030303030) |
+	                      (((chunk + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) ^ 0x3030303030303030);
+	return non_digits ? (size_t) __builtin_ctzll(non_digits) / 8 : 8;
+}
+
+static uint32_t bencode_swar_parse_8_digits(uint64_t chunk) {
+	const uint64_t mask = 0x000000FF000000FF;
+	const uint64_t mul1 = 100 + ((uint64_t) 1000000 << 32);
+	const uint64_t mul2 = 1 + ((uint64_t) 10000 << 32);
+	
+	chunk -= 0x3030303030303030;
+	chunk = (chunk * 10) + (chunk >> 8); // pairs of digits
+	chunk = (((chunk & mask) * mul1) + (((chunk >> 16) & mask) * mul2)) >> 32;
+	
+	return (uint32_t) chunk;
+}
+#endif // BENCODE_SWAR
+
+/*
+	Converts the run of decimal digits starting at `cursor` in one pass,
+	eight at a time when BENCODE_SWAR is available. Returns the position of
+	the first non-digit (or `end`), or NULL if the value does not fit in 64
+	bits.
+*/
+static char* bencode_read_digits(char *cursor, char *end, uint64_t *value) {
+	uint64_t v = 0;
+	
+	#ifdef BENCODE_SWAR
+	while(end - cursor >= 8) {
+		uint64_t chunk;
+		memcpy(&chunk, cursor, sizeof(chunk));
+		if(!bencode_swar_is_8_digits(chunk)) break;
+		
+		if(v > (UINT64_MAX - 99999999) / 100000000) return NULL;
+		v = v * 100000000 + bencode_swar_parse_8_digits(chunk);
+		cursor += 8;
+	}
+	#endif
+	
+	while(cursor < end && *cursor >= '0' && *cursor <= '9') {
+		unsigned int digit = *cursor - '0';
+		
+		if(v >= UINT64_MAX / 10 && (v > UINT64_MAX / 10 || digit > UINT64_MAX % 10)) return NULL;
+		v = v * 10 + digit;
+		cursor++;
+	}
+	
+	*value = v;
+	return cursor;
+}
+
+#ifdef BENCODE_SWAR
+/*
+	bencode_read_digits() for BENCODE_OPT_PADDED input: the digit run is
+	found and converted from one unaligned load, which may reach into the
+	padding. Runs of 8 or more digits, and runs that cross `end` (the
+	padding happened to hold digits), take the bounded path.
+*/
+static char* bencode_read_digits_padded(char *cursor, char *end, uint64_t *value) {
+	uint64_t chunk;
+	memcpy(&chunk, cursor, sizeof(chunk));
+	
+	size_t n = bencode_swar_leading_digits(chunk);
+	if(n == 0) {
+		*value = 0;
+		return cursor;
+	}
+	if(n == 8 || (size_t) (end - cursor) < n) return bencode_read_digits(cursor, end, value);
+	if(n == 1) {
+		*value = (chunk & 0xFF) - '0'; // most lengths in small messages
+		return cursor + 1;
+	}
+	
+	// move the digits to the high bytes, behind '0's, and convert all eight
+	chunk = (chunk << (64 - 8 * n)) | (0x3030303030303030 >> (8 * n));
+	*value = bencode_swar_parse_8_digits(chunk);
+	return cursor + n;
+}
+#else
+#define bencode_read_digits_padded(cursor, end, value) bencode_read_digits(cursor, end, value)
+#endif
+
+/*
+	Token readers shared by the tree and tape builders.
+	
+	bencode_read_int() reads "i<digits>e" and returns the position just past
+	the 'e'. bencode_read_length() reads the "<digits>:" prefix of a byte
+	string, checks that the payload fits inside `length`, and returns the
+	position of the payload. Both return NULL on malformed input, including
+	values that overflow int64_t or size_t. The _padded variants do the same
+	for BENCODE_OPT_PADDED input, given its end.
+*/
+static int bencode_int_from_magnitude(uint64_t magnitude, int negative, int64_t *value) {
+	if(negative) {
+		if(magnitude > (uint64_t) INT64_MAX + 1) return -1;
+		*value = (magnitude == (uint64_t) INT64_MAX + 1) ? INT64_MIN : -(int64_t) magnitude;
+	} else {
+		if(magnitude > INT64_MAX) return -1;
+		*value = (int64_t) magnitude;
+	}
+	return 0;
+}
+
+static char* bencode_read_int(char *str, size_t length, int64_t *value) {
+	char *end = str + length;
+	char *cursor = str + 1;
+	int negative = 0;
+	
+	if(cursor < end && *cursor == '-') {
+		negative = 1;
+		cursor++;
+	}
+	
+	if(cursor == end || !(*cursor >= '0' && *cursor <= '9')) return NULL; // no blank inputs
+	if(negative && *cursor == '0') return NULL; // no negative leading zeros
+	// if(*cursor == '0' && cursor + 1 < end && cursor[1] != 'e') return NULL; // no leading zeros
+	
+	uint64_t magnitude;
+	char *e = bencode_read_digits(cursor, end, &magnitude);
+	
+	if(e == NULL || e == end || *e != 'e') return NULL;
+	if(bencode_int_from_magnitude(magnitude, negative, value)) return NULL;
+	
+	return e + 1;
+}
+
+static char* bencode_read_int_padded(char *str, char *end, int64_t *value) {
+	char *cursor = str + 1;
+	int negative = (*cursor == '-'); // at worst a padding byte
+	cursor += negative;
+	
+	uint64_t magnitude;
+	char *e = bencode_read_digits_padded(cursor, end, &magnitude);
+	
+	if(e == NULL || e == cursor || e >= end || *e != 'e') return NULL;
+	if(negative && *cursor == '0') return NULL; // no negative leading zeros
+	if(bencode_int_from_magnitude(magnitude, negative, value)) return NULL;
+	
+	return e + 1;
+}
+
+static char* bencode_read_length(char *str, size_t length, size_t *bytes_length) {
+	char *end = str + length;
+	uint64_t value;
+	char *colon = bencode_read_digits(str, end, &value);
+	
+	if(colon == NULL || colon == str || colon == end || *colon != ':') return NULL;
+	if(value >= (uint64_t) (end - colon)) return NULL; // payload must fit
+	
+	*bytes_length = (size_t) value;
+	return colon + 1;
+}
+
+static char* bencode_read_length_padded(char *str, char *end, size_t *bytes_length) {
+	uint64_t value;
+	char *colon = bencode_read_digits_padded(str, end, &value);
+	
+	if(colon == NULL || colon == str || colon >= end || *colon != ':') return NULL;
+	if(value >= (uint64_t) (end - colon)) return NULL; // payload must fit
+	
+	*bytes_length = (size_t) value;
+	return colon + 1;
+}
+
+struct bencode* bencode_gets(struct bencode *b, char *key_string) {
+	return bencode_getsn(b, key_string, strlen(key_string));
+}
+
+struct bencode* bencode_getsn(struct bencode *b, const char *key, size_t key_length) {
+	if(b->type != BENCODE_DICT) return NULL;
+	if((b->flags & BENCODE_FLAG_LAZY) && bencode_expand(b, NULL)) return NULL;
+	
+	struct bencode *head = b->dict;
+	while(head) {
+		if(head->key_length == key_length && 0 == memcmp(head->key, key, key_length))
+			return head;
+		head = head->next;
+	}
+	
+	return head;
+}
+
+static size_t bencode_key_hash(const char *key, size_t key_length) {
+	uint64_t hash = 0xcbf29ce484222325; // FNV-1a
+	
+	for(size_t i = 0; i < key_length; i++) {
+		hash ^= (unsigned char) key[i];
+		hash *= 0x100000001b3;
+	}
+	
+	return (size_t) hash;
+}
+
+// Raw byte order of two dict entries' keys, as canonical bencode sorts them. qsort() style.
+static int bencode_key_order(const void *a, const void *b) {
+	const struct bencode *x = *(const struct bencode * const *) a;
+	const struct bencode *y = *(const struct bencode * const *) b;
+	size_t shorter = (x->key_length < y->key_length) ? x->key_length : y->key_length;
+	
+	int order = memcmp(x->key, y->key, shorter);
+	if(order) return order;
+	return (x->key_length > y->key_length) - (x->key_length < y->key_length);
+}
+
+int bencode_dict_index_build(struct bencode_dict_index *index, struct bencode *dict) {
+	index->entries = NULL;
+	index->count = 0;
+	index->slots = 0;
+	
+	if(dict->type != BENCODE_DICT) return -1;
+	if((dict->flags & BENCODE_FLAG_LAZY) && bencode_expand(dict, NULL)) return -1;
+	
+	for(struct bencode *head = dict->dict; head; head = head->next)
+		index->count++;
+	
+	index->slots = 8;
+	while(index->slots < index->count * 2) index->slots *= 2;
+	
+	index->entries = bencode_heap_calloc(index->slots, sizeof(struct bencode*));
+	if(index->entries == NULL) return -1;
+	
+	for(struct bencode *head = dict->dict; head; head = head->next) {
+		size_t slot = bencode_key_hash(head->key, head->key_length) & (index->slots - 1);
+		
+		while(index->entries[slot]) {
+			struct bencode *other = index->entries[slot];
+			if(other->key_length == head->key_length && memcmp(other->key, head->key, head->key_length) == 0)
+				break; // duplicate key, the first one wins like in bencode_getsn()
+			slot = (slot + 1) & (index->slots - 1);
+		}
+		
+		if(index->entries[slot] == NULL) index->entries[slot] = head;
+	}
+	
+	return 0;
+}
+
+struct bencode* bencode_dict_index_gets(const struct bencode_dict_index *index, const char *key, size_t key_length) {
+	if(index->slots == 0) return NULL;
+	
+	size_t slot = bencode_key_hash(key, key_length) & (index->slots - 1);
+	
+	while(index->entries[slot]) {
+		struct bencode *entry = index->entries[slot];
+		if(entry->key_length == key_length && memcmp(entry->key, key, key_length) == 0)
+			return entry;
+		slot = (slot + 1) & (index->slots - 1);
+	}
+	
+	return NULL;
+}
+
+void bencode_dict_index_free(struct bencode_dict_index *index) {
+	bencode_heap_free(index->entries);
+	index->entries = NULL;
+	index->count = 0;
+	index->slots = 0;
+}
+
+#ifdef BENCODE_THREADS
+#define BENCODE_INTERN_LOAD(slot)            atomic_load_explicit(&(slot), memory_order_acquire)
+#define BENCODE_INTERN_CLAIM(slot, old, key) atomic_compare_exchange_strong_explicit(&(slot), &(old), (key), memory_order_acq_rel, memory_order_acquire)
+#define BENCODE_INTERN_RESERVE(used, n)      atomic_fetch_add_explicit(&(used), (n), memory_order_relaxed)
+#else
+#define BENCODE_INTERN_LOAD(slot)            (slot)
+#define BENCODE_INTERN_CLAIM(slot, old, key) ((slot) = (key), 1)
+#define BENCODE_INTERN_RESERVE(used, n)      (((used) += (n)) - (n))
+#endif
+
+// Each interned key is stored as its length, the bytes and a NUL, 8-byte aligned.
+#define BENCODE_INTERN_HEADER sizeof(size_t)
+
+static size_t bencode_interned_length(const char *key) {
+	size_t length;
+	memcpy(&length, key - BENCODE_INTERN_HEADER, sizeof(size_t));
+	return length;
+}
+
+int bencode_intern_init(struct bencode_intern *table, size_t keys, size_t bytes) {
+	memset(table, 0, sizeof(struct bencode_intern));
+	
+	table->slot_count = 8;
+	while(table->slot_count < keys * 2) table->slot_count *= 2;
+	
+	table->slots = bencode_heap_calloc(table->slot_count, sizeof(*table->slots));
+	table->storage = bencode_heap_malloc(bytes);
+	if(table->slots == NULL || table->storage == NULL) {
+		bencode_intern_free(table);
+		return -1;
+	}
+	
+	table->capacity = bytes;
+	return 0;
+}
+
+const char* bencode_intern(struct bencode_intern *table, const char *key, size_t key_length) {
+	if(table->slot_count == 0) return NULL;
+	
+	size_t mask = table->slot_count - 1;
+	size_t slot = bencode_key_hash(key, key_length) & mask;
+	char *copy = NULL;
+	
+	for(size_t probes = 0; probes < table->slot_count; probes++, slot = (slot + 1) & mask) {
+		char *entry = BENCODE_INTERN_LOAD(table->slots[slot]);
+		
+		if(entry == NULL) {
+			if(copy == NULL) {
+				size_t size = (BENCODE_INTERN_HEADER + key_length + 1 + 7) & ~(size_t) 7;
+				size_t offset = BENCODE_INTERN_RESERVE(table->used, size);
+				if(offset > table->capacity || table->capacity - offset < size) return NULL;
+				
+				copy = table->storage + offset + BENCODE_INTERN_HEADER;
+				memcpy(copy - BENCODE_INTERN_HEADER, &key_length, sizeof(size_t));
+				memcpy(copy, key, key_length);
+				copy[key_length] = 0;
+			}
+			
+			if(BENCODE_INTERN_CLAIM(table->slots[slot], entry, copy)) return copy;
+			// another thread took the slot first; `entry` is now its key
+		}
+		
+		if(bencode_interned_length(entry) == key_length && memcmp(entry, key, key_length) == 0)
+			return entry;
+	}
+	
+	return NULL;
+}
+
+struct bencode* bencode_gets_interned(struct bencode *b, const char *interned_key) {
+	if(b->type != BENCODE_DICT || (b->flags & BENCODE_FLAG_LAZY)) return NULL;
+	
+	for(struct bencode *head = b->dict; head; head = head->next)
+		if(head->key == interned_key) return head;
+	
+	return NULL;
+}
+
+void bencode_intern_free(struct bencode_intern *table) {
+	bencode_heap_free((void*) table->slots);
+	bencode_heap_free(table->storage);
+	memset(table, 0, sizeof(struct bencode_intern));
+}
+
+char* bencode_parses(char *str, struct bencode *dest) {
+	return bencode_parse(str, strlen(str), dest);
+}
+
+char* bencode_parse(char *str, size_t length, struct bencode *dest) {
+	struct bencode_parser parser = {0};
+	return bencode_parse_internal(str, length, dest, &parser);
+}
+
+char* bencode_parse_arena(char *str, size_t length, struct bencode *dest, struct bencode_arena *arena) {
+	struct bencode_parser parser = {0};
+	parser.arena = arena;
+	return bencode_parse_internal(str, length, dest, &parser);
+}
+
+char* bencode_parse_with(char *str, size_t length, struct bencode *dest, struct bencode_parser *parser) {
+	return bencode_parse_internal(str, length, dest, parser);
+}
+
+static char* bencode_parse_bytes(char *cursor, char *end, struct bencode_parser *parser, char **bytes, size_t *bytes_length, int *borrowed);
+
+// Reads a dict key into `node`, from the parser's intern table when it has one.
+static char* bencode_parse_key(char *cursor, char *end, struct bencode_parser *parser, struct bencode *node) {
+	if(parser->intern && *cursor >= '0' && *cursor <= '9') {
+		size_t key_length;
+		char *payload = (parser->flags & BENCODE_OPT_PADDED) ? bencode_read_length_padded(cursor, end, &key_length)
+			: bencode_read_length(cursor, end - cursor, &key_length);
+		if(payload == NULL) return NULL;
+		
+		const char *key = bencode_intern(parser->intern, payload, key_length);
+		if(key) {
+			node->key = (char*) key;
+			node->key_length = key_length;
+			node->flags |= BENCODE_FLAG_INTERNED_KEY;
+			return payload + key_length;
+		}
+	}
+	
+	int borrowed;
+	char *next = bencode_parse_bytes(cursor, end, parser, &node->key, &node->key_length, &borrowed);
+	if(next && borrowed) node->flags |= BENCODE_FLAG_BORROWED_KEY;
+	return next;
+}
+
+/*
+	Reads a byte string token (or an extension string) at `cursor`. The
+	result is borrowed from the input or copied, depending on the parser.
+	Returns the position after the token, or NULL.
+*/
+static char* bencode_parse_bytes(char *cursor, char *end, struct bencode_parser *parser, char **bytes, size_t *bytes_length, int *borrowed) {
+	#ifdef BENCODE_EXT_STRINGS
+	if(*cursor == 's') {
+		if(cursor[1] != '"') return NULL;
+		char *str = cursor + 2;
+		
+		char *final_quote = str;
+		
+		// find the terminating "
+		while(*final_quote != '"') {
+			if(*final_quote == '\\') {
+				if(*(final_quote + 1) == '\"')
+					final_quote++;
+			}
+			final_quote++;
+		}
+		
+		size_t string_length = final_quote - str;
+		assert(string_length > 0);
+		
+		*borrowed = 0;
+		*bytes_length = string_length + 1;
+		*bytes = bencode_alloc_bytes(parser, *bytes_length);
+		if(*bytes == NULL) {
+			parser->error = BENCODE_ERR_NOMEM;
+			return NULL;
+		}
+		(*bytes)[string_length] = 0;
+		memcpy(*bytes, str, string_length);
+		
+		return final_quote + 1;
+	}
+	#endif // BENCODE_EXT_STRINGS
+	
+	char *payload = (parser->flags & BENCODE_OPT_PADDED) ? bencode_read_length_padded(cursor, end, bytes_length)
+		: bencode_read_length(cursor, end - cursor, bytes_length);
+	if(payload == NULL) return NULL;
+	
+	if(parser->flags & (BENCODE_OPT_BORROW | BENCODE_OPT_LAZY)) {
+		*borrowed = 1;
+		*bytes = payload;
+	} else {
+		*borrowed = 0;
+		*bytes = bencode_alloc_bytes(parser, *bytes_length);
+		if(*bytes == NULL && *bytes_length) {
+			parser->error = BENCODE_ERR_NOMEM;
+			return NULL;
+		}
+		memcpy(*bytes, payload, *bytes_length);
+	}
+	
+	if(BENCODE_DEBUG_PRINTS) printf("load bytes (advance cursor by %li) %.*s\n", payload + *bytes_length - cursor, (int) *bytes_length, payload);
+	
+	return payload + *bytes_length;
+}
+
+// Tells apart why the token at `cursor` could not be read.
+static enum bencode_error bencode_token_error(char *cursor, char *end) {
+	char *digits = cursor;
+	if(*cursor == 'i') {
+		digits++;
+		if(digits < end && *digits == '-') digits++;
+	} else if( !(*cursor >= '0' && *cursor <= '9') ) {
+		return BENCODE_ERR_SYNTAX;
+	}
+	
+	char *run = digits;
+	while(run < end && *run >= '0' && *run <= '9') run++;
+	
+	if(run == end) return BENCODE_ERR_EOF;
+	if(run - digits > 19) return BENCODE_ERR_OVERFLOW;
+	if(*cursor != 'i' && *run == ':') return BENCODE_ERR_EOF; // payload runs past the end
+	
+	return BENCODE_ERR_SYNTAX;
+}
+
+#ifdef BENCODE_EXT_WHITESPACE
+#define BENCODE_SKIP_WHITESPACE(cursor, end) while((cursor) < (end) && isspace(*(cursor))) (cursor)++
+#else
+#define BENCODE_SKIP_WHITESPACE(cursor, end)
+#endif
+
+// A length or integer magnitude written with a leading zero, e.g. "03:abc" or "i03e".
+static int bencode_leading_zero(const char *digits) {
+	return digits[0] == '0' && digits[1] >= '0' && digits[1] <= '9';
+}
+
+// Whether the key token at `next` sorts strictly after the one at `previous`. Both were read already.
+static int bencode_key_token_ascending(char *previous, char *next, char *end) {
+	#ifdef BENCODE_EXT_STRINGS
+	if(*previous == 's' || *next == 's') return 1; // only byte string keys are ordered
+	#endif
+	
+	size_t previous_length, next_length;
+	char *a = bencode_read_length(previous, end - previous, &previous_length);
+	char *b = bencode_read_length(next, end - next, &next_length);
+	
+	int order = memcmp(a, b, (previous_length < next_length) ? previous_length : next_length);
+	return order < 0 || (order == 0 && previous_length < next_length);
+}
+
+/*
+	Checks "i<digits>e" at `cursor` like bencode_read_int(), but without
+	converting: only a 19 digit magnitude can overflow, so only that one is
+	converted. With `strict`, leading zeros are refused too.
+*/
+static char* bencode_skip_int(char *cursor, char *end, int strict) {
+	char *digits = cursor + 1;
+	if(digits < end && *digits == '-') digits++;
+	
+	char *run = digits;
+	#ifdef BENCODE_SWAR
+	for(size_t n = 8; n == 8 && end - run >= 8; run += n) {
+		uint64_t chunk;
+		memcpy(&chunk, run, sizeof(chunk));
+		n = bencode_swar_leading_digits(chunk);
+	}
+	#endif
+	while(run < end && *run >= '0' && *run <= '9') run++;
+	
+	if(run == digits || run == end || *run != 'e') return NULL;
+	if(*digits == '0' && (digits != cursor + 1 || (strict && run - digits > 1))) return NULL; // "-0", "i03e"
+	if(run - digits > 19) return NULL;
+	if(run - digits == 19) {
+		int64_t value;
+		return bencode_read_int(cursor, end - cursor, &value);
+	}
+	
+	return run + 1;
+}
+
+// What bencode_skip_value() checks beyond well-formedness.
+#define BENCODE_SKIP_STRICT 1    // integers have no leading zeros
+#define BENCODE_SKIP_CANONICAL 2 // as BENCODE_OPT_CANONICAL
+
+/*
+	Finds the end of the value at `cursor` without building or allocating
+	anything. Open containers are tracked in a bitmap on the stack (one bit:
+	list or dict), so nesting is limited to max_depth and at most
+	BENCODE_MAX_DEPTH levels. With BENCODE_SKIP_STRICT, integers with
+	leading zeros are refused as well. With BENCODE_SKIP_CANONICAL, leading
+	zeros in integers and lengths and out of order keys fail with
+	BENCODE_ERR_CANONICAL; the last key of each open dict is kept for that.
+	Returns the position after the value with *error set to BENCODE_OK, or
+	the failing position with *error set.
+*/
+static char* bencode_skip_value(char *cursor, char *end, size_t max_depth, int strict, enum bencode_error *error) {
+	uint64_t dicts[(BENCODE_MAX_DEPTH + 63) / 64];
+	char *keys[BENCODE_MAX_DEPTH]; // canonical only
+	size_t depth = 0;
+	int in_dict = 0;    // the innermost open container is a dict
+	int expect_key = 0;
+	
+	if(max_depth == 0 || max_depth > BENCODE_MAX_DEPTH) max_depth = BENCODE_MAX_DEPTH;
+	*error = BENCODE_OK;
+	
+	for(;;) {
+		if(depth) {
+			BENCODE_SKIP_WHITESPACE(cursor, end);
+			if(cursor >= end) {
+				*error = BENCODE_ERR_EOF;
+				return cursor;
+			}
+			
+			if(*cursor == 'e') {
+				if(in_dict && !expect_key) {
+					*error = BENCODE_ERR_SYNTAX; // key without a value
+					return cursor;
+				}
+				
+				cursor++;
+				if(--depth == 0) return cursor;
+				in_dict = dicts[(depth - 1) / 64] >> ((depth - 1) % 64) & 1;
+				expect_key = in_dict;
+				continue;
+			}
+		}
+		
+		if(end - cursor < 2) {
+			*error = BENCODE_ERR_EOF;
+			return cursor;
+		}
+		
+		char *next;
+		
+		if(*cursor >= '0' && *cursor <= '9') {
+			size_t length;
+			
+			if(cursor[1] == ':') {
+				// one digit lengths are the common case
+				length = *cursor - '0';
+				next = (length <= (size_t) (end - cursor - 2)) ? cursor + 2 + length : NULL;
+			} else {
+				next = bencode_read_length(cursor, end - cursor, &length);
+				if(next) next += length;
+			}
+			
+		#ifdef BENCODE_EXT_STRINGS
+		} else if(*cursor == 's') {
+			if(cursor[1] != '"') {
+				*error = BENCODE_ERR_SYNTAX;
+				return cursor;
+			}
+			
+			char *quote = cursor + 2;
+			while(quote < end && *quote != '"') {
+				if(*quote == '\\' && quote + 1 < end && quote[1] == '"') quote++;
+				quote++;
+			}
+			
+			if(quote >= end) {
+				*error = BENCODE_ERR_EOF;
+				return cursor;
+			}
+			if(quote == cursor + 2) {
+				*error = BENCODE_ERR_SYNTAX;
+				return cursor;
+			}
+			next = quote + 1;
+		#endif // BENCODE_EXT_STRINGS
+		
+		} else if(expect_key) {
+			*error = BENCODE_ERR_SYNTAX; // keys must be byte strings
+			return cursor;
+			
+		} else if(*cursor == 'i') {
+			next = bencode_skip_int(cursor, end, strict == BENCODE_SKIP_STRICT);
+			
+		} else if(*cursor == 'l' || *cursor == 'd') {
+			if(depth == max_depth) {
+				*error = BENCODE_ERR_DEPTH;
+				return cursor;
+			}
+			
+			uint64_t bit = (uint64_t) 1 << (depth % 64);
+			in_dict = (*cursor == 'd');
+			if(in_dict) dicts[depth / 64] |= bit;
+			else dicts[depth / 64] &= ~bit;
+			
+			keys[depth] = NULL;
+			depth++;
+			expect_key = in_dict;
+			cursor++;
+			continue;
+			
+		} else {
+			*error = BENCODE_ERR_SYNTAX;
+			return cursor;
+		}
+		
+		if(next == NULL) {
+			*error = bencode_token_error(cursor, end);
+			return cursor;
+		}
+		
+		if(strict == BENCODE_SKIP_CANONICAL) {
+			if(bencode_leading_zero((*cursor == 'i') ? cursor + 1 : cursor)
+				|| (expect_key && keys[depth - 1] && !bencode_key_token_ascending(keys[depth - 1], cursor, end))) {
+				*error = BENCODE_ERR_CANONICAL;
+				return cursor;
+			}
+			if(expect_key) keys[depth - 1] = cursor;
+		}
+		
+		cursor = next;
+		if(depth == 0) return cursor;
+		if(in_dict) expect_key = !expect_key;
+	}
+}
+
+/*
+	Returns the position just after the value at the start of `str`, or NULL
+	if it is invalid or runs past `length`. Nothing is allocated.
+*/
+char* bencode_skip(char *str, size_t length) {
+	enum bencode_error error;
+	char *end = bencode_skip_value(str, str + length, BENCODE_MAX_DEPTH, 0, &error);
+	return (error == BENCODE_OK) ? end : NULL;
+}
+
+/*
+	Checks that `str` holds exactly one well-formed value and nothing after
+	it, with the strict integer rules (no leading zeros, no "-0"). Nothing is
+	allocated and the stack use is fixed. Returns BENCODE_OK, or the first
+	error with its offset in *error_offset.
+*/
+enum bencode_error bencode_validate(const char *str, size_t length, size_t *error_offset) {
+	enum bencode_error error;
+	char *start = (char*) str;
+	char *end = start + length;
+	char *cursor = bencode_skip_value(start, end, BENCODE_MAX_DEPTH, BENCODE_SKIP_STRICT, &error);
+	
+	if(error == BENCODE_OK) {
+		BENCODE_SKIP_WHITESPACE(cursor, end);
+		if(cursor != end) error = BENCODE_ERR_SYNTAX; // trailing data
+	}
+	
+	if(error_offset) *error_offset = (error == BENCODE_OK) ? 0 : (size_t) (cursor - start);
+	return error;
+}
+
+char* bencode_schema_fail(char *origin, char *cursor, struct bencode_parser *parser, enum bencode_error error) {
+	parser->error = error;
+	parser->error_offset = cursor - origin;
+	return NULL;
+}
+
+char* bencode_schema_key(char *origin, char *cursor, char *end, struct bencode_bytes *key, struct bencode_parser *parser) {
+	if(cursor >= end) return bencode_schema_fail(origin, cursor, parser, BENCODE_ERR_EOF);
+	
+	char *payload = (*cursor >= '0' && *cursor <= '9') ? bencode_read_length(cursor, end - cursor, &key->length) : NULL;
+	if(payload == NULL) return bencode_schema_fail(origin, cursor, parser, bencode_token_error(cursor, end));
+	
+	key->bytes = payload;
+	return payload + key->length;
+}
+
+char* bencode_schema_int(char *origin, char *cursor, char *end, int64_t *value, struct bencode_parser *parser) {
+	if(cursor >= end) return bencode_schema_fail(origin, cursor, parser, BENCODE_ERR_EOF);
+	if(*cursor != 'i') return bencode_schema_fail(origin, cursor, parser, BENCODE_ERR_SCHEMA);
+	
+	char *next = bencode_read_int(cursor, end - cursor, value);
+	return next ? next : bencode_schema_fail(origin, cursor, parser, bencode_token_error(cursor, end));
+}
+
+char* bencode_schema_bytes(char *origin, char *cursor, char *end, struct bencode_bytes *value, struct bencode_parser *parser) {
+	if(cursor >= end) return bencode_schema_fail(origin, cursor, parser, BENCODE_ERR_EOF);
+	if(!(*cursor >= '0' && *cursor <= '9')) return bencode_schema_fail(origin, cursor, parser, BENCODE_ERR_SCHEMA);
+	return bencode_schema_key(origin, cursor, end, value, parser);
+}
+
+char* bencode_schema_skip(char *origin, char *cursor, char *end, struct bencode_parser *parser) {
+	enum bencode_error error;
+	size_t max_depth = parser->max_depth ? parser->max_depth : BENCODE_MAX_DEPTH;
+	char *next = bencode_skip_value(cursor, end, max_depth, 0, &error);
+	return (error == BENCODE_OK) ? next : bencode_schema_fail(origin, next, parser, error);
+}
+
+char* bencode_schema_list(char *origin, char *cursor, char *end, size_t *count, struct bencode_parser *parser) {
+	if(cursor >= end) return bencode_schema_fail(origin, cursor, parser, BENCODE_ERR_EOF);
+	if(*cursor != 'l') return bencode_schema_fail(origin, cursor, parser, BENCODE_ERR_SCHEMA);
+	
+	char *element = cursor + 1;
+	*count = 0;
+	while(element < end && *element != 'e') {
+		element = bencode_schema_skip(origin, element, end, parser);
+		if(element == NULL) return NULL;
+		(*count)++;
+	}
+	
+	if(element >= end) return bencode_schema_fail(origin, cursor, parser, BENCODE_ERR_EOF);
+	return cursor + 1;
+}
+
+void* bencode_schema_array(char *origin, char *cursor, size_t count, size_t size, struct bencode_parser *parser) {
+	void *array = parser->arena ? bencode_arena_alloc(parser->arena, count * size) : NULL;
+	if(array == NULL) bencode_schema_fail(origin, cursor, parser, BENCODE_ERR_NOMEM);
+	return array;
+}
+
+enum bencode_query_step {
+	BENCODE_STEP_ROOT,
+	BENCODE_STEP_KEY,
+	BENCODE_STEP_INDEX,
+	BENCODE_STEP_ANY, // [*]
+};
+
+struct bencode_query_node {
+	enum bencode_query_step step;
+	size_t key;           // BENCODE_STEP_KEY: offset into query->keys
+	size_t key_length;
+	size_t index;         // BENCODE_STEP_INDEX
+	uint32_t first_child; // 0 for none, the root is never a child
+	uint32_t next_sibling;
+	uint64_t paths;       // bit p is set if path p ends here
+};
+
+// Parses the step at `path`, storing its key bytes at `keys`; returns the position after it, or NULL.
+static const char* bencode_query_step(const char *path, int first, struct bencode_query_node *step, char *keys) {
+	memset(step, 0, sizeof(*step));
+
+	if(*path == '[') {
+		path++;
+		if(*path == '*') {
+			step->step = BENCODE_STEP_ANY;
+			path++;
+		} else {
+			if(!(*path >= '0' && *path <= '9')) return NULL;
+			step->step = BENCODE_STEP_INDEX;
+			for(; *path >= '0' && *path <= '9'; path++) {
+				if(step->index > (SIZE_MAX - 9) / 10) return NULL;
+				step->index = step->index * 10 + (*path - '0');
+			}
+		}
+		return (*path == ']') ? path + 1 : NULL;
+	}
+
+	if(*path == '.') path++;
+	else if(!first) return NULL;
+
+	step->step = BENCODE_STEP_KEY;
+	while(*path && *path != '.' && *path != '[') {
+		if(*path == '\\' && (path[1] == '.' || path[1] == '[' || path[1] == '\\')) path++;
+		keys[step->key_length++] = *path++;
+	}
+	return path;
+}
+
+int bencode_query_compile(struct bencode_query *query, const char **paths, size_t count) {
+	memset(query, 0, sizeof(*query));
+	if(count > BENCODE_QUERY_MAX_PATHS) return -1;
+
+	// every step takes at least one character, except a leading empty key
+	size_t characters = 0;
+	for(size_t p = 0; p < count; p++) characters += strlen(paths[p]) + 1;
+
+	query->nodes = bencode_heap_malloc((characters + 1) * sizeof(struct bencode_query_node));
+	query->keys = bencode_heap_malloc(characters + 1);
+	if(query->nodes == NULL || query->keys == NULL) goto fail;
+
+	memset(&query->nodes[0], 0, sizeof(struct bencode_query_node));
+	query->node_count = 1;
+	query->path_count = count;
+	size_t keys_used = 0;
+
+	for(size_t p = 0; p < count; p++) {
+		const char *path = paths[p];
+		uint32_t node = 0;
+
+		for(size_t steps = 0; *path; steps++) {
+			if(steps == BENCODE_QUERY_MAX_STEPS) goto fail;
+
+			struct bencode_query_node step;
+			path = bencode_query_step(path, steps == 0, &step, query->keys + keys_used);
+			if(path == NULL) goto fail;
+
+			// share the node with an earlier path that took the same step
+			uint32_t child = query->nodes[node].first_child;
+			for(; child; child = query->nodes[child].next_sibling) {
+				struct bencode_query_node *other = &query->nodes[child];
+				if(other->step == step.step && other->index == step.index && other->key_length == step.key_length &&
+				   0 == memcmp(query->keys + other->key, query->keys + keys_used, step.key_length)) break;
+			}
+
+			if(child == 0) {
+				child = (uint32_t) query->node_count++;
+				step.key = keys_used;
+				keys_used += step.key_length;
+				step.next_sibling = query->nodes[node].first_child;
+				query->nodes[child] = step;
+				query->nodes[node].first_child = child;
+			}
+			node = child;
+		}
+
+		query->nodes[node].paths |= (uint64_t) 1 << p;
+	}
+
+	return 0;
+
+fail:
+	bencode_query_free(query);
+	return -1;
+}
+
+void bencode_query_free(struct bencode_query *query) {
+	bencode_heap_free(query->nodes);
+	bencode_heap_free(query->keys);
+	memset(query, 0, sizeof(*query));
+}
+
+struct bencode_query_state {
+	const struct bencode_query *query;
+	char *origin;
+	char *end;
+	bencode_match_fn match;
+	void *ctx;
+
+	enum bencode_error error;
+	size_t error_offset;
+};
+
+static char* bencode_query_fail(struct bencode_query_state *state, char *cursor, enum bencode_error error) {
+	state->error = error;
+	state->error_offset = cursor - state->origin;
+	return NULL;
+}
+
+/*
+	Reads the value at `cursor`, which the trie nodes in `active` lead to.
+	Only containers that some active node has steps into are walked here;
+	everything else is skipped. The recursion is bounded by the length of
+	the longest path, not by the input.
+*/
+static char* bencode_query_value(struct bencode_query_state *state, char *cursor, const uint16_t *active, size_t active_count, size_t depth) {
+	const struct bencode_query_node *nodes = state->query->nodes;
+	char *end = state->end;
+	char *start = cursor;
+
+	uint64_t ends = 0;
+	int descend = 0;
+	for(size_t a = 0; a < active_count; a++) {
+		ends |= nodes[active[a]].paths;
+		descend |= (nodes[active[a]].first_child != 0);
+	}
+
+	struct bencode_match match = {0};
+	match.offset = start - state->origin;
+
+	if(end - cursor < 2) return bencode_query_fail(state, cursor, BENCODE_ERR_EOF);
+
+	if((*cursor == 'l' || *cursor == 'd') && descend) {
+		int dict = (*cursor == 'd');
+		size_t index = 0;
+		if(depth + 1 >= BENCODE_MAX_DEPTH) return bencode_query_fail(state, cursor, BENCODE_ERR_DEPTH);
+
+		match.type = dict ? BENCODE_DICT : BENCODE_LIST;
+		cursor++;
+
+		for(;;) {
+			BENCODE_SKIP_WHITESPACE(cursor, end);
+			if(cursor >= end) return bencode_query_fail(state, start, BENCODE_ERR_EOF);
+			if(*cursor == 'e') break;
+
+			char *key = NULL;
+			size_t key_length = 0;
+			if(dict) {
+				key = (*cursor >= '0' && *cursor <= '9') ? bencode_read_length(cursor, end - cursor, &key_length) : NULL;
+				if(key == NULL) return bencode_query_fail(state, cursor, bencode_token_error(cursor, end));
+				cursor = key + key_length;
+				BENCODE_SKIP_WHITESPACE(cursor, end);
+			}
+
+			uint16_t next[BENCODE_QUERY_MAX_PATHS];
+			size_t next_count = 0;
+			for(size_t a = 0; a < active_count; a++) {
+				for(uint32_t child = nodes[active[a]].first_child; child; child = nodes[child].next_sibling) {
+					const struct bencode_query_node *step = &nodes[child];
+					int taken = dict
+						? (step->step == BENCODE_STEP_KEY && step->key_length == key_length && 0 == memcmp(state->query->keys + step->key, key, key_length))
+						: (step->step == BENCODE_STEP_ANY || (step->step == BENCODE_STEP_INDEX && step->index == index));
+					if(taken) next[next_count++] = (uint16_t) child;
+				}
+			}
+
+			if(next_count) {
+				cursor = bencode_query_value(state, cursor, next, next_count, depth + 1);
+				if(cursor == NULL) return NULL;
+			} else {
+				enum bencode_error error;
+				char *skipped = bencode_skip_value(cursor, end, BENCODE_MAX_DEPTH - depth - 1, 0, &error);
+				if(error != BENCODE_OK) return bencode_query_fail(state, skipped, error);
+				cursor = skipped;
+			}
+			index++;
+		}
+
+		cursor++;
+		match.bytes = start;
+		match.length = cursor - start;
+
+	} else if(*cursor == 'l' || *cursor == 'd') {
+		enum bencode_error error;
+		char *skipped = bencode_skip_value(cursor, end, BENCODE_MAX_DEPTH - depth, 0, &error);
+		if(error != BENCODE_OK) return bencode_query_fail(state, skipped, error);
+
+		match.type = (*cursor == 'l') ? BENCODE_LIST : BENCODE_DICT;
+		match.bytes = start;
+		match.length = skipped - start;
+		cursor = skipped;
+
+	} else if(*cursor == 'i') {
+		char *next = bencode_read_int(cursor, end - cursor, &match.i);
+		if(next == NULL) return bencode_query_fail(state, cursor, bencode_token_error(cursor, end));
+		match.type = BENCODE_INT;
+		cursor = next;
+
+	} else if(*cursor >= '0' && *cursor <= '9') {
+		match.bytes = bencode_read_length(cursor, end - cursor, &match.length);
+		if(match.bytes == NULL) return bencode_query_fail(state, cursor, bencode_token_error(cursor, end));
+		match.type = BENCODE_BYTES;
+		cursor = match.bytes + match.length;
+
+	} else {
+		return bencode_query_fail(state, cursor, BENCODE_ERR_SYNTAX);
+	}
+
+	for(; ends; ends &= ends - 1) {
+		match.path = __builtin_ctzll(ends);
+		state->match(state->ctx, &match);
+	}
+
+	return cursor;
+}
+
+enum bencode_error bencode_query_run(const struct bencode_query *query, char *str, size_t length, bencode_match_fn match, void *ctx, size_t *error_offset) {
+	struct bencode_query_state state = { query, str, str + length, match, ctx, BENCODE_OK, 0 };
+	uint16_t root = 0;
+
+	bencode_query_value(&state, str, &root, 1, 0);
+	if(error_offset) *error_offset = state.error_offset;
+	return state.error;
+}
+
+/*
+	The tree builder. It does not recurse: open containers live on an
+	explicit stack of frames, the first BENCODE_INLINE_DEPTH of them on the C
+	stack and deeper ones on the heap, and nesting beyond the parser's
+	max_depth is refused. The C stack use is fixed, and the heap use is at
+	most max_depth frames.
+	
+	On failure the position of the value that could not be parsed is
+	returned (for an unterminated container, the container itself), and the
+	tree built so far is left in place for bencode_free().
+	
+	Spans and error offsets are measured from `origin`, which is `str`
+	unless only part of a larger input is being parsed.
+*/
+struct bencode_frame {
+	struct bencode *container;
+	struct bencode *tail; // last child so far
+	char *start;          // the container's 'l' or 'd'
+};
+
+// Whether `next` sorts strictly after `previous`. Keys nearly always differ in their first byte.
+static int bencode_key_ascending(const struct bencode *previous, const struct bencode *next) {
+	if(previous->key_length && next->key_length && previous->key[0] != next->key[0])
+		return (unsigned char) previous->key[0] < (unsigned char) next->key[0];
+	return bencode_key_order(&previous, &next) < 0;
+}
+
+static char* bencode_parse_range(char *origin, char *str, size_t length, struct bencode *dest, struct bencode_parser *parser) {
+	if(BENCODE_DEBUG_PRINTS) printf("PARSING: %.*s\n", (int) length, str);
+	
+	char *cursor = str;
+	char *end = str + length;
+	size_t max_depth = parser->max_depth ? parser->max_depth : BENCODE_MAX_DEPTH;
+	
+	struct bencode_frame inline_stack[BENCODE_INLINE_DEPTH];
+	struct bencode_frame *stack = inline_stack;
+	size_t stack_capacity = BENCODE_INLINE_DEPTH;
+	size_t depth = 0;
+	
+	struct bencode *node = dest;
+	enum bencode_error error = BENCODE_ERR_SYNTAX;
+	
+	parser->error = BENCODE_OK;
+	parser->error_offset = 0;
+	dest->next = NULL;
+	BENCODE_SET_PARENT(dest, NULL);
+	
+	for(;;) {
+		// parse one value into node
+		BENCODE_SPAN_BEGIN(node, cursor - origin);
+		
+		if(end - cursor < 2) {
+			error = BENCODE_ERR_EOF;
+			goto fail;
+		}
+		
+		if(*cursor == 'i') {
+			char *e = (parser->flags & BENCODE_OPT_PADDED) ? bencode_read_int_padded(cursor, end, &node->i)
+				: bencode_read_int(cursor, end - cursor, &node->i);
+			if(e == NULL) {
+				error = bencode_token_error(cursor, end);
+				goto fail;
+			}
+			if(BENCODE_DEBUG_PRINTS) printf("load int %li\n", node->i);
+			if((parser->flags & BENCODE_OPT_CANONICAL) && bencode_leading_zero(cursor + 1)) {
+				error = BENCODE_ERR_CANONICAL;
+				goto fail;
+			}
+			
+			node->type = BENCODE_INT;
+			cursor = e;
+			BENCODE_SPAN_END(node, cursor - origin);
+			
+		} else if( (*cursor >= '0' && *cursor <= '9')
+			#ifdef BENCODE_EXT_STRINGS
+			|| *cursor == 's'
+			#endif
+		) {
+			char *bytes;
+			size_t bytes_length;
+			int borrowed;
+			char *next = bencode_parse_bytes(cursor, end, parser, &bytes, &bytes_length, &borrowed);
+			if(next == NULL) {
+				error = parser->error ? parser->error : bencode_token_error(cursor, end); // NOMEM from the copy
+				goto fail;
+			}
+			
+			node->type = BENCODE_BYTES;
+			node->bytes = bytes;
+			node->length = bytes_length;
+			node->flags &= ~(BENCODE_FLAG_BORROWED | BENCODE_FLAG_ARENA);
+			if(borrowed) node->flags |= BENCODE_FLAG_BORROWED;
+			else if(parser->arena) node->flags |= BENCODE_FLAG_ARENA;
+			
+			// checked once the copy belongs to the node, so bencode_free() releases it
+			if((parser->flags & BENCODE_OPT_CANONICAL) && bencode_leading_zero(cursor)) {
+				error = BENCODE_ERR_CANONICAL;
+				goto fail;
+			}
+			
+			cursor = next;
+			BENCODE_SPAN_END(node, cursor - origin);
+			
+		} else if(*cursor == 'l' || *cursor == 'd') {
+			if(depth == max_depth) {
+				error = BENCODE_ERR_DEPTH;
+				goto fail;
+			}
+			
+			if((parser->flags & BENCODE_OPT_LAZY) && depth > 0) {
+				int checks = (parser->flags & BENCODE_OPT_CANONICAL) ? BENCODE_SKIP_CANONICAL : 0;
+				char *skipped = bencode_skip_value(cursor, end, max_depth - depth, checks, &error);
+				if(error != BENCODE_OK) {
+					cursor = skipped;
+					goto fail;
+				}
+				
+				node->type = (*cursor == 'l') ? BENCODE_LIST : BENCODE_DICT;
+				node->bytes = cursor;
+				node->length = skipped - cursor;
+				node->flags |= BENCODE_FLAG_LAZY;
+				cursor = skipped;
+				BENCODE_SPAN_END(node, cursor - origin);
+				goto next_value;
+			}
+			
+			if(depth == stack_capacity) {
+				size_t capacity = stack_capacity * 2;
+				if(capacity > max_depth) capacity = max_depth;
+				
+				// with an arena the frames come from it too, so deep documents need no malloc
+				struct bencode_frame *grown;
+				if(parser->arena) grown = bencode_arena_alloc(parser->arena, capacity * sizeof(struct bencode_frame));
+				else grown = bencode_heap_realloc((stack == inline_stack) ? NULL : stack, capacity * sizeof(struct bencode_frame));
+				if(grown == NULL) {
+					error = BENCODE_ERR_NOMEM;
+					goto fail;
+				}
+				if(stack == inline_stack || parser->arena) memcpy(grown, stack, stack_capacity * sizeof(struct bencode_frame));
+				
+				stack = grown;
+				stack_capacity = capacity;
+			}
+			
+			node->type = (*cursor == 'l') ? BENCODE_LIST : BENCODE_DICT;
+			node->list = NULL;
+			if(BENCODE_DEBUG_PRINTS) printf("start %s %p\n", (node->type == BENCODE_LIST) ? "list" : "dict", (void*) cursor);
+			
+			stack[depth].container = node;
+			stack[depth].tail = NULL;
+			stack[depth].start = cursor;
+			depth++;
+			cursor++;
+			
+		} else {
+			error = BENCODE_ERR_SYNTAX; // not left over from an earlier lazy skip
+			goto fail;
+		}
+		
+	next_value:
+		BENCODE_STAT_NODE(node->type);
+		
+		// close finished containers, then set up the node for the next value
+		for(;;) {
+			if(depth == 0) goto done;
+			
+			BENCODE_SKIP_WHITESPACE(cursor, end);
+			
+			if(cursor >= end) {
+				cursor = stack[depth - 1].start;
+				error = BENCODE_ERR_EOF;
+				goto fail;
+			}
+			
+			if(*cursor != 'e') break;
+			
+			if(BENCODE_DEBUG_PRINTS) printf("end container %p\n", (void*) cursor);
+			BENCODE_SPAN_END(stack[depth - 1].container, cursor + 1 - origin);
+			depth--;
+			cursor++;
+		}
+		
+		struct bencode_frame *frame = &stack[depth - 1];
+		struct bencode *previous = frame->tail;
+		
+		node = bencode_alloc(parser, sizeof(struct bencode));
+		if(node == NULL) {
+			error = BENCODE_ERR_NOMEM;
+			goto fail;
+		}
+		memset(node, 0, sizeof(struct bencode));
+		BENCODE_SET_PARENT(node, frame->container);
+		
+		if(frame->tail) frame->tail->next = node;
+		else frame->container->list = node;
+		frame->tail = node;
+		
+		if(frame->container->type == BENCODE_DICT) {
+			// keys must be byte strings
+			char *next = NULL;
+			
+			if(end - cursor >= 2 && (
+				(*cursor >= '0' && *cursor <= '9')
+				#ifdef BENCODE_EXT_STRINGS
+				|| *cursor == 's'
+				#endif
+			)) next = bencode_parse_key(cursor, end, parser, node);
+			
+			if(next == NULL) {
+				error = parser->error ? parser->error : bencode_token_error(cursor, end);
+				goto fail;
+			}
+			
+			// canonical dicts have strictly ascending keys, so the previous key is all there is to check
+			if((parser->flags & BENCODE_OPT_CANONICAL) && (bencode_leading_zero(cursor)
+				|| (previous && !bencode_key_ascending(previous, node)))) {
+				error = BENCODE_ERR_CANONICAL;
+				goto fail;
+			}
+			
+			cursor = next;
+			BENCODE_SKIP_WHITESPACE(cursor, end);
+		}
+	}
+	
+done:
+	if(stack != inline_stack && !parser->arena) bencode_heap_free(stack);
+	return cursor;
+	
+fail:
+	if(stack != inline_stack && !parser->arena) bencode_heap_free(stack);
+	parser->error = error;
+	parser->error_offset = cursor - origin;
+	return cursor;
+}
+
+static char* bencode_parse_internal(char *str, size_t length, struct bencode *dest, struct bencode_parser *parser) {
+	return bencode_parse_range(str, str, length, dest, parser);
+}
+
+/*
+	Finds the end of a list or dict whose span was already checked by
+	bencode_skip_value(), so nothing is validated or bounds checked again.
+*/
+static char* bencode_skip_span(char *cursor) {
+	size_t depth = 0;
+	
+	do {
+		switch(*cursor) {
+			case 'l':
+			case 'd':
+				depth++;
+				cursor++;
+				break;
+			
+			case 'e':
+				depth--;
+				cursor++;
+				break;
+			
+			case 'i':
+				while(*cursor != 'e') cursor++;
+				cursor++;
+				break;
+			
+			#ifdef BENCODE_EXT_STRINGS
+			case 's':
+				cursor += 2;
+				while(*cursor != '"') cursor += (*cursor == '\\' && cursor[1] == '"') ? 2 : 1;
+				cursor++;
+				break;
+			#endif
+			
+			default: {
+				#ifdef BENCODE_EXT_WHITESPACE
+				if(isspace(*cursor)) {
+					cursor++;
+					break;
+				}
+				#endif
+				
+				size_t length = 0;
+				while(*cursor != ':') length = length * 10 + (*cursor++ - '0');
+				cursor += 1 + length;
+			}
+		}
+	} while(depth);
+	
+	return cursor;
+}
+
+/*
+	Builds the children of a lazy list or dict, one level deep: containers
+	among them stay lazy. The span was validated when the node was parsed,
+	so this only fails if memory runs out, or with BENCODE_OPT_CANONICAL if
+	the level is not canonical (spans skipped by a canonical parse always
+	are). A NULL parser allocates from the heap. Returns 0, or -1 with the
+	node left lazy (and parser->error set, with the offset in the span, if
+	given).
+*/
+int bencode_expand(struct bencode *b, struct bencode_parser *parser) {
+	if(!(b->flags & BENCODE_FLAG_LAZY)) return 0;
+	
+	struct bencode_parser lazy = {0};
+	if(parser) lazy = *parser;
+	lazy.flags |= BENCODE_OPT_LAZY;
+	
+	char *span = b->bytes;
+	char *cursor = span + 1;
+	char *end = span + b->length - 1; // the closing 'e'
+	char *start = cursor;
+	int canonical = (lazy.flags & BENCODE_OPT_CANONICAL) != 0;
+	enum bencode_error error = BENCODE_ERR_NOMEM;
+	struct bencode *previous = NULL;
+	
+	b->flags &= ~BENCODE_FLAG_LAZY;
+	b->list = NULL;
+	struct bencode **link = &b->list;
+	
+	for(;;) {
+		BENCODE_SKIP_WHITESPACE(cursor, end);
+		if(cursor == end) break;
+		
+		start = cursor;
+		struct bencode *node = bencode_alloc(&lazy, sizeof(struct bencode));
+		if(node == NULL) goto fail;
+		memset(node, 0, sizeof(struct bencode));
+		BENCODE_SET_PARENT(node, b);
+		*link = node;
+		link = &node->next;
+		
+		int borrowed;
+		if(b->type == BENCODE_DICT) {
+			cursor = bencode_parse_key(cursor, end, &lazy, node);
+			if(cursor == NULL) goto fail;
+			if(canonical && (bencode_leading_zero(start) || (previous && !bencode_key_ascending(previous, node)))) {
+				error = BENCODE_ERR_CANONICAL;
+				goto fail;
+			}
+			previous = node;
+			BENCODE_SKIP_WHITESPACE(cursor, end);
+		}
+		
+		BENCODE_SPAN_BEGIN(node, b->span_begin + (cursor - span));
+		
+		if(canonical && bencode_leading_zero((*cursor == 'i') ? cursor + 1 : cursor)) {
+			start = cursor;
+			error = BENCODE_ERR_CANONICAL;
+			goto fail;
+		}
+		
+		if(*cursor == 'i') {
+			node->type = BENCODE_INT;
+			cursor = bencode_read_int(cursor, end - cursor, &node->i);
+			
+		} else if(*cursor == 'l' || *cursor == 'd') {
+			char *skipped = bencode_skip_span(cursor);
+			node->type = (*cursor == 'l') ? BENCODE_LIST : BENCODE_DICT;
+			node->flags |= BENCODE_FLAG_LAZY;
+			node->bytes = cursor;
+			node->length = skipped - cursor;
+			cursor = skipped;
+			
+		} else {
+			node->type = BENCODE_BYTES;
+			cursor = bencode_parse_bytes(cursor, end, &lazy, &node->bytes, &node->length, &borrowed);
+			if(cursor == NULL) goto fail;
+			if(borrowed) node->flags |= BENCODE_FLAG_BORROWED;
+			else if(lazy.arena) node->flags |= BENCODE_FLAG_ARENA;
+		}
+		
+		BENCODE_STAT_NODE(node->type);
+		BENCODE_SPAN_END(node, b->span_begin + (cursor - span));
+	}
+	
+	return 0;
+	
+fail:
+	if(lazy.arena == NULL) bencode_free(b);
+	b->bytes = span;
+	b->flags |= BENCODE_FLAG_LAZY;
+	if(parser) {
+		parser->error = error;
+		parser->error_offset = start - span;
+	}
+	return -1;
+}
+
+#ifdef BENCODE_SPANS
+const char* bencode_span(const struct bencode *b, const char *input, size_t *length) {
+	*length = b->span_end - b->span_begin;
+	return input + b->span_begin;
+}
+
+void bencode_hash_span(const struct bencode *b, const char *input, bencode_span_fn update, void *ctx) {
+	update(ctx, input + b->span_begin, b->span_end - b->span_begin);
+}
+#endif // BENCODE_SPANS
+
+void print_bencode(struct bencode *b, int indent) {
+	for(int i = 0; i < indent; i++)
+		printf("\t");
+		
+	if(!b->type) {
+		printf("struct bencode {addr=%p, type=(uninitialized)}\n", (void*) b);
+		return;
+	}
+
+	#ifdef BENCODE_PRINT_ADDRESSES
+	printf("struct bencode {addr=%p, next=%p, type=%u, ", (void*) b, (void*) b->next, b->type);
+	#else
+	printf("struct bencode {next=%p, type=%u, ", (void*) b->next, b->type);
+	#endif
+	
+	if(b->key) {
+		printf("key_length=%li key=\"", b->key_length);
+		for(unsigned int i = 0; i < b->key_length; i++) printf("%c", b->key[i]);
+		printf("\", ");
+	}
+	
+	if(b->type == BENCODE_INT)
+		printf("int=%li", b->i);
+	
+	if(b->type == BENCODE_BYTES) {
+		printf("length=%zu, bytes=\"", b->length);
+		for(unsigned int i = 0; i < b->length; i++) printf("%c", b->bytes[i]);
+		printf("\"");
+	}
+	
+	if(b->flags & BENCODE_FLAG_LAZY) {
+		printf("%s=(lazy), length=%zu, bytes=\"%.*s\"}\n", (b->type == BENCODE_LIST) ? "list" : "dict", b->length, (int) b->length, b->bytes);
+		return;
+	}
+	
+	if(b->type == BENCODE_LIST || b->type == BENCODE_DICT) {
+		printf( ((b->type == BENCODE_LIST) ? "list=%p\n" : "dict=%p\n"), (void*) b->list);
+		struct bencode *element = b->list;
+		
+		while(element) {
+			print_bencode(element, indent+1);
+			element = element->next;
+		}
+	}
+	
+	if(b->type == BENCODE_LIST || b->type == BENCODE_DICT)
+		for(int i = 0; i < indent; i++)
+			printf("\t");
+	
+	printf("}\n");
+}
+
+// Does not recurse: a container's children are spliced in front of it, so it is freed after them.
+void bencode_free(struct bencode *b) {
+	if(b->type == BENCODE_BYTES) {
+		if(!(b->flags & BENCODE_FLAG_BORROWED)) bencode_heap_free(b->bytes);
+		b->bytes = NULL;
+	}
+	
+	if(!(b->type == BENCODE_LIST || b->type == BENCODE_DICT) || (b->flags & BENCODE_FLAG_LAZY)) return;
+	
+	struct bencode *head = b->list;
+	while(head) {
+		struct bencode *node = head;
+		head = head->next;
+		
+		if(node->type == BENCODE_BYTES) {
+			if(!(node->flags & BENCODE_FLAG_BORROWED)) bencode_heap_free(node->bytes);
+		} else if((node->type == BENCODE_LIST || node->type == BENCODE_DICT) && !(node->flags & BENCODE_FLAG_LAZY) && node->list) {
+			struct bencode *last = node->list;
+			while(last->next) last = last->next;
+			last->next = node;
+			node->next = head;
+			head = node->list;
+			node->list = NULL;
+			continue;
+		}
+		
+		// only dict entries have keys
+		if(!(node->flags & (BENCODE_FLAG_BORROWED_KEY | BENCODE_FLAG_INTERNED_KEY))) bencode_heap_free(node->key);
+		bencode_heap_free(node);
+	}
+}
+
+static const char bencode_digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static int bencode_count_digits(uint64_t value) {
+	int digits = 1;
+	for(;;) {
+		if(value < 10) return digits;
+		if(value < 100) return digits + 1;
+		if(value < 1000) return digits + 2;
+		if(value < 10000) return digits + 3;
+		value /= 10000;
+		digits += 4;
+	}
+}
+
+// Writes `value` in decimal at `out`, two digits per step, and returns the end.
+static char* bencode_write_u64(char *out, uint64_t value) {
+	int digits = bencode_count_digits(value);
+	char *cursor = out + digits;
+	
+	while(value >= 100) {
+		unsigned int pair = (unsigned int) (value % 100) * 2;
+		value /= 100;
+		*--cursor = bencode_digit_pairs[pair + 1];
+		*--cursor = bencode_digit_pairs[pair];
+	}
+	
+	if(value >= 10) {
+		*--cursor = bencode_digit_pairs[value * 2 + 1];
+		*--cursor = bencode_digit_pairs[value * 2];
+	} else {
+		*--cursor = '0' + (char) value;
+	}
+	
+	return out + digits;
+}
+
+static uint64_t bencode_int_magnitude(int64_t i) {
+	return (i < 0) ? (uint64_t) 0 - (uint64_t) i : (uint64_t) i;
+}
+
+/*
+	The encoder and the size walks do not recurse either. Open containers live
+	on a stack of frames, the first BENCODE_INLINE_DEPTH of them on the C
+	stack and deeper ones on the heap. The children of canonical dicts are
+	sorted into one shared key list, its first BENCODE_ENCODE_INLINE_KEYS
+	entries on the C stack too.
+*/
+struct bencode_encode_frame {
+	const struct bencode *container;
+	const struct bencode *child; // next child, unless sorted
+	size_t keys_start;           // canonical dicts: their children, sorted, are keys[keys_start ... keys_end - 1]
+	size_t keys_next;
+	size_t keys_end;
+};
+
+struct bencode_encoder {
+	struct bencode_encode_frame inline_stack[BENCODE_INLINE_DEPTH];
+	struct bencode_encode_frame *stack;
+	size_t capacity;
+	size_t depth;
+	
+	const struct bencode *inline_keys[BENCODE_ENCODE_INLINE_KEYS];
+	const struct bencode **keys;
+	size_t keys_capacity;
+	size_t keys_used;
+};
+
+static void bencode_encoder_init(struct bencode_encoder *encoder) {
+	encoder->stack = encoder->inline_stack;
+	encoder->capacity = BENCODE_INLINE_DEPTH;
+	encoder->depth = 0;
+	encoder->keys = encoder->inline_keys;
+	encoder->keys_capacity = BENCODE_ENCODE_INLINE_KEYS;
+	encoder->keys_used = 0;
+}
+
+static void bencode_encoder_release(struct bencode_encoder *encoder) {
+	if(encoder->stack != encoder->inline_stack) bencode_heap_free(encoder->stack);
+	if(encoder->keys != encoder->inline_keys) bencode_heap_free(encoder->keys);
+}
+
+// Grows a buffer that starts out as `inline_buffer` to at least `needed` elements.
+static void* bencode_encoder_grow(void *buffer, void *inline_buffer, size_t *capacity, size_t needed, size_t element_size) {
+	size_t grown_capacity = *capacity;
+	while(grown_capacity < needed) grown_capacity *= 2;
+	
+	void *grown;
+	if(buffer == inline_buffer) {
+		grown = bencode_heap_malloc(grown_capacity * element_size);
+		if(grown) memcpy(grown, buffer, *capacity * element_size);
+	} else {
+		grown = bencode_heap_realloc(buffer, grown_capacity * element_size);
+	}
+	
+	if(grown) *capacity = grown_capacity;
+	return grown;
+}
+
+// Opens a list or dict; bencode_encoder_next() then returns its children in order.
+static int bencode_encoder_push(struct bencode_encoder *encoder, const struct bencode *container, unsigned int flags) {
+	if(encoder->depth == encoder->capacity) {
+		struct bencode_encode_frame *stack = bencode_encoder_grow(encoder->stack, encoder->inline_stack,
+			&encoder->capacity, encoder->depth + 1, sizeof(struct bencode_encode_frame));
+		if(stack == NULL) return -1;
+		encoder->stack = stack;
+	}
+	
+	struct bencode_encode_frame *frame = &encoder->stack[encoder->depth++];
+	frame->container = container;
+	frame->child = container->list;
+	frame->keys_start = frame->keys_next = frame->keys_end = encoder->keys_used;
+	
+	if(container->type == BENCODE_DICT && (flags & BENCODE_ENCODE_CANONICAL)) {
+		size_t count = 0;
+		for(const struct bencode *child = container->dict; child; child = child->next) count++;
+		
+		if(encoder->keys_used + count > encoder->keys_capacity) {
+			const struct bencode **keys = bencode_encoder_grow(encoder->keys, encoder->inline_keys,
+				&encoder->keys_capacity, encoder->keys_used + count, sizeof(struct bencode*));
+			if(keys == NULL) return -1;
+			encoder->keys = keys;
+		}
+		
+		const struct bencode **children = encoder->keys + encoder->keys_used;
+		count = 0;
+		for(const struct bencode *child = container->dict; child; child = child->next) children[count++] = child;
+		qsort(children, count, sizeof(struct bencode*), bencode_key_order);
+		
+		encoder->keys_used += count;
+		frame->child = NULL;
+		frame->keys_end = encoder->keys_used;
+	}
+	
+	return 0;
+}
+
+// The next child of the innermost open container, or NULL after the last one.
+static const struct bencode* bencode_encoder_next(struct bencode_encoder *encoder) {
+	struct bencode_encode_frame *frame = &encoder->stack[encoder->depth - 1];
+	
+	if(frame->keys_next < frame->keys_end) return encoder->keys[frame->keys_next++];
+	
+	const struct bencode *child = frame->child;
+	if(child) frame->child = child->next;
+	return child;
+}
+
+static void bencode_encoder_pop(struct bencode_encoder *encoder) {
+	encoder->keys_used = encoder->stack[--encoder->depth].keys_start;
+}
+
+static int bencode_encoder_in_dict(const struct bencode_encoder *encoder) {
+	return encoder->stack[encoder->depth - 1].container->type == BENCODE_DICT;
+}
+
+// Whether `b` is written as 'l' or 'd', its children, and 'e'.
+static int bencode_encode_opens(const struct bencode *b) {
+	return (b->type == BENCODE_LIST || b->type == BENCODE_DICT) && !(b->flags & BENCODE_FLAG_LAZY);
+}
+
+#ifdef BENCODE_SPANS
+static int bencode_patch_whole(const struct bencode *b);
+static size_t bencode_patched_whole_size(const struct bencode *b);
+static char* bencode_encode_patched_whole(const struct bencode *b, const char *input, char *cursor, char *end);
+#endif
+
+// The size of `b` encoded, or with `patched`, as bencode_encode_patched() writes it. 0 if out of memory.
+static size_t bencode_size_walk(const struct bencode *b, int patched) {
+	struct bencode_encoder encoder;
+	bencode_encoder_init(&encoder);
+	
+	const struct bencode *node = b;
+	size_t size = 0;
+	(void) patched;
+	
+	for(;;) {
+		#ifdef BENCODE_SPANS
+		if(patched && bencode_patch_whole(node)) {
+			size_t whole = bencode_patched_whole_size(node);
+			if(whole == 0) goto nomem;
+			size += whole;
+		} else
+		#endif
+		if(bencode_encode_opens(node)) {
+			if(bencode_encoder_push(&encoder, node, 0)) goto nomem;
+			size += 2;
+		} else if(node->type == BENCODE_INT) {
+			size += 2 + (node->i < 0) + bencode_count_digits(bencode_int_magnitude(node->i));
+		} else if(node->type == BENCODE_BYTES) {
+			size += bencode_count_digits(node->length) + 1 + node->length;
+		} else {
+			size += node->length; // lazy, written as parsed
+		}
+		
+		// on to the next child, past the containers that are done
+		while(encoder.depth && (node = bencode_encoder_next(&encoder)) == NULL) bencode_encoder_pop(&encoder);
+		if(encoder.depth == 0) break;
+		
+		if(bencode_encoder_in_dict(&encoder))
+			size += bencode_count_digits(node->key_length) + 1 + node->key_length;
+	}
+	
+	bencode_encoder_release(&encoder);
+	return size;
+	
+nomem:
+	bencode_encoder_release(&encoder);
+	return 0;
+}
+
+size_t bencode_encoded_size(const struct bencode *b) {
+	return bencode_size_walk(b, 0);
+}
+
+static char* bencode_encode_bytes(char *cursor, char *end, const char *bytes, size_t length) {
+	if((size_t) (end - cursor) < bencode_count_digits(length) + 1 + length) return NULL;
+	
+	cursor = bencode_write_u64(cursor, length);
+	*cursor++ = ':';
+	if(length) memcpy(cursor, bytes, length);
+	return cursor + length;
+}
+
+// Writes `b`, or with an `input`, patches it as bencode_encode_patched() does. NULL if out of space or memory.
+static char* bencode_encode_walk(const struct bencode *b, const char *input, char *cursor, char *end, unsigned int flags) {
+	struct bencode_encoder encoder;
+	bencode_encoder_init(&encoder);
+	
+	const struct bencode *node = b;
+	(void) input;
+	
+	for(;;) {
+		#ifdef BENCODE_SPANS
+		if(input && bencode_patch_whole(node)) {
+			cursor = bencode_encode_patched_whole(node, input, cursor, end);
+		} else
+		#endif
+		if(bencode_encode_opens(node)) {
+			if(cursor == end || bencode_encoder_push(&encoder, node, flags)) cursor = NULL;
+			else *cursor++ = (node->type == BENCODE_LIST) ? 'l' : 'd';
+		} else if(node->type == BENCODE_INT) {
+			uint64_t magnitude = bencode_int_magnitude(node->i);
+			if((size_t) (end - cursor) < (size_t) (2 + (node->i < 0) + bencode_count_digits(magnitude))) {
+				cursor = NULL;
+			} else {
+				*cursor++ = 'i';
+				if(node->i < 0) *cursor++ = '-';
+				cursor = bencode_write_u64(cursor, magnitude);
+				*cursor++ = 'e';
+			}
+		} else if(node->type == BENCODE_BYTES) {
+			cursor = bencode_encode_bytes(cursor, end, node->bytes, node->length);
+		} else if((size_t) (end - cursor) < node->length) {
+			cursor = NULL;
+		} else {
+			// lazy, written as parsed, even in canonical mode
+			memcpy(cursor, node->bytes, node->length);
+			cursor += node->length;
+		}
+		if(cursor == NULL) break;
+		
+		// on to the next child, closing the containers that are done
+		while(encoder.depth && (node = bencode_encoder_next(&encoder)) == NULL) {
+			if(cursor == end) break;
+			*cursor++ = 'e';
+			bencode_encoder_pop(&encoder);
+		}
+		if(encoder.depth == 0) break;
+		if(node == NULL) {
+			cursor = NULL;
+			break;
+		}
+		
+		if(bencode_encoder_in_dict(&encoder)) cursor = bencode_encode_bytes(cursor, end, node->key, node->key_length);
+		if(cursor == NULL) break;
+	}
+	
+	bencode_encoder_release(&encoder);
+	return cursor;
+}
+
+char* bencode_encode(const struct bencode *b, char *buffer, size_t size, unsigned int flags) {
+	return bencode_encode_walk(b, NULL, buffer, buffer + size, flags);
+}
+
+#ifdef BENCODE_SPANS
+// Marks the containers from `b` up. Marked ones have all their ancestors marked already.
+static void bencode_mark_ancestors(struct bencode *b) {
+	for(; b && !(b->flags & BENCODE_FLAG_DIRTY_CHILD); b = b->parent)
+		b->flags |= BENCODE_FLAG_DIRTY_CHILD;
+}
+
+void bencode_touch(struct bencode *b) {
+	// a lazy container cannot have changed inside; it is written as parsed
+	if((b->type == BENCODE_LIST || b->type == BENCODE_DICT) && !(b->flags & BENCODE_FLAG_LAZY))
+		bencode_mark_ancestors(b);
+}
+
+int bencode_set_int(struct bencode *b, int64_t value) {
+	if(b->type != BENCODE_INT) return -1;
+	
+	b->i = value;
+	b->flags |= BENCODE_FLAG_DIRTY;
+	bencode_mark_ancestors(b->parent);
+	return 0;
+}
+
+int bencode_set_bytes(struct bencode *b, char *bytes, size_t length, struct bencode_parser *parser) {
+	if(b->type != BENCODE_BYTES) return -1;
+	
+	struct bencode_parser heap = {0};
+	if(parser == NULL) {
+		if(b->flags & BENCODE_FLAG_ARENA) return -1; // the tree lives in an arena, nothing would free a heap copy
+		parser = &heap;
+	}
+	
+	char *copy = bytes;
+	if(!(parser->flags & (BENCODE_OPT_BORROW | BENCODE_OPT_LAZY))) {
+		copy = bencode_alloc_bytes(parser, length);
+		if(copy == NULL && length) return -1;
+		if(length) memcpy(copy, bytes, length);
+	}
+	
+	if(!(b->flags & (BENCODE_FLAG_BORROWED | BENCODE_FLAG_ARENA))) bencode_heap_free(b->bytes);
+	
+	b->bytes = copy;
+	b->length = length;
+	b->flags &= ~(BENCODE_FLAG_BORROWED | BENCODE_FLAG_ARENA);
+	if(copy == bytes) b->flags |= BENCODE_FLAG_BORROWED;
+	else if(parser->arena) b->flags |= BENCODE_FLAG_ARENA;
+	b->flags |= BENCODE_FLAG_DIRTY;
+	bencode_mark_ancestors(b->parent);
+	return 0;
+}
+
+// Untouched parsed values are copied from the input as they are.
+static int bencode_is_clean(const struct bencode *b) {
+	return !(b->flags & (BENCODE_FLAG_DIRTY | BENCODE_FLAG_DIRTY_CHILD)) && b->span_end != 0;
+}
+
+// Values written in one piece, copied from the input or encoded again; the others are opened to reach their changes.
+static int bencode_patch_whole(const struct bencode *b) {
+	return bencode_is_clean(b) || !(b->flags & BENCODE_FLAG_DIRTY_CHILD) || (b->flags & BENCODE_FLAG_DIRTY);
+}
+
+static size_t bencode_patched_whole_size(const struct bencode *b) {
+	if(bencode_is_clean(b)) return b->span_end - b->span_begin;
+	return bencode_size_walk(b, 0);
+}
+
+static char* bencode_encode_patched_whole(const struct bencode *b, const char *input, char *cursor, char *end) {
+	if(bencode_is_clean(b)) {
+		size_t length = b->span_end - b->span_begin;
+		if((size_t) (end - cursor) < length) return NULL;
+		memcpy(cursor, input + b->span_begin, length);
+		return cursor + length;
+	}
+	
+	return bencode_encode_walk(b, NULL, cursor, end, 0);
+}
+
+size_t bencode_patched_size(const struct bencode *b) {
+	return bencode_size_walk(b, 1);
+}
+
+char* bencode_encode_patched(const struct bencode *b, const char *input, char *buffer, size_t size) {
+	return bencode_encode_walk(b, input, buffer, buffer + size, 0);
+}
+#endif // BENCODE_SPANS
+
+static struct bencode_tape_entry* bencode_tape_push(struct bencode_tape *tape) {
+	if(tape->count == tape->capacity) {
+		size_t capacity = tape->capacity ? tape->capacity * 2 : 64;
+		struct bencode_tape_entry *entries = bencode_heap_realloc(tape->entries, capacity * sizeof(struct bencode_tape_entry));
+		if(entries == NULL) return NULL;
+		tape->entries = entries;
+		tape->capacity = capacity;
+	}
+	
+	return &tape->entries[tape->count++];
+}
+
+/*
+	Builds the tape without recursion. While a container is open its `end`
+	holds the index of the enclosing open container plus one (0 at the top
+	level) and its `length` counts the entries directly inside it; both are
+	fixed up when the container's 'e' is read.
+*/
+char* bencode_parse_tape(char *str, size_t length, struct bencode_tape *tape) {
+	char *cursor = str;
+	char *end = str + length;
+	size_t open = 0; // index of the innermost open container plus one
+	
+	tape->count = 0;
+	
+	do {
+		if(cursor >= end) return str;
+		
+		struct bencode_tape_entry *parent = open ? &tape->entries[open - 1] : NULL;
+		
+		if(*cursor == 'e' && parent) {
+			if(parent->type == BENCODE_DICT) {
+				if(parent->length % 2) return str; // key without a value
+				parent->length /= 2;
+			}
+			
+			open = parent->end;
+			parent->end = tape->count;
+			cursor++;
+			continue;
+		}
+		
+		// dict keys must be byte strings
+		if(parent && parent->type == BENCODE_DICT && parent->length % 2 == 0)
+			if( !(*cursor >= '0' && *cursor <= '9') ) return str;
+		
+		if(parent) {
+			if(parent->length == UINT32_MAX) return str;
+			parent->length++;
+		}
+		
+		struct bencode_tape_entry *entry = bencode_tape_push(tape);
+		if(entry == NULL) return str;
+		
+		if(*cursor == 'i') {
+			entry->type = BENCODE_INT;
+			entry->length = 0;
+			cursor = bencode_read_int(cursor, end - cursor, &entry->i);
+			if(cursor == NULL) return str;
+			
+		} else if(*cursor >= '0' && *cursor <= '9') {
+			size_t bytes_length;
+			char *payload = bencode_read_length(cursor, end - cursor, &bytes_length);
+			if(payload == NULL || bytes_length > UINT32_MAX) return str;
+			
+			entry->type = BENCODE_BYTES;
+			entry->length = bytes_length;
+			entry->bytes = payload;
+			cursor = payload + bytes_length;
+			
+		} else if(*cursor == 'l' || *cursor == 'd') {
+			entry->type = (*cursor == 'l') ? BENCODE_LIST : BENCODE_DICT;
+			entry->length = 0;
+			entry->end = open;
+			open = tape->count;
+			cursor++;
+			
+		} else return str;
+		
+	} while(open);
+	
+	return cursor;
+}
+
+void bencode_tape_free(struct bencode_tape *tape) {
+	bencode_heap_free(tape->entries);
+	tape->entries = NULL;
+	tape->count = 0;
+	tape->capacity = 0;
+}
+
+size_t bencode_tape_next(const struct bencode_tape *tape, size_t index) {
+	const struct bencode_tape_entry *entry = &tape->entries[index];
+	
+	if(entry->type == BENCODE_LIST || entry->type == BENCODE_DICT)
+		return entry->end;
+	
+	return index + 1;
+}
+
+// Returns the index of the value stored under key_string, or 0 (the root can never be a value).
+size_t bencode_tape_gets(const struct bencode_tape *tape, size_t index, char *key_string) {
+	const struct bencode_tape_entry *dict = &tape->entries[index];
+	if(dict->type != BENCODE_DICT) return 0;
+	
+	size_t query_length = strlen(key_string);
+	
+	for(size_t i = index + 1; i < dict->end; i = bencode_tape_next(tape, i + 1)) {
+		const struct bencode_tape_entry *key = &tape->entries[i];
+		if(key->length == query_length && memcmp(key->bytes, key_string, query_length) == 0)
+			return i + 1;
+	}
+	
+	return 0;
+}
+
+void print_bencode_tape(const struct bencode_tape *tape, size_t index, int indent) {
+	const struct bencode_tape_entry *entry = &tape->entries[index];
+	
+	for(int i = 0; i < indent; i++)
+		printf("\t");
+	
+	printf("tape[%zu] {type=%u, ", index, entry->type);
+	
+	if(entry->type == BENCODE_INT)
+		printf("int=%li", entry->i);
+	
+	if(entry->type == BENCODE_BYTES) {
+		printf("length=%u, bytes=\"", entry->length);
+		for(unsigned int i = 0; i < entry->length; i++) printf("%c", entry->bytes[i]);
+		printf("\"");
+	}
+	
+	if(entry->type == BENCODE_LIST || entry->type == BENCODE_DICT) {
+		printf( ((entry->type == BENCODE_LIST) ? "elements=%u, end=%zu\n" : "pairs=%u, end=%zu\n"), entry->length, entry->end);
+		
+		for(size_t i = index + 1; i < entry->end; i = bencode_tape_next(tape, i))
+			print_bencode_tape(tape, i, indent+1);
+		
+		for(int i = 0; i < indent; i++)
+			printf("\t");
+	}
+	
+	printf("}\n");
+}
+
+// Makes room for `needed` elements of `size` bytes. Returns the (possibly moved) array, or NULL leaving it untouched.
+static void* bencode_compact_reserve(void *array, size_t *capacity, size_t needed, size_t size) {
+	if(needed <= *capacity) return array;
+	
+	size_t grown = *capacity ? *capacity * 2 : 64;
+	while(grown < needed) grown *= 2;
+	
+	array = bencode_heap_realloc(array, grown * size);
+	if(array) *capacity = grown;
+	return array;
+}
+
+// Appends to the string pool. Returns the offset, or -1.
+static int64_t bencode_compact_store(struct bencode_compact *doc, const char *bytes, size_t length) {
+	if(length > UINT32_MAX - doc->strings_length) return -1;
+	
+	char *strings = bencode_compact_reserve(doc->strings, &doc->strings_capacity, doc->strings_length + length, 1);
+	if(strings == NULL) return -1;
+	doc->strings = strings;
+	
+	memcpy(doc->strings + doc->strings_length, bytes, length);
+	doc->strings_length += length;
+	return (int64_t) (doc->strings_length - length);
+}
+
+/*
+	Builds the same way as the tape: while a container is open its
+	children.end holds the index of the enclosing open container plus one,
+	and is fixed up when its 'e' is read. A dict key goes straight into the
+	key table and waits in `key` for the value it belongs to.
+*/
+char* bencode_parse_compact(char *str, size_t length, struct bencode_compact *doc) {
+	char *cursor = str;
+	char *end = str + length;
+	size_t open = 0; // index of the innermost open container plus one
+	uint32_t key = BENCODE_COMPACT_NO_KEY;
+	
+	doc->count = 0;
+	doc->key_count = 0;
+	doc->strings_length = 0;
+	
+	do {
+		if(cursor >= end) return str;
+		
+		struct bencode_compact_node *parent = open ? &doc->nodes[open - 1] : NULL;
+		
+		if(*cursor == 'e' && parent) {
+			if(key != BENCODE_COMPACT_NO_KEY) return str; // key without a value
+			open = parent->children.end;
+			parent->children.end = (uint32_t) doc->count;
+			cursor++;
+			continue;
+		}
+		
+		if(parent && parent->type == BENCODE_DICT && key == BENCODE_COMPACT_NO_KEY) {
+			size_t key_length;
+			char *payload = (*cursor >= '0' && *cursor <= '9') ? bencode_read_length(cursor, end - cursor, &key_length) : NULL;
+			if(payload == NULL || doc->key_count == BENCODE_COMPACT_NO_KEY) return str;
+			
+			struct bencode_compact_key *keys = bencode_compact_reserve(doc->keys, &doc->key_capacity, doc->key_count + 1, sizeof(struct bencode_compact_key));
+			if(keys == NULL) return str;
+			doc->keys = keys;
+			
+			int64_t offset = bencode_compact_store(doc, payload, key_length);
+			if(offset < 0) return str;
+			
+			key = (uint32_t) doc->key_count++;
+			doc->keys[key].offset = (uint32_t) offset;
+			doc->keys[key].length = (uint32_t) key_length;
+			cursor = payload + key_length;
+			continue;
+		}
+		
+		if(parent) {
+			if(parent->children.count == UINT32_MAX) return str;
+			parent->children.count++;
+		}
+		
+		if(doc->count == UINT32_MAX) return str;
+		struct bencode_compact_node *nodes = bencode_compact_reserve(doc->nodes, &doc->capacity, doc->count + 1, sizeof(struct bencode_compact_node));
+		if(nodes == NULL) return str;
+		doc->nodes = nodes;
+		
+		struct bencode_compact_node *node = &doc->nodes[doc->count++];
+		node->inline_length = 0;
+		node->reserved = 0;
+		node->key = key;
+		key = BENCODE_COMPACT_NO_KEY;
+		
+		if(*cursor == 'i') {
+			node->type = BENCODE_INT;
+			cursor = bencode_read_int(cursor, end - cursor, &node->i);
+			if(cursor == NULL) return str;
+			
+		} else if(*cursor >= '0' && *cursor <= '9') {
+			size_t bytes_length;
+			char *payload = bencode_read_length(cursor, end - cursor, &bytes_length);
+			if(payload == NULL) return str;
+			
+			node->type = BENCODE_BYTES;
+			if(bytes_length <= sizeof(node->data)) {
+				node->inline_length = (uint8_t) bytes_length;
+				memcpy(node->data, payload, bytes_length);
+			} else {
+				int64_t offset = bencode_compact_store(doc, payload, bytes_length);
+				if(offset < 0) return str;
+				node->inline_length = BENCODE_COMPACT_POOLED;
+				node->pooled.offset = (uint32_t) offset;
+				node->pooled.length = (uint32_t) bytes_length;
+			}
+			cursor = payload + bytes_length;
+			
+		} else if(*cursor == 'l' || *cursor == 'd') {
+			node->type = (*cursor == 'l') ? BENCODE_LIST : BENCODE_DICT;
+			node->children.count = 0;
+			node->children.end = (uint32_t) open;
+			open = doc->count;
+			cursor++;
+			
+		} else return str;
+		
+	} while(open);
+	
+	return cursor;
+}
+
+void bencode_compact_shrink(struct bencode_compact *doc) {
+	// a failed realloc just leaves that array as it was
+	if(doc->count && doc->count < doc->capacity) {
+		struct bencode_compact_node *nodes = bencode_heap_realloc(doc->nodes, doc->count * sizeof(struct bencode_compact_node));
+		if(nodes) {
+			doc->nodes = nodes;
+			doc->capacity = doc->count;
+		}
+	}
+	if(doc->key_count && doc->key_count < doc->key_capacity) {
+		struct bencode_compact_key *keys = bencode_heap_realloc(doc->keys, doc->key_count * sizeof(struct bencode_compact_key));
+		if(keys) {
+			doc->keys = keys;
+			doc->key_capacity = doc->key_count;
+		}
+	}
+	if(doc->strings_length && doc->strings_length < doc->strings_capacity) {
+		char *strings = bencode_heap_realloc(doc->strings, doc->strings_length);
+		if(strings) {
+			doc->strings = strings;
+			doc->strings_capacity = doc->strings_length;
+		}
+	}
+}
+
+void bencode_compact_free(struct bencode_compact *doc) {
+	bencode_heap_free(doc->nodes);
+	bencode_heap_free(doc->keys);
+	bencode_heap_free(doc->strings);
+	memset(doc, 0, sizeof(struct bencode_compact));
+}
+
+int bencode_compact_type(const struct bencode_compact *doc, size_t index) {
+	return doc->nodes[index].type;
+}
+
+int64_t bencode_compact_int(const struct bencode_compact *doc, size_t index) {
+	const struct bencode_compact_node *node = &doc->nodes[index];
+	return (node->type == BENCODE_INT) ? node->i : 0;
+}
+
+// Returns the bytes of a BENCODE_BYTES node, or NULL. They are not NUL terminated.
+const char* bencode_compact_bytes(const struct bencode_compact *doc, size_t index, size_t *length) {
+	const struct bencode_compact_node *node = &doc->nodes[index];
+	*length = 0;
+	if(node->type != BENCODE_BYTES) return NULL;
+	
+	if(node->inline_length != BENCODE_COMPACT_POOLED) {
+		*length = node->inline_length;
+		return node->data;
+	}
+	
+	*length = node->pooled.length;
+	return doc->strings + node->pooled.offset;
+}
+
+// Returns the key a dict child is stored under, or NULL outside of dicts.
+const char* bencode_compact_key(const struct bencode_compact *doc, size_t index, size_t *length) {
+	const struct bencode_compact_node *node = &doc->nodes[index];
+	*length = 0;
+	if(node->key == BENCODE_COMPACT_NO_KEY) return NULL;
+	
+	*length = doc->keys[node->key].length;
+	return doc->strings + doc->keys[node->key].offset;
+}
+
+// Elements of a list or pairs of a dict.
+size_t bencode_compact_count(const struct bencode_compact *doc, size_t index) {
+	const struct bencode_compact_node *node = &doc->nodes[index];
+	return (node->type == BENCODE_LIST || node->type == BENCODE_DICT) ? node->children.count : 0;
+}
+
+size_t bencode_compact_end(const struct bencode_compact *doc, size_t index) {
+	const struct bencode_compact_node *node = &doc->nodes[index];
+	return (node->type == BENCODE_LIST || node->type == BENCODE_DICT) ? node->children.end : index + 1;
+}
+
+size_t bencode_compact_next(const struct bencode_compact *doc, size_t index) {
+	return bencode_compact_end(doc, index);
+}
+
+// Returns the index of the value stored under key_string, or 0 (the root can never be a value).
+size_t bencode_compact_gets(const struct bencode_compact *doc, size_t index, char *key_string) {
+	const struct bencode_compact_node *dict = &doc->nodes[index];
+	if(dict->type != BENCODE_DICT) return 0;
+	
+	size_t query_length = strlen(key_string);
+	
+	for(size_t i = index + 1; i < dict->children.end; i = bencode_compact_next(doc, i)) {
+		const struct bencode_compact_key *key = &doc->keys[doc->nodes[i].key];
+		if(key->length == query_length && memcmp(doc->strings + key->offset, key_string, query_length) == 0)
+			return i;
+	}
+	
+	return 0;
+}
+
+enum {
+	BENCODE_STREAM_VALUE = 0, // next byte starts a value, or ends a container
+	BENCODE_STREAM_INT_SIGN,  // after 'i'
+	BENCODE_STREAM_INT_FIRST, // after "i-"
+	BENCODE_STREAM_INT,       // inside the digits of an integer
+	BENCODE_STREAM_LENGTH,    // inside a length prefix
+	BENCODE_STREAM_PAYLOAD,   // copying a byte string
+	BENCODE_STREAM_DONE,
+};
+
+void bencode_stream_init(struct bencode_stream *stream, struct bencode *dest, struct bencode_parser *parser) {
+	memset(stream, 0, sizeof(struct bencode_stream));
+	memset(dest, 0, sizeof(struct bencode));
 	
-	struct bencode *head = b->dict;
-	while(head) {
-		if( 0 == memcmp(
-		           head->key,
-		           key_string,
-		           (head->key_length > query_length) ? query_length : head->key_length
-			)
-		) return head;
-		head = head->next;
+	stream->dest = dest;
+	stream->max_bytes = BENCODE_STREAM_MAX_BYTES;
+	if(parser) {
+		stream->parser.arena = parser->arena;
+		stream->parser.max_depth = parser->max_depth;
 	}
+}
+
+void bencode_stream_free(struct bencode_stream *stream) {
+	// a key that never got its node
+	if(stream->reading_key && !stream->parser.arena) bencode_heap_free(stream->bytes);
 	
-	return head;
+	bencode_heap_free(stream->stack);
+	stream->stack = NULL;
+	stream->bytes = NULL;
+	stream->depth = 0;
+	stream->stack_capacity = 0;
 }
 
-char* bencode_parses(char *str, struct bencode *dest) {
-	return bencode_parse(str, strlen(str), dest);
+static enum bencode_stream_status bencode_stream_fail(struct bencode_stream *stream, enum bencode_error error, size_t position) {
+	stream->error = error;
+	stream->error_offset = stream->offset + position;
+	return BENCODE_ERROR;
 }
 
-char* bencode_parse(char *str, size_t length, struct bencode *dest) {
-	if(BENCODE_DEBUG_PRINTS) printf("PARSING: %s\n", str);
-	
-	if(length < 2) return str;
+// Picks the node a value starting now will be parsed into, or flags a key.
+static struct bencode* bencode_stream_slot(struct bencode_stream *stream) {
+	if(stream->depth == 0) return stream->dest;
 	
-	dest->next = NULL;
+	struct bencode_stream_frame *frame = &stream->stack[stream->depth - 1];
 	
-	if(str[0] == 'i') {
-		char *e = memchr(str, 'e', length);
-		char integer_read[24] = {0};
-		
-		if(e == NULL) return str;
-		if(e == str+1) return str; // no blank inputs
-		if( (e - (str+1)) > (long int) sizeof(integer_read) ) return str;
-		if( memcmp(str+1, "-0", 2) == 0 ) return str; // no negative leading zeros
-		// if( (e - str) < 2 && str[1] == '0' ) return str; // no leading zeros
-		// if(isspace(str[1])) return str; // no leading whitespace
-		
-		int enumerate = 0;
-		for(char *cursor = str + 1; cursor < e; cursor++, enumerate++) {
-			if(*cursor == '-' && enumerate == 0) continue;
-			
-			if( !(*cursor >= '0' && *cursor <= '9') ) return str;
+	if(frame->container->type == BENCODE_DICT) {
+		if(frame->expect_key) {
+			stream->reading_key = 1;
+			return frame->container; // placeholder, keys are not stored in a node
 		}
 		
-		strncpy(integer_read, str+1, e - str);
-		
-		// dest->i = atol(integer_read);
-		if( sscanf(integer_read, "%li", &dest->i) != 1 ) return str;
-		if(BENCODE_DEBUG_PRINTS) printf("load int %li\n", dest->i);
-		
-		dest->type = BENCODE_INT;
-		
-		return e + 1;
-		
-	} else if(str[0] >= '0' && str[0] <= '9') {
-		char *colon = strchr(str, ':');
-		char integer_read[24] = {0};
-		
-		if(colon == NULL) return str;
-		
-		if( colon - str > (long int) sizeof(integer_read) ) return str;
-		
-		memcpy(integer_read, str, colon - str);
-		// size_t bytes_length = atol(integer_read);
-		size_t bytes_length;
-		assert( sscanf(integer_read, "%lu", &bytes_length) == 1);
-		
-		if( (size_t) (colon + bytes_length) >= (size_t) (str + length) ) return str;
-		
-		dest->type = BENCODE_BYTES;
-		dest->length = bytes_length;
-		dest->bytes = malloc(bytes_length);
-		memcpy(dest->bytes, colon+1, bytes_length);
-		if(BENCODE_DEBUG_PRINTS) printf("load bytes (advance cursor by %li) ", colon + bytes_length + 1 - str);
-		if(BENCODE_DEBUG_PRINTS) for(unsigned int i=0; i<dest->length;i++) printf("%c", dest->bytes[i]);
-		if(BENCODE_DEBUG_PRINTS) printf("\n");
+		frame->expect_key = 1;
+		return frame->tail;
+	}
+	
+	struct bencode *node = bencode_alloc(&stream->parser, sizeof(struct bencode));
+	if(node == NULL) return NULL;
+	memset(node, 0, sizeof(struct bencode));
+	BENCODE_SET_PARENT(node, frame->container);
+	
+	if(frame->tail) frame->tail->next = node;
+	else frame->container->list = node;
+	frame->tail = node;
+	
+	return node;
+}
 
-		return colon + bytes_length + 1;
+// A key or value just finished; returns 1 once the whole document is complete.
+static int bencode_stream_complete(struct bencode_stream *stream) {
+	if(stream->reading_key) {
+		struct bencode_stream_frame *frame = &stream->stack[stream->depth - 1];
 		
-	} else if(str[0] == 'l' || str[0] == 'd') {
-		dest->type = (str[0] == 'l') ? BENCODE_LIST : BENCODE_DICT;
-		dest->list = NULL;
-		dest->dict = NULL;
-		if(BENCODE_DEBUG_PRINTS && dest->type == BENCODE_LIST) printf("start list %p\n", str);
-		if(BENCODE_DEBUG_PRINTS && dest->type == BENCODE_DICT) printf("start dict %p\n", str);
+		struct bencode *node = bencode_alloc(&stream->parser, sizeof(struct bencode));
+		if(node == NULL) return -1;
+		memset(node, 0, sizeof(struct bencode));
+		BENCODE_SET_PARENT(node, frame->container);
 		
-		int first = 1;
+		node->key = stream->bytes;
+		node->key_length = stream->bytes_length;
 		
-		struct bencode *head;
+		if(frame->tail) frame->tail->next = node;
+		else frame->container->dict = node;
+		frame->tail = node;
+		frame->expect_key = 0;
 		
-		char *original_str = str;
-		str++;
+		stream->reading_key = 0;
+		stream->bytes = NULL;
+		stream->state = BENCODE_STREAM_VALUE;
+		return 0;
+	}
+	
+	stream->bytes = NULL; // owned by the value node now
+	stream->state = (stream->depth == 0) ? BENCODE_STREAM_DONE : BENCODE_STREAM_VALUE;
+	return stream->depth == 0;
+}
+
+static enum bencode_error bencode_stream_push(struct bencode_stream *stream, struct bencode *container) {
+	size_t max_depth = stream->parser.max_depth ? stream->parser.max_depth : BENCODE_MAX_DEPTH;
+	if(stream->depth == max_depth) return BENCODE_ERR_DEPTH;
+	
+	if(stream->depth == stream->stack_capacity) {
+		size_t capacity = stream->stack_capacity ? stream->stack_capacity * 2 : 16;
+		struct bencode_stream_frame *stack = bencode_heap_realloc(stream->stack, capacity * sizeof(struct bencode_stream_frame));
+		if(stack == NULL) return BENCODE_ERR_NOMEM;
+		stream->stack = stack;
+		stream->stack_capacity = capacity;
+	}
+	
+	struct bencode_stream_frame *frame = &stream->stack[stream->depth++];
+	frame->container = container;
+	frame->tail = NULL;
+	frame->expect_key = (container->type == BENCODE_DICT);
+	
+	return BENCODE_OK;
+}
+
+enum bencode_stream_status bencode_stream_feed(struct bencode_stream *stream, const char *chunk, size_t length, size_t *consumed) {
+	size_t i = 0;
+	int done = 0;
+	
+	if(consumed) *consumed = 0;
+	if(stream->state == BENCODE_STREAM_DONE) return BENCODE_DONE;
+	if(stream->error) return BENCODE_ERROR;
+	
+	while(i < length && !done) {
+		char c = chunk[i];
 		
-		while(str[0] != 'e' && str < original_str + length) {
-			if(first) {
-				struct bencode **pog = (dest->type == BENCODE_LIST) ? &dest->list : &dest->dict;
-				*pog = malloc(sizeof(struct bencode));
-				memset(*pog, 0, sizeof(struct bencode));
-				head = *pog;
-				
-				first = 0;
+		switch(stream->state) {
+		case BENCODE_STREAM_VALUE: {
+			if(c == 'e' && stream->depth) {
+				struct bencode_stream_frame *frame = &stream->stack[stream->depth - 1];
+				if(frame->container->type == BENCODE_DICT && !frame->expect_key)
+					return bencode_stream_fail(stream, BENCODE_ERR_SYNTAX, i); // key without a value
 				
-			} else {
-				head->next = malloc(sizeof(struct bencode));
-				memset(head->next, 0, sizeof(struct bencode));
-				head = head->next;
+				BENCODE_SPAN_END(frame->container, stream->offset + i + 1);
+				stream->depth--;
+				i++;
+				done = bencode_stream_complete(stream);
+				break;
+			}
 			
+			int is_bytes = (c >= '0' && c <= '9');
+			if(!is_bytes && c != 'i' && c != 'l' && c != 'd')
+				return bencode_stream_fail(stream, BENCODE_ERR_SYNTAX, i);
+			
+			if(stream->depth && !is_bytes) {
+				struct bencode_stream_frame *frame = &stream->stack[stream->depth - 1];
+				if(frame->container->type == BENCODE_DICT && frame->expect_key)
+					return bencode_stream_fail(stream, BENCODE_ERR_SYNTAX, i); // keys must be byte strings
 			}
 			
-			#ifdef BENCODE_EXT_WHITESPACE
-			{
-				size_t position = str - original_str;
-				while(isspace(*str) && position < length) {
-					position++;
-					str++;
-				}
+			struct bencode *node = bencode_stream_slot(stream);
+			if(node == NULL) return bencode_stream_fail(stream, BENCODE_ERR_NOMEM, i);
+			if(!stream->reading_key) BENCODE_SPAN_BEGIN(node, stream->offset + i);
+			stream->node = node;
+			stream->number = 0;
+			
+			if(is_bytes) {
+				stream->state = BENCODE_STREAM_LENGTH;
+				continue; // the digit is part of the length
 			}
-			#endif
 			
-			if(dest->type == BENCODE_LIST) {
-				char *next = bencode_parse(str, length - (str - original_str), head);
-				
-				// assert(str != next);
-				if(str == next) return str;
-				
-				if(BENCODE_DEBUG_PRINTS) printf("list jumped forward %li bytes\n", next - str);
-				str = next;
-				
-			} else if(dest->type == BENCODE_DICT) {
-				// load the key into a temporary struct
-				struct bencode key = {0};
-				char *next = bencode_parse(str, length - (str - original_str), &key);
-				
-				// verify the key is bytes type
-				if(key.type != BENCODE_BYTES) {
-					bencode_free(&key);
-					return str;
-				}
-				assert(str != next);
-				
-				str = next;
+			if(c == 'i') {
+				stream->negative = 0;
+				stream->state = BENCODE_STREAM_INT_SIGN;
+			} else {
+				node->type = (c == 'l') ? BENCODE_LIST : BENCODE_DICT;
+				BENCODE_STAT_NODE(node->type);
+				enum bencode_error error = bencode_stream_push(stream, node);
+				if(error) return bencode_stream_fail(stream, error, i);
+			}
+			i++;
+			break;
+		}
+		
+		case BENCODE_STREAM_INT_SIGN:
+		case BENCODE_STREAM_INT_FIRST:
+			if(c == '-' && stream->state == BENCODE_STREAM_INT_SIGN) {
+				stream->negative = 1;
+				stream->state = BENCODE_STREAM_INT_FIRST;
+				i++;
+				break;
+			}
+			
+			if( !(c >= '0' && c <= '9') ) return bencode_stream_fail(stream, BENCODE_ERR_SYNTAX, i);
+			if(stream->negative && c == '0') return bencode_stream_fail(stream, BENCODE_ERR_SYNTAX, i); // no negative leading zeros
+			
+			stream->state = BENCODE_STREAM_INT;
+			// fall through
+		
+		case BENCODE_STREAM_INT:
+		case BENCODE_STREAM_LENGTH: {
+			uint64_t v = stream->number;
+			
+			while(i < length && chunk[i] >= '0' && chunk[i] <= '9') {
+				unsigned int digit = chunk[i] - '0';
+				if(v >= UINT64_MAX / 10 && (v > UINT64_MAX / 10 || digit > UINT64_MAX % 10))
+					return bencode_stream_fail(stream, BENCODE_ERR_OVERFLOW, i);
+				v = v * 10 + digit;
+				i++;
+			}
+			
+			stream->number = v;
+			if(i == length) break;
+			
+			if(stream->state == BENCODE_STREAM_INT) {
+				if(chunk[i] != 'e') return bencode_stream_fail(stream, BENCODE_ERR_SYNTAX, i);
 				
-				#ifdef BENCODE_EXT_WHITESPACE
-				{
-					size_t position = str - original_str;
-					while(isspace(*str) && position < length) {
-						position++;
-						str++;
-					}
+				if(stream->negative) {
+					if(v > (uint64_t) INT64_MAX + 1) return bencode_stream_fail(stream, BENCODE_ERR_OVERFLOW, i);
+					stream->node->i = (v == (uint64_t) INT64_MAX + 1) ? INT64_MIN : -(int64_t) v;
+				} else {
+					if(v > INT64_MAX) return bencode_stream_fail(stream, BENCODE_ERR_OVERFLOW, i);
+					stream->node->i = (int64_t) v;
 				}
-				#endif
-				
-				// load the value into the head
-				next = bencode_parse(str, length - (str - original_str), head);
-
-				// load the key into the head
-				head->key = key.bytes;
-				head->key_length = key.length;
-				
-				assert(str != next);
-				str = next;
 				
+				stream->node->type = BENCODE_INT;
+				BENCODE_STAT_NODE(BENCODE_INT);
+				i++;
+				BENCODE_SPAN_END(stream->node, stream->offset + i);
+				done = bencode_stream_complete(stream);
+				break;
 			}
-
-			#ifdef BENCODE_EXT_WHITESPACE
-			{
-				size_t position = str - original_str;
-				while(isspace(*str) && position < length) {
-					position++;
-					str++;
-				}
+			
+			if(chunk[i] != ':') return bencode_stream_fail(stream, BENCODE_ERR_SYNTAX, i);
+			if(v > stream->max_bytes) return bencode_stream_fail(stream, BENCODE_ERR_OVERFLOW, i);
+			i++;
+			
+			stream->bytes_length = (size_t) v;
+			stream->bytes_filled = 0;
+			stream->bytes = bencode_alloc_bytes(&stream->parser, stream->bytes_length);
+			if(stream->bytes == NULL && stream->bytes_length) return bencode_stream_fail(stream, BENCODE_ERR_NOMEM, i);
+			
+			if(!stream->reading_key) {
+				stream->node->type = BENCODE_BYTES;
+				BENCODE_STAT_NODE(BENCODE_BYTES);
+				stream->node->bytes = stream->bytes;
+				stream->node->length = stream->bytes_length;
+				if(stream->parser.arena) stream->node->flags |= BENCODE_FLAG_ARENA;
 			}
-			#endif
+			
+			stream->state = BENCODE_STREAM_PAYLOAD;
 		}
+			// fall through
 		
-		if(BENCODE_DEBUG_PRINTS) printf("end list %p\n", str);
-		return str+1;
-		
+		case BENCODE_STREAM_PAYLOAD: {
+			size_t available = length - i;
+			size_t wanted = stream->bytes_length - stream->bytes_filled;
+			size_t n = (available < wanted) ? available : wanted;
+			
+			memcpy(stream->bytes + stream->bytes_filled, chunk + i, n);
+			stream->bytes_filled += n;
+			i += n;
+			
+			if(stream->bytes_filled == stream->bytes_length) {
+				if(!stream->reading_key) BENCODE_SPAN_END(stream->node, stream->offset + i);
+				done = bencode_stream_complete(stream);
+				if(done < 0) return bencode_stream_fail(stream, BENCODE_ERR_NOMEM, i);
+			}
+			break;
+		}
+		}
 	}
-	#ifdef BENCODE_EXT_STRINGS
-	else if(str[0] == 's'){
-		if(str[1] != '"') return str;
-		str += 2;
+	
+	stream->offset += i;
+	if(consumed) *consumed = i;
+	
+	return done ? BENCODE_DONE : BENCODE_NEED_MORE;
+}
 
-		char *final_quote = str;
+#ifdef BENCODE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-		// find the terminating "
-		while(*final_quote != '"') {
-			if(*final_quote == '\\') {
-				if(*(final_quote + 1) == '\"')
-					final_quote++;
-			}
-			final_quote++;
+static char bencode_empty_file[1];
+
+#if !defined(BENCODE_EXT_WHITESPACE) && !defined(BENCODE_EXT_STRINGS)
+static char* bencode_parse_file_windows(struct bencode_file *file, struct bencode *dest, struct bencode_parser *parser) {
+	struct bencode_stream stream;
+	bencode_stream_init(&stream, dest, parser);
+	stream.max_bytes = file->length;
+	
+	enum bencode_stream_status status = BENCODE_NEED_MORE;
+	size_t offset = 0;
+	
+	while(offset < file->length && status == BENCODE_NEED_MORE) {
+		size_t window = file->length - offset;
+		if(window > BENCODE_FILE_WINDOW) window = BENCODE_FILE_WINDOW;
+		
+		size_t used;
+		status = bencode_stream_feed(&stream, file->data + offset, window, &used);
+		if(status == BENCODE_NEED_MORE) madvise(file->data + offset, window, MADV_DONTNEED); // copied out already
+		offset += used;
+	}
+	
+	bencode_stream_free(&stream);
+	
+	if(status == BENCODE_DONE) {
+		parser->error = BENCODE_OK;
+		parser->error_offset = 0;
+	} else if(status == BENCODE_ERROR) {
+		parser->error = stream.error;
+		parser->error_offset = stream.error_offset;
+	} else {
+		parser->error = BENCODE_ERR_EOF;
+		parser->error_offset = file->length;
+	}
+	
+	return file->data + ((status == BENCODE_DONE) ? offset : parser->error_offset);
+}
+#endif
+
+char* bencode_parse_file(const char *path, struct bencode_file *file, struct bencode *dest, struct bencode_parser *parser) {
+	file->data = NULL;
+	file->length = 0;
+	
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return NULL;
+	
+	struct stat st;
+	if(fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	
+	file->length = (size_t) st.st_size;
+	if(file->length == 0) {
+		file->data = bencode_empty_file;
+	} else {
+		void *data = mmap(NULL, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED) {
+			close(fd);
+			file->length = 0;
+			return NULL;
 		}
+		file->data = data;
+		madvise(file->data, file->length, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	
+	struct bencode_parser defaults = {0};
+	if(parser == NULL) parser = &defaults;
+	
+	// nothing past the end of a mapping may be read
+	struct bencode_parser options = *parser;
+	options.flags &= ~BENCODE_OPT_PADDED;
+	
+	char *end;
+	#if !defined(BENCODE_EXT_WHITESPACE) && !defined(BENCODE_EXT_STRINGS)
+	// the stream only knows about the arena and max_depth
+	unsigned int mapped = BENCODE_OPT_BORROW | BENCODE_OPT_LAZY | BENCODE_OPT_CANONICAL;
+	if(!(options.flags & mapped) && !options.intern && !options.strings && file->length) {
+		end = bencode_parse_file_windows(file, dest, &options);
+		madvise(file->data, file->length, MADV_DONTNEED);
+		parser->error = options.error;
+		parser->error_offset = options.error_offset;
+		return end;
+	}
+	#endif
+	
+	end = bencode_parse_internal(file->data, file->length, dest, &options);
+	if(file->length) {
+		madvise(file->data, file->length, MADV_DONTNEED);
+		madvise(file->data, file->length, MADV_NORMAL);
+	}
+	parser->error = options.error;
+	parser->error_offset = options.error_offset;
+	return end;
+}
 
-		size_t string_length = final_quote - str;
-		assert(string_length > 0);
+void bencode_file_close(struct bencode_file *file) {
+	if(file->length) munmap(file->data, file->length);
+	file->data = NULL;
+	file->length = 0;
+}
+#endif // BENCODE_MMAP
 
-		dest->type = BENCODE_BYTES;
-		dest->length = string_length + 1;
-		dest->bytes = malloc(dest->length);
-		dest->bytes[string_length] = 0;
-		memcpy(dest->bytes, str, string_length);
+#ifdef BENCODE_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
 
-		return final_quote + 1;
+// A thread's share of the work: next (high half) and end (low half) packed
+// into one word, so taking from the front and stealing from the back are
+// both a single compare-and-swap.
+struct bencode_batch_worker {
+	_Atomic uint64_t range;
+	
+	struct bencode_batch_worker *workers;
+	size_t index;
+	size_t count;
+	
+	struct bencode_parser parser; // the batch's options with this thread's arena
+	int (*job)(struct bencode_parser *parser, void *jobs, size_t index); // returns 1 on failure
+	void *jobs;
+	size_t failed;
+};
+
+#define BENCODE_RANGE(next, end) (((uint64_t) (next) << 32) | (uint32_t) (end))
+#define BENCODE_RANGE_NEXT(range) ((uint32_t) ((range) >> 32))
+#define BENCODE_RANGE_END(range) ((uint32_t) (range))
+
+// Takes the next job of a worker's own range, or returns 0.
+static int bencode_batch_take(struct bencode_batch_worker *worker, size_t *job) {
+	uint64_t range = atomic_load(&worker->range);
+	
+	while(BENCODE_RANGE_NEXT(range) < BENCODE_RANGE_END(range)) {
+		uint64_t taken = BENCODE_RANGE(BENCODE_RANGE_NEXT(range) + 1, BENCODE_RANGE_END(range));
+		if(atomic_compare_exchange_weak(&worker->range, &range, taken)) {
+			*job = BENCODE_RANGE_NEXT(range);
+			return 1;
+		}
 	}
-	#endif // BENCODE_EXT_STRINGS
 	
-	return str;
+	return 0;
 }
 
-void print_bencode(struct bencode *b, int indent) {
-	for(int i = 0; i < indent; i++)
-		printf("\t");
+// Moves the back half of some other worker's range into this one's.
+static int bencode_batch_steal(struct bencode_batch_worker *worker) {
+	for(size_t i = 1; i < worker->count; i++) {
+		struct bencode_batch_worker *victim = &worker->workers[(worker->index + i) % worker->count];
+		uint64_t range = atomic_load(&victim->range);
 		
-	if(!b->type) {
-		printf("struct bencode {addr=%p, type=(uninitialized)}\n", (void*) b);
-		return;
+		while(BENCODE_RANGE_NEXT(range) < BENCODE_RANGE_END(range)) {
+			uint32_t next = BENCODE_RANGE_NEXT(range), end = BENCODE_RANGE_END(range);
+			uint32_t split = next + (end - next) / 2;
+			
+			if(atomic_compare_exchange_weak(&victim->range, &range, BENCODE_RANGE(next, split))) {
+				atomic_store(&worker->range, BENCODE_RANGE(split, end));
+				return 1;
+			}
+		}
 	}
+	
+	return 0;
+}
 
-	#ifdef BENCODE_PRINT_ADDRESSES
-	printf("struct bencode {addr=%p, next=%p, type=%u, ", (void*) b, (void*) b->next, b->type);
-	#else
-	printf("struct bencode {next=%p, type=%u, ", (void*) b->next, b->type);
-	#endif
+static void* bencode_batch_run(void *arg) {
+	struct bencode_batch_worker *worker = arg;
 	
-	if(b->key) {
-		printf("key_length=%li key=\"", b->key_length);
-		for(unsigned int i = 0; i < b->key_length; i++) printf("%c", b->key[i]);
-		printf("\", ");
+	do {
+		size_t i;
+		while(bencode_batch_take(worker, &i))
+			worker->failed += worker->job(&worker->parser, worker->jobs, i);
+	} while(bencode_batch_steal(worker));
+	
+	return NULL;
+}
+
+// How many threads to use, with an arena ready for each; 0 if there are none.
+static size_t bencode_batch_threads(struct bencode_batch *batch) {
+	size_t threads = batch->threads;
+	if(threads == 0) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (online > 0) ? (size_t) online : 1;
 	}
 	
-	if(b->type == BENCODE_INT)
-		printf("int=%li", b->i);
+	if(batch->arena_count < threads) {
+		struct bencode_arena *arenas = bencode_heap_realloc(batch->arenas, threads * sizeof(struct bencode_arena));
+		if(arenas) {
+			for(size_t i = batch->arena_count; i < threads; i++) bencode_arena_init(&arenas[i], 0);
+			batch->arenas = arenas;
+			batch->arena_count = threads;
+		}
+		threads = batch->arena_count; // fewer threads if that failed
+	}
 	
-	if(b->type == BENCODE_BYTES) {
-		printf("length=%zu, bytes=\"", b->length);
-		for(unsigned int i = 0; i < b->length; i++) printf("%c", b->bytes[i]);
-		printf("\"");
+	return threads;
+}
+
+/*
+	Runs jobs 0..count-1 (at most 2^32-1) on up to `threads` threads, the
+	calling one included, and returns how many failed.
+*/
+static size_t bencode_batch_dispatch(struct bencode_batch *batch, size_t threads, size_t count,
+	int (*job)(struct bencode_parser *parser, void *jobs, size_t index), void *jobs) {
+	if(threads > count) threads = count ? count : 1;
+	
+	struct bencode_batch_worker *workers = bencode_heap_malloc(threads * sizeof(struct bencode_batch_worker));
+	pthread_t *handles = bencode_heap_malloc(threads * sizeof(pthread_t));
+	if(workers == NULL || handles == NULL) {
+		bencode_heap_free(workers);
+		bencode_heap_free(handles);
+		threads = 1;
+		workers = NULL;
 	}
 	
-	if(b->type == BENCODE_LIST || b->type == BENCODE_DICT) {
-		printf( ((b->type == BENCODE_LIST) ? "list=%p\n" : "dict=%p\n"), (void*) b->list);
-		struct bencode *element = b->list;
-		
-		while(element) {
-			print_bencode(element, indent+1);
-			element = element->next;
+	struct bencode_batch_worker single;
+	if(workers == NULL) workers = &single;
+	
+	for(size_t t = 0; t < threads; t++) {
+		struct bencode_batch_worker *worker = &workers[t];
+		atomic_init(&worker->range, BENCODE_RANGE(count * t / threads, count * (t + 1) / threads));
+		worker->workers = workers;
+		worker->index = t;
+		worker->count = threads;
+		worker->parser = batch->parser;
+		worker->parser.arena = &batch->arenas[t];
+		worker->job = job;
+		worker->jobs = jobs;
+		worker->failed = 0;
+	}
+	
+	// start the helpers; a helper that fails to start leaves its range to be stolen
+	size_t started = 1;
+	for(; started < threads; started++)
+		if(pthread_create(&handles[started], NULL, bencode_batch_run, &workers[started])) break;
+	
+	bencode_batch_run(&workers[0]);
+	
+	size_t failed = workers[0].failed;
+	for(size_t t = 1; t < started; t++) {
+		pthread_join(handles[t], NULL);
+		failed += workers[t].failed;
+	}
+	
+	if(workers != &single) {
+		bencode_heap_free(workers);
+		bencode_heap_free(handles);
+	}
+	return failed;
+}
+
+static int bencode_batch_message(struct bencode_parser *parser, void *jobs, size_t index) {
+	struct bencode_message *message = (struct bencode_message*) jobs + index;
+	memset(&message->tree, 0, sizeof(struct bencode));
+	
+	message->end = bencode_parse_internal(message->str, message->length, &message->tree, parser);
+	message->error = parser->error;
+	message->error_offset = parser->error_offset;
+	return message->error != BENCODE_OK;
+}
+
+void bencode_batch_init(struct bencode_batch *batch, size_t threads) {
+	memset(batch, 0, sizeof(struct bencode_batch));
+	batch->threads = threads;
+}
+
+/*
+	Parses every message and returns how many failed. Batches of more than
+	2^32-1 messages are parsed in slices.
+*/
+size_t bencode_parse_batch(struct bencode_batch *batch, struct bencode_message *messages, size_t count) {
+	size_t threads = bencode_batch_threads(batch);
+	
+	if(threads == 0) {
+		for(size_t i = 0; i < count; i++) {
+			memset(&messages[i].tree, 0, sizeof(struct bencode));
+			messages[i].end = messages[i].str;
+			messages[i].error = BENCODE_ERR_NOMEM;
+			messages[i].error_offset = 0;
 		}
+		return count;
 	}
 	
-	if(b->type == BENCODE_LIST || b->type == BENCODE_DICT)
-		for(int i = 0; i < indent; i++)
-			printf("\t");
+	size_t failed = 0;
+	for(size_t done = 0; done < count; done += UINT32_MAX) {
+		size_t slice = (count - done < UINT32_MAX) ? count - done : UINT32_MAX;
+		failed += bencode_batch_dispatch(batch, threads, slice, bencode_batch_message, messages + done);
+	}
+	return failed;
+}
+
+// One piece of a top-level list or dict for bencode_parse_parallel().
+struct bencode_chunk {
+	char *begin; // first child
+	char *end;   // just past the last child
 	
-	printf("}\n");
+	struct bencode *head; // the children, linked
+	struct bencode *tail;
+	char *stop;
+	enum bencode_error error;
+	size_t error_offset;
+};
+
+struct bencode_parallel {
+	char *origin;
+	int dict;
+	struct bencode_chunk *chunks;
+	struct bencode *container;
+};
+
+static int bencode_parallel_chunk(struct bencode_parser *parser, void *jobs, size_t index) {
+	struct bencode_parallel *parallel = jobs;
+	struct bencode_chunk *chunk = &parallel->chunks[index];
+	char *cursor = chunk->begin;
+	
+	struct bencode_parser element = *parser;
+	element.max_depth = (parser->max_depth ? parser->max_depth : BENCODE_MAX_DEPTH) - 1;
+	element.flags &= ~BENCODE_OPT_CANONICAL; // the skip pass checked it
+	element.error = BENCODE_OK;
+	
+	chunk->head = NULL;
+	chunk->tail = NULL;
+	
+	for(;;) {
+		BENCODE_SKIP_WHITESPACE(cursor, chunk->end);
+		if(cursor >= chunk->end) break;
+		
+		struct bencode *node = bencode_alloc(parser, sizeof(struct bencode));
+		if(node == NULL) {
+			element.error = BENCODE_ERR_NOMEM;
+			element.error_offset = cursor - parallel->origin;
+			break;
+		}
+		memset(node, 0, sizeof(struct bencode));
+		
+		if(chunk->tail) chunk->tail->next = node;
+		else chunk->head = node;
+		chunk->tail = node;
+		
+		if(parallel->dict) {
+			char *next = bencode_parse_key(cursor, chunk->end, parser, node);
+			if(next == NULL) {
+				element.error = BENCODE_ERR_NOMEM; // the skip pass checked the syntax
+				element.error_offset = cursor - parallel->origin;
+				break;
+			}
+			cursor = next;
+			BENCODE_SKIP_WHITESPACE(cursor, chunk->end);
+		}
+		
+		cursor = bencode_parse_range(parallel->origin, cursor, chunk->end - cursor, node, &element);
+		BENCODE_SET_PARENT(node, parallel->container);
+		if(element.error) break;
+	}
+	
+	chunk->stop = cursor;
+	chunk->error = element.error;
+	chunk->error_offset = element.error_offset;
+	return chunk->error != BENCODE_OK;
 }
 
-void bencode_free(struct bencode *b) {
-	if(b->type == BENCODE_BYTES) {
-		free(b->bytes);
-		b->bytes = NULL;
+/*
+	Parses a document whose top level is one big list or dict using the
+	batch's threads. A sequential skip pass checks the children and cuts
+	them into about four chunks per thread. The chunks are then parsed in
+	parallel, each thread into its own arena, and their children are linked
+	back together in document order.
+	
+	The options and error fields of batch->parser are used as with
+	bencode_parse_with(). Inputs smaller than BENCODE_PARALLEL_MIN, other
+	top-level values, lazy parsing, a max_depth of 1 and one-thread batches
+	are parsed sequentially into the first arena. The skip pass also does
+	the BENCODE_OPT_CANONICAL checks. If it finds an error, no children are
+	built. The tree lives in the batch's arenas like those of
+	bencode_parse_batch().
+*/
+char* bencode_parse_parallel(char *str, size_t length, struct bencode *dest, struct bencode_batch *batch) {
+	struct bencode_parser *parser = &batch->parser;
+	size_t threads = bencode_batch_threads(batch);
+	
+	if(threads == 0) {
+		parser->error = BENCODE_ERR_NOMEM;
+		parser->error_offset = 0;
+		return str;
 	}
 	
-	if(b->type == BENCODE_LIST || b->type == BENCODE_DICT) {
-		struct bencode *head = (b->type == BENCODE_LIST) ? b->list : b->dict;
+	// the children are parsed with one level less, and a depth of 0 would mean the default
+	size_t max_depth = parser->max_depth ? parser->max_depth : BENCODE_MAX_DEPTH;
+	
+	struct bencode_chunk *chunks = NULL;
+	if(threads > 1 && length >= BENCODE_PARALLEL_MIN && max_depth > 1 && !(parser->flags & BENCODE_OPT_LAZY) && (str[0] == 'l' || str[0] == 'd'))
+		chunks = bencode_heap_malloc((threads * 4 + 1) * sizeof(struct bencode_chunk));
+	
+	if(chunks == NULL) {
+		struct bencode_parser sequential = *parser;
+		sequential.arena = &batch->arenas[0];
+		char *end = bencode_parse_internal(str, length, dest, &sequential);
+		parser->error = sequential.error;
+		parser->error_offset = sequential.error_offset;
+		return end;
+	}
+	
+	// find the chunk boundaries
+	size_t target = length / (threads * 4);
+	size_t count = 0;
+	int dict = (str[0] == 'd');
+	int checks = (parser->flags & BENCODE_OPT_CANONICAL) ? BENCODE_SKIP_CANONICAL : 0;
+	char *previous = NULL; // the last top-level key
+	enum bencode_error error = BENCODE_OK;
+	
+	char *end = str + length;
+	char *cursor = str + 1;
+	char *chunk_begin = cursor;
+	
+	for(;;) {
+		BENCODE_SKIP_WHITESPACE(cursor, end);
+		if(cursor >= end) {
+			error = BENCODE_ERR_EOF;
+			cursor = str;
+			break;
+		}
+		if(*cursor == 'e') break;
 		
-		while(head) {
-			struct bencode *prev = head;
-			head = head->next;
+		if(dict) {
+			if( !(*cursor >= '0' && *cursor <= '9')
+				#ifdef BENCODE_EXT_STRINGS
+				&& *cursor != 's'
+				#endif
+			) {
+				error = BENCODE_ERR_SYNTAX; // keys must be byte strings
+				break;
+			}
 			
-			bencode_free(prev);
-			if(b->type == BENCODE_DICT) {
-				free(prev->key);
-				prev->key = NULL;
+			char *key = cursor;
+			cursor = bencode_skip_value(cursor, end, 1, checks, &error);
+			if(error) break;
+			if(checks && previous && !bencode_key_token_ascending(previous, key, end)) {
+				error = BENCODE_ERR_CANONICAL;
+				cursor = key;
+				break;
 			}
-			free(prev);
+			previous = key;
+			BENCODE_SKIP_WHITESPACE(cursor, end);
+		}
+		
+		cursor = bencode_skip_value(cursor, end, max_depth - 1, checks, &error);
+		if(error) break;
+		
+		if((size_t) (cursor - chunk_begin) >= target && count < threads * 4) {
+			chunks[count].begin = chunk_begin;
+			chunks[count].end = cursor;
+			count++;
+			chunk_begin = cursor;
+		}
+	}
+	
+	dest->type = dict ? BENCODE_DICT : BENCODE_LIST;
+	BENCODE_STAT_NODE(dest->type);
+	dest->list = NULL;
+	dest->next = NULL;
+	BENCODE_SET_PARENT(dest, NULL);
+	BENCODE_SPAN_BEGIN(dest, 0);
+	
+	if(error) {
+		bencode_heap_free(chunks);
+		parser->error = error;
+		parser->error_offset = cursor - str;
+		return cursor;
+	}
+	
+	if(cursor > chunk_begin) {
+		chunks[count].begin = chunk_begin;
+		chunks[count].end = cursor;
+		count++;
+	}
+	
+	struct bencode_parallel parallel = { str, dict, chunks, dest };
+	bencode_batch_dispatch(batch, threads, count, bencode_parallel_chunk, &parallel);
+	
+	// link the chunks in order, up to the first one that failed
+	struct bencode *tail = NULL;
+	parser->error = BENCODE_OK;
+	parser->error_offset = 0;
+	
+	for(size_t i = 0; i < count; i++) {
+		if(chunks[i].head) {
+			if(tail) tail->next = chunks[i].head;
+			else dest->list = chunks[i].head;
+			tail = chunks[i].tail;
+		}
+		
+		if(chunks[i].error) {
+			parser->error = chunks[i].error;
+			parser->error_offset = chunks[i].error_offset;
+			cursor = chunks[i].stop;
+			break;
 		}
 	}
+	
+	bencode_heap_free(chunks);
+	if(parser->error) return cursor;
+	
+	BENCODE_SPAN_END(dest, cursor + 1 - str);
+	return cursor + 1;
+}
+
+void bencode_batch_reset(struct bencode_batch *batch) {
+	for(size_t i = 0; i < batch->arena_count; i++) bencode_arena_reset(&batch->arenas[i]);
+}
+
+void bencode_batch_free(struct bencode_batch *batch) {
+	for(size_t i = 0; i < batch->arena_count; i++) bencode_arena_free(&batch->arenas[i]);
+	bencode_heap_free(batch->arenas);
+	batch->arenas = NULL;
+	batch->arena_count = 0;
 }
+#endif // BENCODE_THREADS
 
 #endif // BENCODE_IMPLEMENTATION
 
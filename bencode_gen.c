@@ -0,0 +1,426 @@
+/*
+	Copyright (c) 2021 Julian Cahill <cahill.julian@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgment in the product documentation would be
+	   appreciated but is not required.
+	2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+	3. This notice may not be removed or altered from any source distribution.
+*/
+
+/*
+	Generates parsers that read bencoded dicts straight into C structs.
+
+		gcc bencode_gen.c -o bencode_gen
+		./bencode_gen krpc.schema > krpc.h
+
+	A schema is a list of structs, each one a dict with known keys:
+
+		struct krpc_args {
+			required bytes id;
+			int port;
+			bytes piece_length "piece length"; // the key, when it is not the field's name
+			list bytes values;                  // list int, list bytes, list struct <name>
+			struct other nested;                // structs must be declared first
+		}
+
+	For each struct the header declares `struct <name>`, a `present` bit per
+	field and `<name>_parse()`. Like bencode.h, the parsers are compiled in
+	the file that defines BENCODE_IMPLEMENTATION. They need no tree: keys are
+	matched by length and then against constants, values are written into
+	the struct, byte strings point into the input and unknown keys are
+	skipped. Lists are arrays taken from parser->arena, with their length in
+	`<field>_count`; fields cannot be named `present` or like such a count.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#define GEN_MAX_STRUCTS 64
+#define GEN_MAX_FIELDS 64 // one bit each in `present`
+#define GEN_MAX_NAME 64
+#define GEN_MAX_KEY 256
+
+enum gen_type { GEN_INT, GEN_BYTES, GEN_STRUCT };
+
+struct gen_field {
+	char name[GEN_MAX_NAME];
+	char key[GEN_MAX_KEY];
+	size_t key_length;
+	enum gen_type type;
+	int target; // GEN_STRUCT: index of the struct
+	int list;
+	int required;
+};
+
+struct gen_struct {
+	char name[GEN_MAX_NAME];
+	struct gen_field fields[GEN_MAX_FIELDS];
+	int field_count;
+};
+
+static struct gen_struct structs[GEN_MAX_STRUCTS];
+static int struct_count;
+
+/*
+	Tokens: identifiers, "strings", and single characters.
+*/
+
+static const char *schema_path;
+static char *src;
+static int line = 1;
+
+static char token[GEN_MAX_KEY + 1]; // a key of GEN_MAX_KEY bytes, and the NUL
+static size_t token_length;
+static int token_is_string;
+
+static void fail(const char *message, const char *detail) {
+	fprintf(stderr, "%s:%d: %s%s%s\n", schema_path, line, message, detail ? " " : "", detail ? detail : "");
+	exit(1);
+}
+
+// Reads the next token; returns 0 at the end of the schema.
+static int next_token() {
+	for(;;) {
+		while(isspace((unsigned char) *src)) {
+			if(*src == '\n') line++;
+			src++;
+		}
+		if(src[0] == '/' && src[1] == '/') {
+			while(*src && *src != '\n') src++;
+			continue;
+		}
+		break;
+	}
+
+	token_length = 0;
+	token_is_string = 0;
+	if(*src == 0) return 0;
+
+	if(*src == '"') {
+		token_is_string = 1;
+		src++;
+		while(*src != '"') {
+			if(*src == 0 || *src == '\n') fail("unterminated string", NULL);
+			if(*src == '\\' && (src[1] == '"' || src[1] == '\\')) src++;
+			if(token_length == GEN_MAX_KEY) fail("key too long", NULL);
+			token[token_length++] = *src++;
+		}
+		src++;
+	} else if(isalpha((unsigned char) *src) || *src == '_') {
+		while(isalnum((unsigned char) *src) || *src == '_') {
+			if(token_length == GEN_MAX_NAME - 1) fail("name too long", NULL);
+			token[token_length++] = *src++;
+		}
+	} else {
+		token[token_length++] = *src++;
+	}
+
+	token[token_length] = 0;
+	return 1;
+}
+
+static int is_word(const char *word) {
+	return !token_is_string && strcmp(token, word) == 0;
+}
+
+static void expect(const char *what) {
+	if(!next_token() || !is_word(what)) fail("expected", what);
+}
+
+static void expect_name(char *name) {
+	if(!next_token() || token_is_string || !(isalpha((unsigned char) token[0]) || token[0] == '_')) fail("expected a name, got", token);
+	strcpy(name, token);
+}
+
+// Whether `other` is named like the <name>_count member generated for the list field `list`.
+static int clashes_with_count(const struct gen_field *list, const struct gen_field *other) {
+	size_t n = strlen(list->name);
+	return list->list && strncmp(other->name, list->name, n) == 0 && strcmp(other->name + n, "_count") == 0;
+}
+
+static int find_struct(const char *name) {
+	for(int s = 0; s < struct_count; s++)
+		if(strcmp(structs[s].name, name) == 0) return s;
+	return -1;
+}
+
+static void parse_schema() {
+	while(next_token()) {
+		if(!is_word("struct")) fail("expected struct, got", token);
+		if(struct_count == GEN_MAX_STRUCTS) fail("too many structs", NULL);
+
+		struct gen_struct *st = &structs[struct_count];
+		expect_name(st->name);
+		if(find_struct(st->name) >= 0) fail("struct declared twice:", st->name);
+		expect("{");
+
+		for(;;) {
+			if(!next_token()) fail("expected }", NULL);
+			if(is_word("}")) break;
+			if(st->field_count == GEN_MAX_FIELDS) fail("too many fields in", st->name);
+
+			struct gen_field *field = &st->fields[st->field_count];
+			if(is_word("required")) {
+				field->required = 1;
+				next_token();
+			}
+			if(is_word("list")) {
+				field->list = 1;
+				next_token();
+			}
+
+			if(is_word("int")) field->type = GEN_INT;
+			else if(is_word("bytes")) field->type = GEN_BYTES;
+			else if(is_word("struct")) {
+				char target[GEN_MAX_NAME];
+				expect_name(target);
+				field->type = GEN_STRUCT;
+				field->target = find_struct(target);
+				if(field->target < 0) fail("unknown struct", target);
+			} else fail("expected int, bytes, list or struct, got", token);
+
+			expect_name(field->name);
+			if(!next_token()) fail("expected ;", NULL);
+			if(token_is_string) {
+				memcpy(field->key, token, token_length);
+				field->key_length = token_length;
+				if(!next_token()) fail("expected ;", NULL);
+			} else {
+				strcpy(field->key, field->name);
+				field->key_length = strlen(field->name);
+			}
+			if(!is_word(";")) fail("expected ;, got", token);
+
+			if(strcmp(field->name, "present") == 0) fail("field name taken by the generated member:", field->name);
+			for(int f = 0; f < st->field_count; f++) {
+				if(strcmp(st->fields[f].name, field->name) == 0) fail("field declared twice:", field->name);
+				if(clashes_with_count(&st->fields[f], field) || clashes_with_count(field, &st->fields[f]))
+					fail("field name taken by a generated _count member:", clashes_with_count(field, &st->fields[f]) ? st->fields[f].name : field->name);
+				if(st->fields[f].key_length == field->key_length && memcmp(st->fields[f].key, field->key, field->key_length) == 0) fail("key used twice in", st->name);
+			}
+			st->field_count++;
+		}
+
+		struct_count++;
+	}
+}
+
+/*
+	Output
+*/
+
+static void print_upper(const char *name) {
+	for(; *name; name++) putchar(toupper((unsigned char) *name));
+}
+
+static void print_bit(const struct gen_struct *st, const struct gen_field *field) {
+	print_upper(st->name);
+	putchar('_');
+	print_upper(field->name);
+}
+
+static void print_key_literal(const struct gen_field *field) {
+	putchar('"');
+	for(size_t i = 0; i < field->key_length; i++) {
+		unsigned char c = field->key[i];
+		if(c == '"' || c == '\\') printf("\\%c", c);
+		else if(isprint(c)) putchar(c);
+		else printf("\\%03o", c);
+	}
+	putchar('"');
+}
+
+static const char* value_type(const struct gen_field *field) {
+	static char type[GEN_MAX_NAME + 8];
+	if(field->type == GEN_INT) return "int64_t";
+	if(field->type == GEN_BYTES) return "struct bencode_bytes";
+	snprintf(type, sizeof(type), "struct %s", structs[field->target].name);
+	return type;
+}
+
+static void print_declarations(const struct gen_struct *st) {
+	printf("struct %s {\n", st->name);
+	printf("\tuint64_t present; // ");
+	print_upper(st->name);
+	printf("_* bits of the keys that were found\n");
+
+	for(int f = 0; f < st->field_count; f++) {
+		const struct gen_field *field = &st->fields[f];
+		if(field->list) printf("\t%s *%s;\n\tsize_t %s_count;\n", value_type(field), field->name, field->name);
+		else printf("\t%s %s;\n", value_type(field), field->name);
+	}
+	printf("};\n\n");
+
+	for(int f = 0; f < st->field_count; f++) {
+		printf("#define ");
+		print_bit(st, &st->fields[f]);
+		printf(" ((uint64_t) 1 << %d)\n", f);
+	}
+
+	printf("\nchar* %s_parse(char *str, size_t length, struct %s *out, struct bencode_parser *parser);\n\n", st->name, st->name);
+}
+
+// Reads one value of the field's type into `target`.
+static void print_read(const struct gen_field *field, const char *target, const char *indent) {
+	if(field->type == GEN_INT)
+		printf("%scursor = bencode_schema_int(origin, cursor, end, %s, parser);\n", indent, target);
+	else if(field->type == GEN_BYTES)
+		printf("%scursor = bencode_schema_bytes(origin, cursor, end, %s, parser);\n", indent, target);
+	else
+		printf("%scursor = %s_read(origin, cursor, end, %s, parser);\n", indent, structs[field->target].name, target);
+}
+
+static void print_field(const struct gen_struct *st, const struct gen_field *field) {
+	printf("\t\t\tif(memcmp(key.bytes, ");
+	print_key_literal(field);
+	printf(", %zu) == 0) {\n", field->key_length);
+
+	if(field->list) {
+		printf("\t\t\t\tsize_t count;\n");
+		printf("\t\t\t\tcursor = bencode_schema_list(origin, cursor, end, &count, parser);\n");
+		printf("\t\t\t\tif(cursor == NULL) return NULL;\n");
+		printf("\t\t\t\tout->%s = count ? bencode_schema_array(origin, cursor, count, sizeof(*out->%s), parser) : NULL;\n", field->name, field->name);
+		printf("\t\t\t\tif(count && out->%s == NULL) return NULL;\n", field->name);
+		printf("\t\t\t\tfor(size_t i = 0; i < count; i++) {\n");
+
+		char target[GEN_MAX_NAME + 16];
+		snprintf(target, sizeof(target), "&out->%s[i]", field->name);
+		print_read(field, target, "\t\t\t\t\t");
+
+		printf("\t\t\t\t\tif(cursor == NULL) return NULL;\n");
+		printf("\t\t\t\t}\n");
+		printf("\t\t\t\tout->%s_count = count;\n", field->name);
+		printf("\t\t\t\tcursor++; // the list's 'e'\n");
+	} else {
+		char target[GEN_MAX_NAME + 8];
+		snprintf(target, sizeof(target), "&out->%s", field->name);
+		print_read(field, target, "\t\t\t\t");
+		printf("\t\t\t\tif(cursor == NULL) return NULL;\n");
+	}
+
+	printf("\t\t\t\tout->present |= ");
+	print_bit(st, field);
+	printf(";\n\t\t\t\tcontinue;\n\t\t\t}\n");
+}
+
+static void print_parser(const struct gen_struct *st) {
+	printf("static char* %s_read(char *origin, char *cursor, char *end, struct %s *out, struct bencode_parser *parser) {\n", st->name, st->name);
+	printf("\tmemset(out, 0, sizeof(*out));\n");
+	printf("\tif(cursor >= end) return bencode_schema_fail(origin, cursor, parser, BENCODE_ERR_EOF);\n");
+	printf("\tif(*cursor != 'd') return bencode_schema_fail(origin, cursor, parser, BENCODE_ERR_SCHEMA);\n");
+	printf("\tchar *start = cursor++;\n\n");
+
+	printf("\tfor(;;) {\n");
+	printf("\t\tif(cursor >= end) return bencode_schema_fail(origin, start, parser, BENCODE_ERR_EOF);\n");
+	printf("\t\tif(*cursor == 'e') break;\n\n");
+	printf("\t\tstruct bencode_bytes key;\n");
+	printf("\t\tcursor = bencode_schema_key(origin, cursor, end, &key, parser);\n");
+	printf("\t\tif(cursor == NULL) return NULL;\n\n");
+
+	if(st->field_count) {
+		printf("\t\tswitch(key.length) {\n");
+
+		// one case per key length, shortest first
+		size_t lengths[GEN_MAX_FIELDS];
+		int length_count = 0;
+		for(int f = 0; f < st->field_count; f++) {
+			size_t length = st->fields[f].key_length;
+			int seen = 0;
+			for(int k = 0; k < length_count; k++) seen |= (lengths[k] == length);
+			if(seen) continue;
+
+			int k = length_count++;
+			for(; k > 0 && lengths[k - 1] > length; k--) lengths[k] = lengths[k - 1];
+			lengths[k] = length;
+		}
+
+		for(int k = 0; k < length_count; k++) {
+			printf("\t\tcase %zu:\n", lengths[k]);
+			for(int f = 0; f < st->field_count; f++)
+				if(st->fields[f].key_length == lengths[k]) print_field(st, &st->fields[f]);
+			printf("\t\t\tbreak;\n");
+		}
+
+		printf("\t\t}\n\n");
+	}
+
+	printf("\t\tcursor = bencode_schema_skip(origin, cursor, end, parser); // not in the schema\n");
+	printf("\t\tif(cursor == NULL) return NULL;\n");
+	printf("\t}\n\n");
+
+	uint64_t required = 0;
+	for(int f = 0; f < st->field_count; f++)
+		if(st->fields[f].required) required |= (uint64_t) 1 << f;
+	if(required) {
+		printf("\tconst uint64_t required = 0x%llxULL;\n", (unsigned long long) required);
+		printf("\tif((out->present & required) != required) return bencode_schema_fail(origin, start, parser, BENCODE_ERR_SCHEMA);\n");
+	}
+	printf("\treturn cursor + 1;\n");
+	printf("}\n\n");
+
+	printf("char* %s_parse(char *str, size_t length, struct %s *out, struct bencode_parser *parser) {\n", st->name, st->name);
+	printf("\tparser->error = BENCODE_OK;\n");
+	printf("\tparser->error_offset = 0;\n");
+	printf("\treturn %s_read(str, str, str + length, out, parser);\n", st->name);
+	printf("}\n\n");
+}
+
+int main(int argc, char **argv) {
+	if(argc != 2) {
+		fprintf(stderr, "usage: %s file.schema > file.h\n", argv[0]);
+		return 2;
+	}
+	schema_path = argv[1];
+
+	FILE *file = fopen(schema_path, "rb");
+	if(file == NULL) {
+		perror(schema_path);
+		return 1;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	src = malloc(size + 1);
+	if(src == NULL || fread(src, 1, size, file) != (size_t) size) {
+		perror(schema_path);
+		return 1;
+	}
+	src[size] = 0;
+	fclose(file);
+
+	parse_schema();
+
+	// the include guard is made from the schema's file name
+	char guard[GEN_MAX_NAME * 2] = "";
+	const char *base = strrchr(schema_path, '/');
+	base = base ? base + 1 : schema_path;
+	size_t n = 0;
+	for(; base[n] && n < sizeof(guard) - 3; n++)
+		guard[n] = isalnum((unsigned char) base[n]) ? toupper((unsigned char) base[n]) : '_';
+	strcpy(guard + n, "_H");
+
+	printf("// Generated by bencode_gen from %s. Do not edit.\n\n", base);
+	printf("#ifndef %s\n#define %s\n\n#include \"bencode.h\"\n\n", guard, guard);
+	for(int s = 0; s < struct_count; s++) print_declarations(&structs[s]);
+	printf("#endif // %s\n\n", guard);
+
+	printf("#if defined(BENCODE_IMPLEMENTATION) && !defined(%s_IMPLEMENTED)\n#define %s_IMPLEMENTED\n\n", guard, guard);
+	for(int s = 0; s < struct_count; s++) print_parser(&structs[s]);
+	printf("#endif\n");
+
+	return 0;
+}
@@ -0,0 +1,3 @@
+gcc -Wall -Wextra -Wpedantic -Wshadow bencode_gen.c -o bencode_gen && ./bencode_gen krpc.schema > krpc.h && ./bencode_gen metainfo.schema > metainfo.h && \
+gcc -O2 -Wall -Wextra -Wpedantic -Wshadow bench.c -o bench && \
+gcc -O2 -Wall -Wextra -Wpedantic -Wshadow -DBENCODE_THREADS -pthread bench.c -o bench_threads
@@ -1 +1,3 @@
-gcc -g -Wall -Wextra -Wpedantic -fmax-errors=1 -Wshadow tests.c
\ No newline at end of file
+gcc -Wall -Wextra -Wpedantic -Wshadow bencode_gen.c -o bencode_gen && ./bencode_gen krpc.schema > krpc.h && ./bencode_gen metainfo.schema > metainfo.h && \
+gcc -g -Wall -Wextra -Wpedantic -fmax-errors=1 -Wshadow tests.c && \
+gcc -g -Wall -Wextra -Wpedantic -fmax-errors=1 -Wshadow -DBENCODE_THREADS -DBENCODE_SPANS -DBENCODE_STATS -pthread tests.c -o tests_threads && ./tests_threads
\ No newline at end of file
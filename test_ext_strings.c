@@ -59,10 +59,30 @@ void test_string_escape_sequence() {
 	
 }
 
+void test_string_lazy() {
+	struct bencode b = {0};
+	struct bencode_parser parser = {0};
+	parser.flags = BENCODE_OPT_LAZY;
+	
+	char *c1 = "d1:ald1:bs\"xy\"eee";
+	
+	lok(bencode_parse_with(c1, strlen(c1), &b, &parser) == c1 + strlen(c1));
+	struct bencode *list = bencode_gets(&b, "a");
+	lok(list->flags & BENCODE_FLAG_LAZY);
+	lok(bencode_expand(list, NULL) == 0);
+	struct bencode *s = bencode_gets(list->list, "b");
+	lok(s != NULL && s->type == BENCODE_BYTES);
+	lok(!(s->flags & BENCODE_FLAG_BORROWED)); // copied to the heap, freed with the tree
+	lok(s != NULL && memcmp(s->bytes, "xy", 3) == 0);
+	bencode_free(&b);
+	
+}
+
 int main() {
 	
 	lrun("(extension) string parsing", test_string_basic);
 	lrun("escape sequences", test_string_escape_sequence);
+	lrun("lazy strings", test_string_lazy);
 	
 	lresults();
 	
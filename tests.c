@@ -26,6 +26,10 @@
 // #define BENCODE_EXT_WHITESPACE
 #include "bencode.h"
 
+// generated from krpc.schema and metainfo.schema by compile_tests.sh
+#include "krpc.h"
+#include "metainfo.h"
+
 #define bencode_parse_test_returns_end_of_str(string, bencode) \
 	(bencode_parses((string), (bencode)) == (string) + strlen(string))
 
@@ -44,6 +48,39 @@ void test_int() {
 	// char *c3 = "i02e";
 	// lok(bencode_parses(c3, &b) == c3);
 	
+	char *c4 = "i9223372036854775807e";
+	lok(bencode_parses(c4, &b) == c4 + strlen(c4));
+	lok(b.i == INT64_MAX);
+	
+	char *c5 = "i-9223372036854775808e";
+	lok(bencode_parses(c5, &b) == c5 + strlen(c5));
+	lok(b.i == INT64_MIN);
+	
+	char *c6 = "i1234567890123456e";
+	lok(bencode_parses(c6, &b) == c6 + strlen(c6));
+	llequal(b.i, 1234567890123456l);
+	
+	char *c7 = "i-12345678e";
+	lok(bencode_parses(c7, &b) == c7 + strlen(c7));
+	llequal(b.i, -12345678l);
+}
+
+void test_int_overflow() {
+	char *overflow_tests[] = {
+		"i9223372036854775808e",
+		"i-9223372036854775809e",
+		"i99999999999999999999e",
+		"i123456789012345678901234567890e",
+		"18446744073709551616:abc",
+		"18446744073709551615:abc",
+	};
+	
+	int tests_count = sizeof(overflow_tests) / sizeof(char*);
+	for(int i = 0; i < tests_count; i++) {
+		struct bencode b = {0};
+		lok(bencode_parses(overflow_tests[i], &b) == overflow_tests[i]);
+		lok(b.type == 0);
+	}
 }
 
 void test_invalid() {
@@ -247,6 +284,72 @@ void test_dict_retrieve() {
 	bencode_free(&b);
 }
 
+void test_dict_exact_keys() {
+	struct bencode b = {0};
+	
+	char *c1 = "d5:namesi1e4:namei2e2:nai3ee";
+	lok(bencode_parse_test_returns_end_of_str(c1, &b));
+	llequal(bencode_gets(&b, "name")->i, 2l);
+	llequal(bencode_gets(&b, "names")->i, 1l);
+	llequal(bencode_getsn(&b, "name", 2)->i, 3l);
+	lok(bencode_gets(&b, "n") == NULL);
+	lok(bencode_gets(&b, "namesake") == NULL);
+	
+	bencode_free(&b);
+}
+
+void test_dict_index() {
+	char c1[4096];
+	char key[16];
+	
+	for(int shuffled = 0; shuffled < 2; shuffled++) {
+		struct bencode b = {0};
+		int n = sprintf(c1, "d");
+		for(int i = 0; i < 200; i++) {
+			int k = shuffled ? (i * 37) % 200 : i;
+			n += sprintf(c1 + n, "7:key%04di%de", k, k);
+		}
+		n += sprintf(c1 + n, "e");
+		lok(bencode_parse(c1, n, &b) == c1 + n);
+		
+		struct bencode_dict_index index;
+		lok(bencode_dict_index_build(&index, &b) == 0);
+		lequal((int) index.count, 200);
+		lok(index.slots >= 400);
+		
+		int found = 0;
+		for(int i = 0; i < 200; i++) {
+			sprintf(key, "key%04d", i);
+			struct bencode *value = bencode_dict_index_gets(&index, key, 7);
+			if(value && value->i == i && value == bencode_getsn(&b, key, 7)) found++;
+		}
+		lequal(found, 200);
+		
+		lok(bencode_dict_index_gets(&index, "key0200", 7) == NULL);
+		lok(bencode_dict_index_gets(&index, "key000", 6) == NULL);
+		lok(bencode_dict_index_gets(&index, "", 0) == NULL);
+		
+		bencode_dict_index_free(&index);
+		bencode_free(&b);
+	}
+	
+	// duplicate keys resolve to the first one, like bencode_gets
+	struct bencode b = {0};
+	char *c2 = "d1:ai1e1:bi2e1:ai3ee";
+	lok(bencode_parses(c2, &b) == c2 + strlen(c2));
+	struct bencode_dict_index index;
+	lok(bencode_dict_index_build(&index, &b) == 0);
+	llequal(bencode_dict_index_gets(&index, "a", 1)->i, 1l);
+	bencode_dict_index_free(&index);
+	bencode_free(&b);
+	
+	struct bencode empty = {0};
+	lok(bencode_parses("de", &empty) != NULL);
+	lok(bencode_dict_index_build(&index, &empty) == 0);
+	lok(bencode_dict_index_gets(&index, "a", 1) == NULL);
+	bencode_dict_index_free(&index);
+}
+
 void test_dict_error() {
 	struct bencode b = {0};
 	
@@ -260,6 +363,1291 @@ void test_dict_error() {
 	bencode_free(&b);
 }
 
+void test_arena() {
+	struct bencode_arena arena = {0};
+	struct bencode b = {0};
+	
+	char *c1 = "d4:named5:first7:Winston4:last10:Churchhille3:agei69ee";
+	lok(bencode_parse_arena(c1, strlen(c1), &b, &arena) == c1 + strlen(c1));
+	lok(arena.first != NULL);
+	
+	struct bencode *name = bencode_gets(&b, "name");
+	lok(name != NULL && name->type == BENCODE_DICT);
+	lok(memcmp(bencode_gets(name, "last")->bytes, "Churchhill", 10) == 0);
+	llequal(bencode_gets(&b, "age")->i, 69l);
+	
+	// a reset arena hands the same memory to the next document
+	struct bencode_arena_block *first = arena.first;
+	size_t used = arena.first->used;
+	bencode_arena_reset(&arena);
+	lok(arena.first->used == 0);
+	
+	struct bencode c = {0};
+	lok(bencode_parse_arena(c1, strlen(c1), &c, &arena) == c1 + strlen(c1));
+	lok(arena.first == first);
+	lok(arena.first->used == used);
+	lok(c.dict == b.dict);
+	
+	// blocks smaller than a single allocation still work
+	struct bencode_arena tiny = {0};
+	bencode_arena_init(&tiny, 16);
+	struct bencode d = {0};
+	lok(bencode_parse_arena(c1, strlen(c1), &d, &tiny) == c1 + strlen(c1));
+	llequal(bencode_gets(&d, "age")->i, 69l);
+	lok(tiny.first->next != NULL);
+	
+	bencode_arena_free(&tiny);
+	bencode_arena_free(&arena);
+	lok(arena.first == NULL);
+}
+
+void test_borrowed() {
+	struct bencode_parser parser = {0};
+	parser.flags = BENCODE_OPT_BORROW;
+	
+	char *c1 = "d4:named5:first7:Winston4:last10:Churchhille6:pieces6:abcdefe";
+	struct bencode b = {0};
+	lok(bencode_parse_with(c1, strlen(c1), &b, &parser) == c1 + strlen(c1));
+	
+	struct bencode *pieces = bencode_gets(&b, "pieces");
+	lok(pieces != NULL);
+	lok(pieces->flags & BENCODE_FLAG_BORROWED);
+	lok(pieces->bytes == strstr(c1, "abcdef"));
+	lok(pieces->key == strstr(c1, "pieces"));
+	lok(pieces->flags & BENCODE_FLAG_BORROWED_KEY);
+	
+	struct bencode *last = bencode_gets(bencode_gets(&b, "name"), "last");
+	lok(last->bytes == strstr(c1, "Churchhill"));
+	
+	// only the nodes are released, the input still holds the bytes
+	bencode_free(&b);
+	
+	// borrowing also works out of an arena
+	struct bencode_arena arena = {0};
+	parser.arena = &arena;
+	struct bencode c = {0};
+	lok(bencode_parse_with(c1, strlen(c1), &c, &parser) == c1 + strlen(c1));
+	lok(bencode_gets(&c, "pieces")->bytes == strstr(c1, "abcdef"));
+	bencode_arena_free(&arena);
+}
+
+void test_tape() {
+	struct bencode_tape tape = {0};
+	
+	char *c1 = "d4:named5:first7:Winston4:last10:Churchhille3:agei69e4:tagsli1ei2eli3eeee";
+	lok(bencode_parse_tape(c1, strlen(c1), &tape) == c1 + strlen(c1));
+	print_bencode_tape(&tape, 0, 0);
+	
+	lok(tape.entries[0].type == BENCODE_DICT);
+	lequal((int) tape.entries[0].length, 3);
+	lequal((int) tape.entries[0].end, (int) tape.count);
+	
+	size_t name = bencode_tape_gets(&tape, 0, "name");
+	lok(name != 0);
+	lok(tape.entries[name].type == BENCODE_DICT);
+	lequal((int) tape.entries[name].length, 2);
+	
+	size_t last = bencode_tape_gets(&tape, name, "last");
+	lok(last != 0);
+	lok(memcmp(tape.entries[last].bytes, "Churchhill", 10) == 0);
+	
+	lequal((int) tape.entries[bencode_tape_gets(&tape, 0, "age")].i, 69);
+	lok(bencode_tape_gets(&tape, 0, "ag") == 0);
+	lok(bencode_tape_gets(&tape, name, "age") == 0);
+	
+	// the nested list is skipped over in one step
+	size_t tags = bencode_tape_gets(&tape, 0, "tags");
+	lequal((int) tape.entries[tags].length, 3);
+	int64_t sum = 0;
+	int children = 0;
+	for(size_t i = tags + 1; i < tape.entries[tags].end; i = bencode_tape_next(&tape, i), children++)
+		if(tape.entries[i].type == BENCODE_INT) sum += tape.entries[i].i;
+	lequal(children, 3);
+	llequal(sum, 3l);
+	
+	char *invalid[] = {
+		"l5e",
+		"li24e",
+		"d3:abce",
+		"di1ei2ee",
+		"d1:ai1e1:be",
+		"e",
+	};
+	for(unsigned int i = 0; i < sizeof(invalid) / sizeof(char*); i++)
+		lok(bencode_parse_tape(invalid[i], strlen(invalid[i]), &tape) == invalid[i]);
+	
+	char *c2 = "i42e4:eggs";
+	lok(bencode_parse_tape(c2, strlen(c2), &tape) == c2 + 4);
+	lequal((int) tape.count, 1);
+	
+	bencode_tape_free(&tape);
+}
+
+void test_compact() {
+	struct bencode_compact doc = {0};
+	lequal((int) sizeof(struct bencode_compact_node), 16);
+	
+	char *c1 = "d4:named5:first7:Winston4:last10:Churchhille3:agei69e4:tagsli1ei-2e12:twelve bytesee";
+	lok(bencode_parse_compact(c1, strlen(c1), &doc) == c1 + strlen(c1));
+	
+	// keys are not nodes: root, name, first, last, age, tags and its 3 elements
+	lequal((int) doc.count, 9);
+	lequal((int) doc.key_count, 5);
+	lequal(bencode_compact_type(&doc, 0), BENCODE_DICT);
+	lequal((int) bencode_compact_count(&doc, 0), 3);
+	lequal((int) bencode_compact_end(&doc, 0), 9);
+	
+	size_t name = bencode_compact_gets(&doc, 0, "name");
+	lok(name != 0);
+	size_t length;
+	size_t first = bencode_compact_gets(&doc, name, "first");
+	lok(memcmp(bencode_compact_bytes(&doc, first, &length), "Winston", 7) == 0);
+	lequal((int) length, 7);
+	lok(doc.nodes[first].inline_length == 7);
+	size_t last = bencode_compact_gets(&doc, name, "last");
+	lok(memcmp(bencode_compact_bytes(&doc, last, &length), "Churchhill", 10) == 0);
+	lok(doc.nodes[last].inline_length == BENCODE_COMPACT_POOLED);
+	lok(memcmp(bencode_compact_key(&doc, last, &length), "last", 4) == 0 && length == 4);
+	
+	llequal(bencode_compact_int(&doc, bencode_compact_gets(&doc, 0, "age")), 69l);
+	lok(bencode_compact_gets(&doc, 0, "ag") == 0);
+	lok(bencode_compact_gets(&doc, name, "age") == 0);
+	
+	size_t tags = bencode_compact_gets(&doc, 0, "tags");
+	int64_t sum = 0;
+	int children = 0;
+	for(size_t i = tags + 1; i < bencode_compact_end(&doc, tags); i = bencode_compact_next(&doc, i), children++) {
+		lok(bencode_compact_key(&doc, i, &length) == NULL);
+		sum += bencode_compact_int(&doc, i);
+	}
+	lequal(children, 3);
+	llequal(sum, -1l);
+	lok(memcmp(bencode_compact_bytes(&doc, tags + 3, &length), "twelve bytes", 12) == 0 && length == 12);
+	lok(bencode_compact_bytes(&doc, tags, &length) == NULL);
+	
+	bencode_compact_shrink(&doc);
+	lequal((int) doc.capacity, 9);
+	lok(memcmp(bencode_compact_bytes(&doc, last, &length), "Churchhill", 10) == 0);
+	
+	char *invalid[] = {
+		"l5e",
+		"li24e",
+		"d3:abce",
+		"di1ei2ee",
+		"d1:ai1e1:be",
+		"e",
+	};
+	for(unsigned int i = 0; i < sizeof(invalid) / sizeof(char*); i++)
+		lok(bencode_parse_compact(invalid[i], strlen(invalid[i]), &doc) == invalid[i]);
+	
+	char *c2 = "i42e4:eggs";
+	lok(bencode_parse_compact(c2, strlen(c2), &doc) == c2 + 4);
+	lequal((int) doc.count, 1);
+	
+	bencode_compact_free(&doc);
+}
+
+void test_stream() {
+	char *c1 = "d4:named5:first7:Winston4:last10:Churchhille3:agei-69e4:tagsli1e0:leee";
+	size_t length = strlen(c1);
+	
+	// every chunk size gives the same tree as parsing in one go
+	for(size_t chunk = 1; chunk <= length; chunk++) {
+		struct bencode b;
+		struct bencode_stream stream;
+		bencode_stream_init(&stream, &b, NULL);
+		
+		enum bencode_stream_status status = BENCODE_NEED_MORE;
+		size_t offset = 0, consumed = 0;
+		while(offset < length && status == BENCODE_NEED_MORE) {
+			size_t n = (length - offset < chunk) ? length - offset : chunk;
+			status = bencode_stream_feed(&stream, c1 + offset, n, &consumed);
+			offset += consumed;
+		}
+		
+		lok(status == BENCODE_DONE);
+		lok(offset == length);
+		lok(stream.offset == length);
+		llequal(bencode_gets(&b, "age")->i, -69l);
+		lok(memcmp(bencode_gets(bencode_gets(&b, "name"), "last")->bytes, "Churchhill", 10) == 0);
+		lok(bencode_gets(&b, "tags")->list->next->length == 0);
+		
+		bencode_stream_free(&stream);
+		bencode_free(&b);
+	}
+	
+	// back to back messages: DONE reports how much of the chunk was used
+	char *c2 = "i42e4:spamli1ee";
+	struct bencode b;
+	struct bencode_stream stream;
+	size_t consumed;
+	bencode_stream_init(&stream, &b, NULL);
+	lok(bencode_stream_feed(&stream, c2, strlen(c2), &consumed) == BENCODE_DONE);
+	lequal((int) consumed, 4);
+	lok(bencode_stream_feed(&stream, c2 + 4, 1, &consumed) == BENCODE_DONE);
+	lequal((int) consumed, 0);
+	bencode_stream_free(&stream);
+	
+	bencode_stream_init(&stream, &b, NULL);
+	lok(bencode_stream_feed(&stream, c2 + 4, 3, &consumed) == BENCODE_NEED_MORE);
+	lok(bencode_stream_feed(&stream, c2 + 7, strlen(c2) - 7, &consumed) == BENCODE_DONE);
+	lequal((int) consumed, 3);
+	lok(memcmp(b.bytes, "spam", 4) == 0);
+	bencode_stream_free(&stream);
+	bencode_free(&b);
+	
+	// errors carry the offset of the offending byte across chunks
+	char *invalid[] = { "li1ei2x", "di1ei2ee", "i-0e", "d3:abce", "i99999999999999999999e", "d1:a1:b1x", "l4:ab!d" };
+	size_t offsets[] = { 6, 1, 2, 6, 20, 8, 7 };
+	for(unsigned int i = 0; i < sizeof(invalid) / sizeof(char*); i++) {
+		bencode_stream_init(&stream, &b, NULL);
+		enum bencode_stream_status status = BENCODE_NEED_MORE;
+		for(size_t j = 0; j < strlen(invalid[i]) && status == BENCODE_NEED_MORE; j += 2)
+			status = bencode_stream_feed(&stream, invalid[i] + j, (strlen(invalid[i]) - j < 2) ? 1 : 2, NULL);
+		
+		if(i == sizeof(invalid) / sizeof(char*) - 1) {
+			// valid, just not finished
+			lok(status == BENCODE_NEED_MORE);
+		} else {
+			lok(status == BENCODE_ERROR);
+			lequal((int) stream.error_offset, (int) offsets[i]);
+		}
+		bencode_stream_free(&stream);
+		bencode_free(&b);
+	}
+	
+	// a huge length prefix is refused before anything is allocated
+	bencode_stream_init(&stream, &b, NULL);
+	lok(bencode_stream_feed(&stream, "99999999999:", 12, NULL) == BENCODE_ERROR);
+	lok(stream.error == BENCODE_ERR_OVERFLOW);
+	bencode_stream_free(&stream);
+	bencode_free(&b);
+}
+
+void test_depth_limit() {
+	static char deep[20001];
+	struct bencode_parser parser = {0};
+	
+	// an attacker-sized nesting is refused without touching the C stack
+	memset(deep, 'l', 10000);
+	memset(deep + 10000, 'e', 10000);
+	
+	struct bencode b = {0};
+	lok(bencode_parse_with(deep, 20000, &b, &parser) == deep + BENCODE_MAX_DEPTH);
+	lok(parser.error == BENCODE_ERR_DEPTH);
+	lequal((int) parser.error_offset, BENCODE_MAX_DEPTH);
+	bencode_free(&b);
+	
+	// deeper than the inline frames but within the limit
+	parser.max_depth = 10000;
+	lok(bencode_parse_with(deep, 20000, &b, &parser) == deep + 20000);
+	lok(parser.error == BENCODE_OK);
+	int depth = 0;
+	for(struct bencode *head = &b; head; head = head->list) depth++;
+	lequal(depth, 10000);
+	bencode_free(&b);
+	
+	parser.max_depth = 2;
+	char *c1 = "lli1eee";
+	lok(bencode_parse_with(c1, strlen(c1), &b, &parser) == c1 + strlen(c1));
+	bencode_free(&b);
+	char *c2 = "llli1eeee";
+	lok(bencode_parse_with(c2, strlen(c2), &b, &parser) == c2 + 2);
+	lok(parser.error == BENCODE_ERR_DEPTH);
+	bencode_free(&b);
+	
+	struct bencode_stream stream;
+	bencode_stream_init(&stream, &b, &parser);
+	lok(bencode_stream_feed(&stream, c2, strlen(c2), NULL) == BENCODE_ERROR);
+	lok(stream.error == BENCODE_ERR_DEPTH);
+	lequal((int) stream.error_offset, 2);
+	bencode_stream_free(&stream);
+	bencode_free(&b);
+}
+
+void test_parse_errors() {
+	struct bencode_parser parser = {0};
+	
+	char *tests[] = { "li1ei2", "i12", "5:abc", "li1exe", "d1:ai1ei2ei3ee", "i99999999999999999999e", "li1e", "" };
+	enum bencode_error errors[] = {
+		BENCODE_ERR_EOF, BENCODE_ERR_EOF, BENCODE_ERR_EOF, BENCODE_ERR_SYNTAX,
+		BENCODE_ERR_SYNTAX, BENCODE_ERR_OVERFLOW, BENCODE_ERR_EOF, BENCODE_ERR_EOF
+	};
+	size_t offsets[] = { 4, 0, 0, 4, 7, 0, 0, 0 };
+	
+	for(unsigned int i = 0; i < sizeof(tests) / sizeof(char*); i++) {
+		struct bencode b = {0};
+		lok(bencode_parse_with(tests[i], strlen(tests[i]), &b, &parser) == tests[i] + offsets[i]);
+		lequal(parser.error, errors[i]);
+		lequal((int) parser.error_offset, (int) offsets[i]);
+		bencode_free(&b);
+	}
+	
+	char *c1 = "d1:ai1ee";
+	struct bencode b = {0};
+	lok(bencode_parse_with(c1, strlen(c1), &b, &parser) == c1 + strlen(c1));
+	lok(parser.error == BENCODE_OK);
+	bencode_free(&b);
+}
+
+void test_canonical() {
+	struct bencode_parser parser = {0};
+	parser.flags = BENCODE_OPT_CANONICAL;
+	
+	char *canonical[] = { "i0e", "i-10e", "0:", "10:abcdefghij", "d0:i0e1:ai1e2:aai2e1:bi3ee", "ld1:ad1:yi0e1:zi0eeee" };
+	for(unsigned int i = 0; i < sizeof(canonical) / sizeof(char*); i++) {
+		struct bencode b = {0};
+		lok(bencode_parse_with(canonical[i], strlen(canonical[i]), &b, &parser) == canonical[i] + strlen(canonical[i]));
+		lequal(parser.error, BENCODE_OK);
+		bencode_free(&b);
+	}
+	
+	// each of these parses normally, but is not canonical
+	char *tests[] = { "i03e", "i00e", "03:abc", "d1:bi1e1:ai2ee", "d1:ai1e1:ai2ee", "d2:abi1e1:ai2ee", "d1:ai1e02:bbi2ee", "d1:ad1:zi0e1:yi0eee" };
+	size_t offsets[] = { 0, 0, 0, 7, 7, 8, 7, 11 };
+	
+	for(unsigned int i = 0; i < sizeof(tests) / sizeof(char*); i++) {
+		struct bencode b = {0};
+		struct bencode_parser plain = {0};
+		lok(bencode_parse_with(tests[i], strlen(tests[i]), &b, &plain) == tests[i] + strlen(tests[i]));
+		bencode_free(&b);
+		
+		memset(&b, 0, sizeof(b));
+		bencode_parse_with(tests[i], strlen(tests[i]), &b, &parser);
+		lequal(parser.error, BENCODE_ERR_CANONICAL);
+		lequal((int) parser.error_offset, (int) offsets[i]);
+		bencode_free(&b);
+	}
+	
+	// lazily skipped values are checked as well
+	struct bencode_parser lazy = {0};
+	lazy.flags = BENCODE_OPT_CANONICAL | BENCODE_OPT_LAZY;
+	for(unsigned int i = 0; i < sizeof(tests) / sizeof(char*); i++) {
+		char nested[32];
+		size_t n = sprintf(nested, "l%se", tests[i]);
+		
+		struct bencode b = {0};
+		bencode_parse_with(nested, n, &b, &lazy);
+		lequal(lazy.error, BENCODE_ERR_CANONICAL);
+		lequal((int) lazy.error_offset, (int) offsets[i] + 1);
+		bencode_free(&b);
+	}
+	
+	// and so is each level bencode_expand() builds
+	char *c1 = "d1:ad1:bi1e1:ai2eee";
+	struct bencode b = {0};
+	lazy.flags = BENCODE_OPT_LAZY;
+	lok(bencode_parse_with(c1, strlen(c1), &b, &lazy) == c1 + strlen(c1));
+	lazy.flags = BENCODE_OPT_CANONICAL;
+	lok(bencode_expand(b.dict, &lazy) == -1);
+	lequal(lazy.error, BENCODE_ERR_CANONICAL);
+	lequal((int) lazy.error_offset, 7);
+	lok(b.dict->flags & BENCODE_FLAG_LAZY);
+	lok(bencode_expand(b.dict, NULL) == 0);
+	bencode_free(&b);
+}
+
+void test_padded() {
+	struct bencode_parser plain = {0}, padded = {0};
+	padded.flags = BENCODE_OPT_PADDED;
+	
+	// padding full of digits must never become part of a token
+	char *docs[] = {
+		"d1:ad2:id20:abcdefghij0123456789e1:q4:ping1:t2:aa1:y1:qe", "i0e", "i-7e", "i1234567e", "i12345678e",
+		"i-9223372036854775808e", "i9223372036854775808e", "i-0e", "ie", "i-e", "i12", "12", "3:ab", "0:", "10:abcdefghij",
+		"li1ei22ei333e4:spame", "d1:ai1e", "d1:ai1e2:bb",
+	};
+	
+	for(unsigned int i = 0; i < sizeof(docs) / sizeof(char*); i++) {
+		char buffer[128];
+		size_t n = strlen(docs[i]);
+		memset(buffer, '9', sizeof(buffer));
+		memcpy(buffer, docs[i], n);
+		
+		struct bencode a = {0}, b = {0};
+		char *end_plain = bencode_parse_with(buffer, n, &a, &plain);
+		char *end_padded = bencode_parse_with(buffer, n, &b, &padded);
+		lok(end_padded == end_plain);
+		lequal(padded.error, plain.error);
+		lequal((int) padded.error_offset, (int) plain.error_offset);
+		
+		if(plain.error == BENCODE_OK) {
+			char x[128], y[128];
+			char *ex = bencode_encode(&a, x, sizeof(x), 0);
+			char *ey = bencode_encode(&b, y, sizeof(y), 0);
+			lok(ex - x == ey - y && memcmp(x, y, ex - x) == 0);
+		}
+		bencode_free(&a);
+		bencode_free(&b);
+	}
+}
+
+void test_encode() {
+	char out[256];
+	char *docs[] = {
+		"i0e", "i-42e", "i9223372036854775807e", "i-9223372036854775808e",
+		"0:", "5:hello", "le", "de",
+		"li1ei22ei333e4:spamd3:cow3:mooee",
+		"d4:infod6:lengthi1234567890e4:name8:file.txte8:announce3:urle",
+	};
+	
+	int roundtrips = 0;
+	for(size_t k = 0; k < sizeof(docs) / sizeof(docs[0]); k++) {
+		struct bencode b = {0};
+		size_t n = strlen(docs[k]);
+		if(bencode_parse(docs[k], n, &b) != docs[k] + n) continue;
+		
+		size_t size = bencode_encoded_size(&b);
+		char *e = bencode_encode(&b, out, size, 0);
+		if(size == n && e == out + n && memcmp(out, docs[k], n) == 0
+			&& bencode_encode(&b, out, size - 1, 0) == NULL) roundtrips++;
+		bencode_free(&b);
+	}
+	lequal(roundtrips, (int) (sizeof(docs) / sizeof(docs[0])));
+	
+	// canonical mode sorts keys by raw bytes, at every level
+	struct bencode b = {0};
+	char *c1 = "d1:bi1e2:aad1:zi0e1:yi0ee1:ai2e0:i3ee";
+	lok(bencode_parse_test_returns_end_of_str(c1, &b));
+	
+	char *e = bencode_encode(&b, out, sizeof(out), BENCODE_ENCODE_CANONICAL);
+	char *sorted = "d0:i3e1:ai2e2:aad1:yi0e1:zi0ee1:bi1ee";
+	lok(e == out + strlen(sorted));
+	lok(memcmp(out, sorted, strlen(sorted)) == 0);
+	lequal((int) bencode_encoded_size(&b), (int) strlen(sorted));
+	
+	// the tree itself is untouched
+	e = bencode_encode(&b, out, sizeof(out), 0);
+	lok(e == out + strlen(c1));
+	lok(memcmp(out, c1, strlen(c1)) == 0);
+	bencode_free(&b);
+	
+	// more keys than fit on the stack
+	char c2[2048];
+	int n = sprintf(c2, "d");
+	for(int i = 0; i < 100; i++) n += sprintf(c2 + n, "3:k%02di%de", 99 - i, i);
+	n += sprintf(c2 + n, "e");
+	lok(bencode_parse(c2, n, &b) == c2 + n);
+	
+	char encoded[2048];
+	e = bencode_encode(&b, encoded, sizeof(encoded), BENCODE_ENCODE_CANONICAL);
+	lok(e == encoded + n);
+	lok(memcmp(encoded, "d3:k00i99e3:k01i98e", 19) == 0);
+	lok(memcmp(e - 9, "3:k99i0ee", 9) == 0);
+	bencode_free(&b);
+	
+	// encoding and freeing do not recurse either, however deep the tree
+	size_t levels = 100000;
+	char *deep = malloc(levels * 17 + 2);
+	char *sorted_deep = malloc(levels * 17 + 2);
+	char *cursor = deep;
+	char *expected = sorted_deep;
+	for(size_t i = 0; i < levels; i++) {
+		memcpy(cursor, "d1:bi0e1:a", 10);
+		memcpy(expected, "d1:a", 4);
+		cursor += 10;
+		expected += 4;
+	}
+	memcpy(cursor, "le", 2);
+	memcpy(expected, "le", 2);
+	cursor += 2;
+	expected += 2;
+	for(size_t i = 0; i < levels; i++) {
+		*cursor++ = 'e';
+		memcpy(expected, "1:bi0ee", 7);
+		expected += 7;
+	}
+	
+	struct bencode_parser parser = {0};
+	parser.max_depth = levels + 1;
+	lok(bencode_parse_with(deep, cursor - deep, &b, &parser) == cursor);
+	lequal((int) bencode_encoded_size(&b), (int) (cursor - deep));
+	
+	char *deep_out = malloc(cursor - deep);
+	lok(bencode_encode(&b, deep_out, cursor - deep, BENCODE_ENCODE_CANONICAL) == deep_out + (cursor - deep));
+	lok(memcmp(deep_out, sorted_deep, cursor - deep) == 0);
+	lok(bencode_encode(&b, deep_out, cursor - deep - 1, 0) == NULL);
+	bencode_free(&b);
+	
+	free(deep_out);
+	free(sorted_deep);
+	free(deep);
+}
+
+void test_skip() {
+	char *valid[] = { "i-5e", "4:spam", "le", "de", "li1eli2eee", "d1:ad1:bl0:eee", "d0:le1:ai1ee" };
+	int skipped = 0;
+	for(size_t k = 0; k < sizeof(valid) / sizeof(valid[0]); k++) {
+		char buf[64];
+		size_t n = strlen(valid[k]);
+		memcpy(buf, valid[k], n);
+		memcpy(buf + n, "i7e", 3); // trailing data is not part of the value
+		if(bencode_skip(buf, n + 3) == buf + n) skipped++;
+	}
+	lequal(skipped, (int) (sizeof(valid) / sizeof(valid[0])));
+	
+	char *invalid[] = { "", "l", "li1e", "di1ei2ee", "d1:ae", "d1:ai1e", "i-0e", "5:spam", "lx" };
+	int rejected = 0;
+	for(size_t k = 0; k < sizeof(invalid) / sizeof(invalid[0]); k++)
+		if(bencode_skip(invalid[k], strlen(invalid[k])) == NULL) rejected++;
+	lequal(rejected, (int) (sizeof(invalid) / sizeof(invalid[0])));
+	
+	static char deep[2 * (BENCODE_MAX_DEPTH + 1)];
+	memset(deep, 'l', BENCODE_MAX_DEPTH);
+	memset(deep + BENCODE_MAX_DEPTH, 'e', BENCODE_MAX_DEPTH);
+	lok(bencode_skip(deep, 2 * BENCODE_MAX_DEPTH) == deep + 2 * BENCODE_MAX_DEPTH);
+	memset(deep, 'l', BENCODE_MAX_DEPTH + 1);
+	memset(deep + BENCODE_MAX_DEPTH + 1, 'e', BENCODE_MAX_DEPTH + 1);
+	lok(bencode_skip(deep, sizeof(deep)) == NULL);
+}
+
+void test_lazy() {
+	char *c1 = "d8:announce3:url4:infod5:filesld6:lengthi1e4:pathl1:aeed6:lengthi2e4:pathl1:beee4:name3:abc12:piece lengthi16384eee";
+	size_t n = strlen(c1);
+	
+	struct bencode b = {0};
+	struct bencode_parser parser = {0};
+	parser.flags = BENCODE_OPT_LAZY;
+	lok(bencode_parse_with(c1, n, &b, &parser) == c1 + n);
+	
+	struct bencode *info = b.dict->next;
+	lok(info->flags & BENCODE_FLAG_LAZY);
+	lok(info->bytes == c1 + 22 && info->length == n - 23);
+	lok(b.dict->flags & BENCODE_FLAG_BORROWED); // lazy parsing borrows
+	
+	lequal((int) bencode_gets(info, "piece length")->i, 16384);
+	lok(!(info->flags & BENCODE_FLAG_LAZY));
+	lok(info->next == NULL);
+	
+	struct bencode *files = bencode_gets(info, "files");
+	lok(files->flags & BENCODE_FLAG_LAZY);
+	lok(bencode_expand(files, NULL) == 0);
+	lok(files->list->flags & BENCODE_FLAG_LAZY);
+	lequal((int) bencode_gets(files->list->next, "length")->i, 2);
+	lok(memcmp(bencode_gets(info, "name")->bytes, "abc", 3) == 0);
+	
+	// partly expanded trees encode back to the input
+	char out[256];
+	lequal((int) bencode_encoded_size(&b), (int) n);
+	lok(bencode_encode(&b, out, sizeof(out), 0) == out + n);
+	lok(memcmp(out, c1, n) == 0);
+	bencode_free(&b);
+	
+	// nested values are still fully checked
+	char *c2 = "d1:ad1:xi1ei2eee";
+	lok(bencode_parse_with(c2, strlen(c2), &b, &parser) == c2 + 11);
+	lequal(parser.error, BENCODE_ERR_SYNTAX);
+	bencode_free(&b);
+	
+	// a bad value after a skipped one is still an error
+	char *c3 = "d1:ad1:bi1ee1:bce";
+	lok(bencode_parse_with(c3, strlen(c3), &b, &parser) == c3 + 15);
+	lequal(parser.error, BENCODE_ERR_SYNTAX);
+	bencode_free(&b);
+	
+	// expanding into an arena
+	struct bencode_arena arena = {0};
+	parser.arena = &arena;
+	lok(bencode_parse_with(c1, n, &b, &parser) == c1 + n);
+	info = bencode_gets(&b, "info");
+	lok(bencode_expand(info, &parser) == 0);
+	files = bencode_gets(info, "files");
+	lok(bencode_expand(files, &parser) == 0);
+	lok(bencode_expand(files->list, &parser) == 0);
+	lequal((int) bencode_gets(files->list, "length")->i, 1);
+	bencode_arena_free(&arena);
+}
+
+void test_validate() {
+	char *valid[] = { "i0e", "i-5e", "i10e", "0:", "4:spam", "le", "de", "d1:ad1:bl0:eee", "li-9223372036854775808ee" };
+	int accepted = 0;
+	for(size_t k = 0; k < sizeof(valid) / sizeof(valid[0]); k++)
+		if(bencode_validate(valid[k], strlen(valid[k]), NULL) == BENCODE_OK) accepted++;
+	lequal(accepted, (int) (sizeof(valid) / sizeof(valid[0])));
+	
+	char *invalid[] = { "i03e", "i-0e", "i00e", "li1ei01ee", "i1ei2e", "d1:ai1e", "5:spam", "di1ei2ee", "" };
+	enum bencode_error errors[] = { BENCODE_ERR_SYNTAX, BENCODE_ERR_SYNTAX, BENCODE_ERR_SYNTAX, BENCODE_ERR_SYNTAX, BENCODE_ERR_SYNTAX, BENCODE_ERR_EOF, BENCODE_ERR_EOF, BENCODE_ERR_SYNTAX, BENCODE_ERR_EOF };
+	size_t offsets[] = { 0, 0, 0, 4, 3, 7, 0, 1, 0 };
+	for(size_t k = 0; k < sizeof(invalid) / sizeof(invalid[0]); k++) {
+		size_t offset = 99;
+		lequal(bencode_validate(invalid[k], strlen(invalid[k]), &offset), errors[k]);
+		lequal((int) offset, (int) offsets[k]);
+	}
+	
+	static char deep[2 * (BENCODE_MAX_DEPTH + 1)];
+	memset(deep, 'l', BENCODE_MAX_DEPTH + 1);
+	memset(deep + BENCODE_MAX_DEPTH + 1, 'e', BENCODE_MAX_DEPTH + 1);
+	size_t offset;
+	lequal(bencode_validate(deep, sizeof(deep), &offset), BENCODE_ERR_DEPTH);
+	lequal((int) offset, BENCODE_MAX_DEPTH);
+}
+
+void test_schema() {
+	struct bencode_arena arena = {0};
+	struct bencode_parser parser = {0};
+	struct krpc_message msg;
+	
+	char *c1 = "d1:ad2:id20:abcdefghij0123456789e1:q4:ping1:t2:aa1:y1:qe";
+	lok(krpc_message_parse(c1, strlen(c1), &msg, &parser) == c1 + strlen(c1));
+	lok(msg.present == (KRPC_MESSAGE_A | KRPC_MESSAGE_Q | KRPC_MESSAGE_T | KRPC_MESSAGE_Y));
+	lok(msg.q.length == 4 && memcmp(msg.q.bytes, "ping", 4) == 0);
+	lok(msg.a.id.length == 20 && msg.a.id.bytes == c1 + 12);
+	
+	// unknown keys are skipped, lists come from the arena
+	char *c2 = "d2:ip4:abcd1:rd2:id20:abcdefghij01234567895:token4:tokn6:valuesl6:peer016:peer02ee1:t2:aa1:v4:UT011:y1:re";
+	lok(krpc_message_parse(c2, strlen(c2), &msg, &parser) == NULL);
+	lequal(parser.error, BENCODE_ERR_NOMEM);
+	parser.arena = &arena;
+	lok(krpc_message_parse(c2, strlen(c2), &msg, &parser) == c2 + strlen(c2));
+	lequal((int) msg.r.values_count, 2);
+	lok(memcmp(msg.r.values[1].bytes, "peer02", 6) == 0);
+	lok(msg.v.length == 4 && memcmp(msg.r.token.bytes, "tokn", 4) == 0);
+	
+	char *invalid[] = { "d1:y1:qe", "d1:ti1e1:y1:qe", "d1:t2:aa", "l1:te" };
+	enum bencode_error errors[] = { BENCODE_ERR_SCHEMA, BENCODE_ERR_SCHEMA, BENCODE_ERR_EOF, BENCODE_ERR_SCHEMA };
+	size_t offsets[] = { 0, 4, 0, 0 };
+	for(size_t k = 0; k < sizeof(invalid) / sizeof(invalid[0]); k++) {
+		lok(krpc_message_parse(invalid[k], strlen(invalid[k]), &msg, &parser) == NULL);
+		lequal(parser.error, errors[k]);
+		lequal((int) parser.error_offset, (int) offsets[k]);
+	}
+	
+	char *c3 = "d8:announce3:url4:infod5:filesld6:lengthi5e4:pathl1:a1:beed6:lengthi7e4:pathl1:ceee"
+		"4:name3:dir12:piece lengthi16384e6:pieces20:aaaaaaaaaaaaaaaaaaaaee";
+	struct metainfo torrent;
+	lok(metainfo_parse(c3, strlen(c3), &torrent, &parser) == c3 + strlen(c3));
+	lequal((int) torrent.info.piece_length, 16384);
+	lequal((int) torrent.info.files_count, 2);
+	lequal((int) (torrent.info.files[0].length + torrent.info.files[1].length), 12);
+	lequal((int) torrent.info.files[0].path_count, 2);
+	lok(torrent.info.files[1].path[0].bytes[0] == 'c');
+	lok(!(torrent.info.present & METAINFO_INFO_LENGTH));
+	
+	bencode_arena_free(&arena);
+}
+
+struct query_matches {
+	struct bencode_match matches[16];
+	size_t count;
+};
+
+static void collect_match(void *ctx, const struct bencode_match *match) {
+	struct query_matches *found = ctx;
+	if(found->count < 16) found->matches[found->count] = *match;
+	found->count++;
+}
+
+void test_query() {
+	const char *paths[] = { "info.files[*].length", "r.nodes", "info.files[1].path[0]", "info.piece length", "info", "[0]", ".info.name", "r.a\\.b" };
+	struct bencode_query query;
+	lequal(bencode_query_compile(&query, paths, sizeof(paths) / sizeof(paths[0])), 0);
+	
+	char *c1 = "d4:infod5:filesld6:lengthi5e4:pathl1:aeed6:lengthi7e4:pathl1:beee4:name3:dir12:piece lengthi16384ee"
+		"1:rd3:a.bi1e5:nodes4:abcdee";
+	struct query_matches found = {0};
+	lequal(bencode_query_run(&query, c1, strlen(c1), collect_match, &found, NULL), BENCODE_OK);
+	lequal((int) found.count, 8);
+	
+	// in the order the values end
+	size_t order[] = { 0, 0, 2, 6, 3, 4, 7, 1 };
+	int in_order = 1;
+	for(size_t k = 0; k < 8; k++) in_order &= (found.matches[k].path == order[k]);
+	lok(in_order);
+	lequal((int) (found.matches[0].i + found.matches[1].i), 12);
+	lok(found.matches[2].type == BENCODE_BYTES && found.matches[2].bytes[0] == 'b');
+	lequal((int) found.matches[4].i, 16384);
+	lok(found.matches[5].type == BENCODE_DICT && found.matches[5].offset == 7 && found.matches[5].bytes[found.matches[5].length - 1] == 'e');
+	lok(found.matches[7].length == 4 && memcmp(found.matches[7].bytes, "abcd", 4) == 0);
+	
+	// errors in skipped parts are still found
+	char *c2 = "d4:infod4:name3:dire1:xli1ei2x";
+	size_t offset;
+	found.count = 0;
+	lequal(bencode_query_run(&query, c2, strlen(c2), collect_match, &found, &offset), BENCODE_ERR_SYNTAX);
+	lequal((int) offset, 27);
+	lequal(bencode_query_run(&query, c1, 20, collect_match, &found, &offset), BENCODE_ERR_EOF);
+	bencode_query_free(&query);
+	
+	const char *invalid[] = { "a[", "a[x]", "[1", "a]b.c[2]x" };
+	int rejected = 0;
+	for(size_t k = 0; k < sizeof(invalid) / sizeof(invalid[0]); k++)
+		rejected += (bencode_query_compile(&query, &invalid[k], 1) == -1);
+	lequal(rejected, 4);
+}
+
+#ifdef BENCODE_THREADS
+struct intern_worker {
+	struct bencode_intern *table;
+	const char *keys[200];
+};
+
+static void* intern_worker_run(void *arg) {
+	struct intern_worker *worker = arg;
+	char key[16];
+	for(int k = 0; k < 200; k++) {
+		int n = sprintf(key, "key%d", k);
+		worker->keys[k] = bencode_intern(worker->table, key, n);
+	}
+	return NULL;
+}
+#endif
+
+void test_intern() {
+	struct bencode_intern table;
+	lok(bencode_intern_init(&table, 64, 4096) == 0);
+	
+	struct bencode_parser parser = {0};
+	parser.intern = &table;
+	
+	char *c1 = "d4:infod6:lengthi42e4:name3:abce5:filesld6:lengthi1eed6:lengthi2eeee";
+	struct bencode a = {0}, b = {0};
+	lok(bencode_parse_with(c1, strlen(c1), &a, &parser) == c1 + strlen(c1));
+	lok(bencode_parse_with(c1, strlen(c1), &b, &parser) == c1 + strlen(c1));
+	
+	// every "length" in both documents is the same copy
+	const char *length = bencode_intern(&table, "length", 6);
+	struct bencode *files = bencode_gets(&a, "files");
+	lok(bencode_gets_interned(bencode_gets(&a, "info"), length) == bencode_gets(bencode_gets(&a, "info"), "length"));
+	lok(bencode_gets_interned(files->list, length)->key == length);
+	lok(bencode_gets_interned(files->list->next, length)->i == 2);
+	lok(bencode_gets(bencode_gets(&b, "info"), "length")->key == length);
+	lok(bencode_gets(&b, "info")->flags & BENCODE_FLAG_INTERNED_KEY);
+	lok(strcmp(length, "length") == 0);
+	lok(bencode_gets_interned(&a, "length") == NULL);
+	lok(bencode_intern(&table, "name", 4) == bencode_gets(&b, "info")->dict->next->key);
+	
+	bencode_free(&a);
+	bencode_free(&b);
+	bencode_intern_free(&table);
+	
+	// a full table falls back to private copies
+	lok(bencode_intern_init(&table, 1, 16) == 0);
+	lok(bencode_intern(&table, "info", 4) != NULL);
+	lok(bencode_intern(&table, "name", 4) == NULL);
+	memset(&a, 0, sizeof(a));
+	lok(bencode_parse_with(c1, strlen(c1), &a, &parser) == c1 + strlen(c1));
+	lok(bencode_gets(&a, "info")->flags & BENCODE_FLAG_INTERNED_KEY);
+	lok(!(bencode_gets(&a, "files")->flags & BENCODE_FLAG_INTERNED_KEY));
+	lok(bencode_gets(&a, "files")->list != NULL);
+	bencode_free(&a);
+	bencode_intern_free(&table);
+	
+	#ifdef BENCODE_THREADS
+	// threads racing to add the same keys agree on every copy
+	lok(bencode_intern_init(&table, 200, 200 * 64) == 0); // room for every thread to lose each race
+	struct intern_worker workers[4];
+	pthread_t threads[4];
+	for(int t = 0; t < 4; t++) {
+		workers[t].table = &table;
+		pthread_create(&threads[t], NULL, intern_worker_run, &workers[t]);
+	}
+	for(int t = 0; t < 4; t++) pthread_join(threads[t], NULL);
+	
+	int agreed = 0;
+	for(int k = 0; k < 200; k++)
+		agreed += (workers[0].keys[k] != NULL && workers[1].keys[k] == workers[0].keys[k]
+			&& workers[2].keys[k] == workers[0].keys[k] && workers[3].keys[k] == workers[0].keys[k]);
+	lequal(agreed, 200);
+	bencode_intern_free(&table);
+	#endif
+}
+
+struct counting_allocator {
+	size_t allocations;
+	size_t frees;
+	size_t budget; // allocations left before returning NULL
+};
+
+static void* counting_malloc(void *ctx, size_t size) {
+	struct counting_allocator *counts = ctx;
+	if(counts->budget == 0) return NULL;
+	counts->budget--;
+	counts->allocations++;
+	return malloc(size);
+}
+
+static void* counting_realloc(void *ctx, void *ptr, size_t size) {
+	if(ptr == NULL) return counting_malloc(ctx, size);
+	return realloc(ptr, size);
+}
+
+static void counting_free(void *ctx, void *ptr) {
+	struct counting_allocator *counts = ctx;
+	if(ptr) counts->frees++;
+	free(ptr);
+}
+
+void test_allocator() {
+	struct counting_allocator counts = { 0, 0, (size_t) -1 };
+	struct bencode_allocator allocator = { counting_malloc, counting_realloc, counting_free, &counts };
+	bencode_set_allocator(&allocator);
+	
+	char *c1 = "d4:infod6:lengthi42e4:name3:abce5:nodesl6:abcdef6:ghijklee";
+	struct bencode b = {0};
+	lok(bencode_parse(c1, strlen(c1), &b) == c1 + strlen(c1));
+	lok(counts.allocations > 0);
+	bencode_free(&b);
+	lequal((int) counts.frees, (int) counts.allocations);
+	
+	// running out of memory part way through fails cleanly
+	struct bencode_parser parser = {0};
+	counts.budget = 3;
+	counts.allocations = counts.frees = 0;
+	memset(&b, 0, sizeof(b));
+	bencode_parse_with(c1, strlen(c1), &b, &parser);
+	lequal(parser.error, BENCODE_ERR_NOMEM);
+	bencode_free(&b);
+	lequal((int) counts.frees, (int) counts.allocations);
+	
+	bencode_set_allocator(NULL);
+}
+
+void test_context() {
+	struct counting_allocator counts = { 0, 0, (size_t) -1 };
+	struct bencode_allocator allocator = { counting_malloc, counting_realloc, counting_free, &counts };
+	bencode_set_allocator(&allocator);
+	
+	// several arena blocks worth of strings, nested deeper than the inline frame stack
+	static char doc[65536];
+	size_t n = 0;
+	for(int k = 0; k < 40; k++) doc[n++] = 'l';
+	for(int k = 0; k < 3000; k++) n += sprintf(doc + n, "d3:key5:v%04de", k);
+	for(int k = 0; k < 40; k++) doc[n++] = 'e';
+	
+	struct bencode_context ctx;
+	bencode_context_init(&ctx, 0);
+	struct bencode b = {0};
+	lok(bencode_parse_context(doc, n, &b, &ctx) == doc + n);
+	lok(ctx.nodes.first->next != NULL && ctx.strings.first != NULL);
+	bencode_reset(&ctx);
+	lok(ctx.nodes.first->next == NULL);
+	
+	// warmed up: the same document, or a smaller one, never touches the heap
+	size_t allocations = counts.allocations;
+	for(int round = 0; round < 3; round++) {
+		memset(&b, 0, sizeof(b));
+		lok(bencode_parse_context(doc, n, &b, &ctx) == doc + n);
+		struct bencode *inner = &b;
+		for(int k = 0; k < 39; k++) inner = inner->list;
+		lok(memcmp(bencode_gets(inner->list, "key")->bytes, "v0000", 5) == 0);
+		bencode_reset(&ctx);
+		
+		char *c1 = "d4:infod6:lengthi42e4:name3:abcee";
+		lok(bencode_parse_context(c1, strlen(c1), &b, &ctx) == c1 + strlen(c1));
+		bencode_reset(&ctx);
+	}
+	lequal((int) counts.allocations, (int) allocations);
+	
+	bencode_context_free(&ctx);
+	lequal((int) counts.frees, (int) counts.allocations);
+	bencode_set_allocator(NULL);
+}
+
+#ifdef BENCODE_STATS
+void test_stats() {
+	bencode_stats_reset();
+	struct bencode_stats stats;
+	bencode_stats_get(&stats);
+	size_t live = stats.live;
+	
+	char *c1 = "d4:infod6:lengthi42e4:name3:abce5:nodesl6:abcdef6:ghijklee";
+	struct bencode b = {0};
+	bencode_parse(c1, strlen(c1), &b);
+	bencode_stats_get(&stats);
+	lequal((int) stats.nodes[BENCODE_DICT], 2);
+	lequal((int) stats.nodes[BENCODE_LIST], 1);
+	lequal((int) stats.nodes[BENCODE_INT], 1);
+	lequal((int) stats.nodes[BENCODE_BYTES], 3);
+	lok(stats.allocations > 0 && stats.bytes > 0);
+	lok(stats.peak >= stats.live && stats.live > live);
+	
+	bencode_free(&b);
+	bencode_stats_get(&stats);
+	lequal((int) stats.frees, (int) stats.allocations);
+	lequal((int) stats.live, (int) live);
+	
+	bencode_stats_reset();
+	char *c2 = "5:hello";
+	bencode_parse(c2, strlen(c2), &b);
+	bencode_stats_get(&stats);
+	lequal((int) (stats.peak - live), (int) stats.bytes); // nothing freed, so the peak is exactly what was allocated
+	bencode_free(&b);
+}
+#endif
+
+#ifdef BENCODE_MMAP
+void test_parse_file() {
+	char *path = "bencode_test_file.tmp";
+	char *c1 = "d4:infod6:lengthi42e4:name3:abce5:nodesl6:abcdef6:ghijklee";
+	size_t n = strlen(c1);
+	
+	FILE *f = fopen(path, "wb");
+	lok(f != NULL);
+	if(f == NULL) return;
+	fwrite(c1, 1, n, f);
+	fclose(f);
+	
+	struct bencode b = {0};
+	struct bencode_file file;
+	struct bencode_parser parser = {0};
+	
+	// copied through the stream
+	char *end = bencode_parse_file(path, &file, &b, &parser);
+	lok(end == file.data + n);
+	lequal(parser.error, BENCODE_OK);
+	bencode_file_close(&file);
+	lequal((int) bencode_gets(bencode_gets(&b, "info"), "length")->i, 42);
+	lok(memcmp(bencode_gets(&b, "nodes")->list->next->bytes, "ghijkl", 6) == 0);
+	bencode_free(&b);
+	
+	// borrowed from the mapping
+	parser.flags = BENCODE_OPT_BORROW;
+	end = bencode_parse_file(path, &file, &b, &parser);
+	lok(end == file.data + n);
+	struct bencode *name = bencode_gets(bencode_gets(&b, "info"), "name");
+	lok(name->flags & BENCODE_FLAG_BORROWED);
+	lok(name->bytes == file.data + 28);
+	bencode_free(&b);
+	bencode_file_close(&file);
+	
+	// errors are reported like any other parse
+	f = fopen(path, "wb");
+	fwrite(c1, 1, 20, f);
+	fclose(f);
+	for(int borrow = 0; borrow < 2; borrow++) {
+		parser.flags = borrow ? BENCODE_OPT_BORROW : 0;
+		end = bencode_parse_file(path, &file, &b, &parser);
+		lok(end != NULL);
+		lequal(parser.error, BENCODE_ERR_EOF);
+		bencode_free(&b);
+		bencode_file_close(&file);
+	}
+	
+	f = fopen(path, "wb");
+	fputs("d1:a1:b1x", f);
+	fclose(f);
+	parser.flags = 0;
+	end = bencode_parse_file(path, &file, &b, &parser);
+	lok(end == file.data + parser.error_offset);
+	lequal(parser.error, BENCODE_ERR_SYNTAX);
+	bencode_free(&b);
+	bencode_file_close(&file);
+	
+	// options the stream does not know about still apply
+	f = fopen(path, "wb");
+	fputs("d1:bi1e1:ai03ee", f);
+	fclose(f);
+	parser.flags = BENCODE_OPT_CANONICAL | BENCODE_OPT_PADDED;
+	end = bencode_parse_file(path, &file, &b, &parser);
+	lequal(parser.error, BENCODE_ERR_CANONICAL);
+	lequal((int) parser.error_offset, 7);
+	lok(end == file.data + 7);
+	bencode_free(&b);
+	bencode_file_close(&file);
+	
+	struct bencode_intern table;
+	bencode_intern_init(&table, 16, 256);
+	parser.flags = 0;
+	parser.intern = &table;
+	end = bencode_parse_file(path, &file, &b, &parser);
+	lok(end == file.data + 15);
+	lequal(parser.error, BENCODE_OK);
+	lok(b.list->flags & BENCODE_FLAG_INTERNED_KEY);
+	lok(b.list->key == bencode_intern(&table, "b", 1));
+	bencode_free(&b);
+	bencode_file_close(&file);
+	bencode_intern_free(&table);
+	parser.intern = NULL;
+	
+	f = fopen(path, "wb");
+	fclose(f);
+	parser.flags = 0;
+	end = bencode_parse_file(path, &file, &b, &parser);
+	lok(end == file.data && file.length == 0);
+	lequal(parser.error, BENCODE_ERR_EOF);
+	bencode_file_close(&file);
+	
+	remove(path);
+	lok(bencode_parse_file(path, &file, &b, &parser) == NULL);
+}
+#endif
+
+#ifdef BENCODE_THREADS
+void test_batch() {
+	static char inputs[1000][48];
+	static struct bencode_message messages[1000];
+	
+	for(int i = 0; i < 1000; i++) {
+		// every seventh message is cut short
+		int n = sprintf(inputs[i], "d2:idi%de4:name5:n%04de", i, i);
+		messages[i].str = inputs[i];
+		messages[i].length = (i % 7 == 3) ? (size_t) n - 3 : (size_t) n;
+	}
+	
+	struct bencode_batch batch;
+	bencode_batch_init(&batch, 4);
+	batch.parser.flags = BENCODE_OPT_BORROW;
+	
+	for(int round = 0; round < 2; round++) {
+		lequal((int) bencode_parse_batch(&batch, messages, 1000), 143);
+		
+		int in_order = 0, failed = 0;
+		for(int i = 0; i < 1000; i++) {
+			struct bencode_message *m = &messages[i];
+			if(i % 7 == 3) {
+				if(m->error == BENCODE_ERR_EOF) failed++;
+				continue;
+			}
+			
+			struct bencode *name = bencode_gets(&m->tree, "name");
+			if(m->end == m->str + m->length && m->error == BENCODE_OK
+				&& bencode_gets(&m->tree, "id")->i == i
+				&& name->bytes == m->str + 16 + (i > 9) + (i > 99)) in_order++;
+		}
+		lequal(in_order, 857);
+		lequal(failed, 143);
+		
+		bencode_batch_reset(&batch);
+	}
+	
+	lequal((int) batch.arena_count, 4);
+	batch.threads = 0; // one per CPU
+	lequal((int) bencode_parse_batch(&batch, messages, 10), 1);
+	lequal((int) bencode_gets(&messages[9].tree, "id")->i, 9);
+	lequal((int) bencode_parse_batch(&batch, messages, 0), 0);
+	
+	bencode_batch_free(&batch);
+}
+
+void test_parallel() {
+	size_t size = 2 * BENCODE_PARALLEL_MIN;
+	char *c1 = malloc(size);
+	char *out = malloc(size);
+	
+	for(int dict = 0; dict < 2; dict++) {
+		size_t n = sprintf(c1, dict ? "d" : "l");
+		for(int i = 0; n < size - 64; i++) {
+			if(dict) n += sprintf(c1 + n, "7:k%06d", i);
+			n += sprintf(c1 + n, "d2:idi%de4:pathl3:dir5:f%04dee", i, i % 10000);
+		}
+		n += sprintf(c1 + n, "e");
+		
+		struct bencode_batch batch;
+		bencode_batch_init(&batch, 4);
+		struct bencode b = {0};
+		
+		lok(bencode_parse_parallel(c1, n, &b, &batch) == c1 + n);
+		lequal(batch.parser.error, BENCODE_OK);
+		lok(b.type == (dict ? BENCODE_DICT : BENCODE_LIST));
+		
+		// every child, in order
+		lok(bencode_encoded_size(&b) == n);
+		lok(bencode_encode(&b, out, size, 0) == out + n);
+		lok(memcmp(out, c1, n) == 0);
+		
+		#ifdef BENCODE_SPANS
+		struct bencode *last = b.list;
+		while(last->next) last = last->next;
+		lequal((int) last->span_end, (int) n - 1);
+		lequal((int) b.span_end, (int) n);
+		lok(last->parent == &b && last->list->parent == last);
+		#endif
+		
+		// errors are found by the skip pass, at the same place as a serial parse
+		char *bad = c1 + n / 2;
+		while(memcmp(bad, "2:idi", 5) != 0) bad++;
+		bad[4] = 'x';
+		
+		struct bencode serial = {0};
+		struct bencode_parser parser = {0};
+		char *serial_end = bencode_parse_with(c1, n, &serial, &parser);
+		bencode_free(&serial);
+		
+		bencode_batch_reset(&batch);
+		lok(bencode_parse_parallel(c1, n, &b, &batch) == serial_end);
+		lequal(batch.parser.error, parser.error);
+		lequal((int) batch.parser.error_offset, (int) parser.error_offset);
+		bad[4] = 'i';
+		
+		// no room for the nested children
+		bencode_batch_reset(&batch);
+		batch.parser.max_depth = 1;
+		lok(bencode_parse_parallel(c1, n, &b, &batch) == c1 + (dict ? 10 : 1));
+		lequal(batch.parser.error, BENCODE_ERR_DEPTH);
+		batch.parser.max_depth = 0;
+		
+		// canonical form is checked by the skip pass, again like a serial parse
+		batch.parser.flags = BENCODE_OPT_CANONICAL;
+		bencode_batch_reset(&batch);
+		lok(bencode_parse_parallel(c1, n, &b, &batch) == c1 + n);
+		lequal(batch.parser.error, BENCODE_OK);
+		
+		parser.flags = BENCODE_OPT_CANONICAL;
+		for(int order = 0; order < 1 + dict; order++) {
+			char *token = c1 + n / 2;
+			while(memcmp(token, order ? "7:k" : "2:idi", order ? 3 : 5) != 0) token++;
+			char saved[6];
+			memcpy(saved, token + 3, 6);
+			if(order) memcpy(token + 3, "000000", 6); // sorts before the key in front of it
+			else token[5] = '0'; // the id has several digits this far in
+			
+			serial_end = bencode_parse_with(c1, n, &serial, &parser);
+			bencode_free(&serial);
+			lequal(parser.error, BENCODE_ERR_CANONICAL);
+			
+			bencode_batch_reset(&batch);
+			lok(bencode_parse_parallel(c1, n, &b, &batch) == serial_end);
+			lequal(batch.parser.error, BENCODE_ERR_CANONICAL);
+			lequal((int) batch.parser.error_offset, (int) parser.error_offset);
+			memcpy(token + 3, saved, 6);
+		}
+		batch.parser.flags = 0;
+		
+		// with one thread it is a plain parse
+		bencode_batch_reset(&batch);
+		batch.threads = 1;
+		lok(bencode_parse_parallel(c1, n, &b, &batch) == c1 + n);
+		lok(bencode_encode(&b, out, size, 0) == out + n);
+		
+		bencode_batch_free(&batch);
+	}
+	
+	free(c1);
+	free(out);
+}
+#endif
+
+#ifdef BENCODE_SPANS
+static void append_span(void *ctx, const void *data, size_t length) {
+	char **out = ctx;
+	memcpy(*out, data, length);
+	*out += length;
+}
+
+void test_spans() {
+	char *c1 = "d8:announce3:url4:infod6:lengthi42e4:name3:abcee";
+	size_t n = strlen(c1);
+	struct bencode b = {0};
+	lok(bencode_parse_test_returns_end_of_str(c1, &b));
+	
+	lok(b.span_begin == 0 && b.span_end == n);
+	struct bencode *info = bencode_gets(&b, "info");
+	lequal((int) info->span_begin, 22);
+	lequal((int) info->span_end, (int) n - 1);
+	lequal((int) bencode_gets(info, "length")->span_begin, 31);
+	lequal((int) bencode_gets(info, "name")->span_end, (int) n - 2);
+	
+	char hashed[64];
+	char *out = hashed;
+	bencode_hash_span(info, c1, append_span, &out);
+	lok(out - hashed == 25 && memcmp(hashed, "d6:lengthi42e4:name3:abce", 25) == 0);
+	bencode_free(&b);
+	
+	// lazily expanded nodes get offsets in the original input too
+	struct bencode_parser parser = {0};
+	parser.flags = BENCODE_OPT_LAZY;
+	lok(bencode_parse_with(c1, n, &b, &parser) == c1 + n);
+	info = bencode_gets(&b, "info");
+	size_t length;
+	lok(bencode_span(info, c1, &length) == c1 + 22 && length == 25);
+	lequal((int) bencode_gets(info, "name")->span_begin, 41);
+	bencode_free(&b);
+	
+	// streams count offsets from the first byte fed
+	struct bencode_stream stream;
+	bencode_stream_init(&stream, &b, NULL);
+	enum bencode_stream_status status = BENCODE_NEED_MORE;
+	for(size_t i = 0; i < n && status == BENCODE_NEED_MORE; i++)
+		status = bencode_stream_feed(&stream, c1 + i, 1, NULL);
+	lequal(status, BENCODE_DONE);
+	info = bencode_gets(&b, "info");
+	lequal((int) info->span_begin, 22);
+	lequal((int) info->span_end, (int) n - 1);
+	lequal((int) bencode_gets(info, "length")->span_end, 35);
+	lequal((int) b.span_end, (int) n);
+	bencode_stream_free(&stream);
+	bencode_free(&b);
+}
+
+void test_patch() {
+	char c1[] = "d11:active_timei100e4:infod6:lengthi42e4:name3:abce6:piecesl3:aaa3:bbbe8:uploadedi5ee";
+	size_t n = strlen(c1);
+	struct bencode b = {0};
+	lok(bencode_parse(c1, n, &b) == c1 + n);
+	
+	char out[256];
+	lok(bencode_patched_size(&b) == n);
+	lok(bencode_encode_patched(&b, c1, out, sizeof(out)) == out + n && memcmp(out, c1, n) == 0);
+	
+	lequal(bencode_set_int(bencode_gets(&b, "uploaded"), 123456), 0);
+	lok(b.flags & BENCODE_FLAG_DIRTY_CHILD);
+	lequal(bencode_set_int(bencode_gets(&b, "pieces"), 1), -1);
+	
+	// untouched values are copied from the input, not serialized: change it under the tree to tell
+	char *expected = "d11:active_timei100e4:infod6:lengthi42e4:name3:xyze6:piecesl3:aaa3:bbbe8:uploadedi123456ee";
+	memcpy(strstr(c1, "abc"), "xyz", 3);
+	size_t size = bencode_patched_size(&b);
+	lequal((int) size, (int) strlen(expected));
+	lok(bencode_encode_patched(&b, c1, out, sizeof(out)) == out + size && memcmp(out, expected, size) == 0);
+	lok(bencode_encode_patched(&b, c1, out, size - 1) == NULL);
+	
+	// nested values, list elements and hand-made nodes
+	struct bencode *info = bencode_gets(&b, "info");
+	lequal(bencode_set_bytes(bencode_gets(info, "name"), "renamed", 7, NULL), 0);
+	lok(info->flags & BENCODE_FLAG_DIRTY_CHILD);
+	struct bencode *pieces = bencode_gets(&b, "pieces");
+	lequal(bencode_set_bytes(pieces->list->next, "ccc", 3, NULL), 0);
+	struct bencode added = {0};
+	added.type = BENCODE_INT;
+	added.i = 7;
+	pieces->list->next->next = &added;
+	bencode_touch(pieces);
+	
+	expected = "d11:active_timei100e4:infod6:lengthi42e4:name7:renamede6:piecesl3:aaa3:ccci7ee8:uploadedi123456ee";
+	size = bencode_patched_size(&b);
+	lequal((int) size, (int) strlen(expected));
+	lok(bencode_encode_patched(&b, c1, out, sizeof(out)) == out + size && memcmp(out, expected, size) == 0);
+	
+	pieces->list->next->next = NULL;
+	bencode_free(&b);
+	
+	// values reached through lazy expansion, in an arena, edited without the parser
+	char *c2 = "d4:infod4:name3:abc6:uploadi5eee";
+	struct bencode_arena arena = {0};
+	struct bencode_parser parser = {0};
+	parser.arena = &arena;
+	lok(bencode_parse_with(c2, strlen(c2), &b, &parser) == c2 + strlen(c2));
+	info = bencode_gets(&b, "info");
+	lequal(bencode_set_int(bencode_gets(info, "upload"), 6), 0);
+	struct bencode *name = bencode_gets(info, "name");
+	lok(name->flags & BENCODE_FLAG_ARENA);
+	lequal(bencode_set_bytes(name, "xy", 2, &parser), 0);
+	lok(name->flags & BENCODE_FLAG_ARENA);
+	
+	expected = "d4:infod4:name2:xy6:uploadi6eee";
+	lok(bencode_encode_patched(&b, c2, out, sizeof(out)) == out + strlen(expected));
+	lok(memcmp(out, expected, strlen(expected)) == 0);
+	
+	lequal(bencode_set_bytes(name, "z", 1, NULL), -1); // nothing would free a heap copy
+	lok(name->flags & BENCODE_FLAG_ARENA);
+	lok(name->length == 2 && memcmp(name->bytes, "xy", 2) == 0);
+	bencode_arena_free(&arena);
+	
+	parser.arena = NULL;
+	parser.flags = BENCODE_OPT_LAZY;
+	lok(bencode_parse_with(c2, strlen(c2), &b, &parser) == c2 + strlen(c2));
+	info = bencode_gets(&b, "info");
+	lequal(bencode_set_int(bencode_gets(info, "upload"), 6), 0);
+	name = bencode_gets(info, "name");
+	lequal(bencode_set_bytes(name, "abc", 3, NULL), 0); // a heap copy, freed with the tree
+	lok(!(name->flags & BENCODE_FLAG_BORROWED) && name->bytes != c2 + 16);
+	expected = "d4:infod4:name3:abc6:uploadi6eee";
+	lok(bencode_encode_patched(&b, c2, out, sizeof(out)) == out + strlen(expected));
+	lok(memcmp(out, expected, strlen(expected)) == 0);
+	bencode_free(&b);
+}
+#endif
+
 #ifdef BENCODE_EXT_WHITESPACE
 void test_whitespace() {
 	struct bencode b = {0};
@@ -282,6 +1670,7 @@ void test_whitespace() {
 int main() {
 	
 	lrun("integer parsing", test_int);
+	lrun("integer overflow", test_int_overflow);
 	lrun("bytes parsing", test_bytes);
 	lrun("sequencing", test_sequence);
 	lrun("lists parsing", test_list_simple);
@@ -290,10 +1679,49 @@ int main() {
 	lrun("dictionary composite parsing", test_dict_composite);
 	lrun("dictionary parsing (with invalid inputs)", test_dict_error);
 	lrun("dictionary get functions", test_dict_retrieve);
+	lrun("dictionary exact key match", test_dict_exact_keys);
+	lrun("dictionary lookup index", test_dict_index);
 	
 	lrun("invalid inputs (bytes and ints)", test_invalid);
 	lrun("invalid inputs (lists)", test_invalid_lists);
 	
+	lrun("arena allocation", test_arena);
+	lrun("borrowed bytes", test_borrowed);
+	lrun("tape documents", test_tape);
+	lrun("compact documents", test_compact);
+	lrun("streaming parser", test_stream);
+	lrun("depth limit", test_depth_limit);
+	lrun("parse errors", test_parse_errors);
+	lrun("canonical form", test_canonical);
+	lrun("padded input", test_padded);
+	lrun("encoding", test_encode);
+	lrun("skipping values", test_skip);
+	lrun("lazy parsing", test_lazy);
+	lrun("validation", test_validate);
+	lrun("generated parsers", test_schema);
+	lrun("path queries", test_query);
+	lrun("key interning", test_intern);
+	lrun("allocator hooks", test_allocator);
+	lrun("parse contexts", test_context);
+	
+	#ifdef BENCODE_MMAP
+	lrun("file parsing", test_parse_file);
+	#endif
+	
+	#ifdef BENCODE_THREADS
+	lrun("batch parsing", test_batch);
+	lrun("parallel parsing", test_parallel);
+	#endif
+	
+	#ifdef BENCODE_SPANS
+	lrun("source spans", test_spans);
+	lrun("patched encoding", test_patch);
+	#endif
+	
+	#ifdef BENCODE_STATS
+	lrun("allocation stats", test_stats);
+	#endif
+	
 	#ifdef BENCODE_EXT_WHITESPACE
 	lrun("extension whitespace", test_whitespace);
 	#endif